@@ -1,6 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <sys/resource.h>
 #include "pe.h"
+#include "pe_coro.h"
+#include "pe_readbuf.h"
+#include "pe_buf.h"
+#include "pe_frame.h"
+#include "pe_overload.h"
+#include "pe_pipe.h"
+#include "pe_admin.h"
+#include "pe_migrate.h"
+#include "pe_upgrade.h"
 
 #define NOT_USED(p) ((void)p)
 
@@ -114,13 +128,2156 @@ TimeEvent_test(void){
 }
 /* ped test =================== End =====================*/
 
+/* coroutine bench =============== Start ===================*/
+#define BENCH_CONNS  64
+#define BENCH_ROUNDS 2000
+#define BENCH_MSG    64
+#define BENCH_COROS  100000
+
+static int bench_active;
+static int bench_rounds[1024];
+
+static long long
+bench_ustime(void){
+    struct timeval tv;
+    gettimeofday(&tv , NULL);
+    return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+void
+bench_client_cb(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    char buf[BENCH_MSG];
+    NOT_USED(clientData);
+    NOT_USED(mask);
+
+    if(read(fd , buf , BENCH_MSG) <= 0 || --bench_rounds[fd] == 0){
+        peDeleteFileEvent(loop , fd , PE_READABLE);
+        close(fd);
+        if(--bench_active == 0) peStop(loop);
+        return;
+    }
+    write(fd , buf , BENCH_MSG);
+}
+
+void
+bench_echo_cb(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    char buf[BENCH_MSG];
+    ssize_t n;
+    NOT_USED(clientData);
+    NOT_USED(mask);
+
+    if((n = read(fd , buf , BENCH_MSG)) <= 0){
+        peDeleteFileEvent(loop , fd , PE_READABLE);
+        close(fd);
+        return;
+    }
+    write(fd , buf , n);
+}
+
+void
+bench_echo_coro(struct peEventLoop *loop , void *arg){
+    int fd = (int)(intptr_t)arg;
+    char buf[BENCH_MSG];
+    ssize_t n;
+    NOT_USED(loop);
+
+    while(peAwaitReadable(fd) != PE_ERR){
+        if((n = read(fd , buf , BENCH_MSG)) <= 0) break;
+        write(fd , buf , n);
+    }
+    close(fd);
+}
+
+void
+bench_yield_coro(struct peEventLoop *loop , void *arg){
+    NOT_USED(arg);
+    peYield();
+    if(--bench_active == 0) peStop(loop);
+}
+
+static long long
+bench_echo_run(int coro){
+    peEventLoop *loop = peCreateEventLoop(1024);
+    char msg[BENCH_MSG] = {0};
+    long long start;
+    int i , sv[2];
+
+    bench_active = BENCH_CONNS;
+    for(i = 0 ; i < BENCH_CONNS ; i++){
+        socketpair(AF_UNIX , SOCK_STREAM , 0 , sv);
+        bench_rounds[sv[0]] = BENCH_ROUNDS;
+        peCreateFileEvent(loop , sv[0] , PE_READABLE , bench_client_cb , NULL);
+        if(coro)
+            peGo(loop , bench_echo_coro , (void *)(intptr_t)sv[1]);
+        else
+            peCreateFileEvent(loop , sv[1] , PE_READABLE , bench_echo_cb , NULL);
+        write(sv[0] , msg , BENCH_MSG);
+    }
+    start = bench_ustime();
+    peMain(loop);
+    /* let the servers see the clients hang up */
+    while(peProcessEvents(loop , PE_ALL_EVENTS|PE_DONT_WAIT) > 0);
+    start = bench_ustime() - start;
+    peDeleteEventLoop(loop);
+    return start;
+}
+
+void
+Coroutine_bench(void){
+    long long cb , co , spawn;
+    double rt = (double)BENCH_CONNS * BENCH_ROUNDS;
+    peEventLoop *loop;
+    int i;
+
+    cb = bench_echo_run(0);
+    co = bench_echo_run(1);
+    printf("echo callbacks  : %lld us , %.0f ns/round trip\n" , cb , cb * 1000.0 / rt);
+    printf("echo coroutines : %lld us , %.0f ns/round trip\n" , co , co * 1000.0 / rt);
+
+    loop = peCreateEventLoop(1024);
+    peSetDeferQueueSize(loop , BENCH_COROS);
+    bench_active = BENCH_COROS;
+    spawn = bench_ustime();
+    for(i = 0 ; i < BENCH_COROS ; i++){
+        if(peGo(loop , bench_yield_coro , NULL) == PE_ERR){
+            printf("peGo failed after %d coroutines\n" , i);
+            bench_active -= BENCH_COROS - i;
+            break;
+        }
+    }
+    spawn = bench_ustime() - spawn;
+    co = bench_ustime();
+    peMain(loop);
+    co = bench_ustime() - co;
+    printf("%d coroutines : spawn %.0f ns each , resume+exit %.0f ns each\n" ,
+           BENCH_COROS , spawn * 1000.0 / BENCH_COROS , co * 1000.0 / BENCH_COROS);
+    peDeleteEventLoop(loop);
+}
+/* coroutine bench ================ End ====================*/
+
+/* pmalloc bench ================= Start ===================*/
+#define ALLOC_OPS   (2 * 1000 * 1000)  /* pmalloc + pfree pairs , split among threads */
+#define ALLOC_SLOTS 64
+
+static void *
+alloc_worker(void *arg){
+    void *slots[ALLOC_SLOTS] = {0};
+    long i , ops = (long)(intptr_t)arg;
+
+    for(i = 0 ; i < ops ; i++){
+        pfree(slots[i % ALLOC_SLOTS]);
+        slots[i % ALLOC_SLOTS] = pmalloc(16 + (i % 7) * 24);
+    }
+    for(i = 0 ; i < ALLOC_SLOTS ; i++) pfree(slots[i]);
+    return NULL;
+}
+
+static int
+alloc_timer_cb(struct peEventLoop *loop , long long id , void *clientData){
+    NOT_USED(loop);
+    NOT_USED(id);
+    NOT_USED(clientData);
+    return PE_NOMORE;
+}
+
+/* request timeouts : armed , then cancelled , with a few live , so the list walk stays small */
+static void
+alloc_timer_bench(void){
+    peEventLoop *loop = peCreateEventLoop(64);
+    long long ids[16] , start;
+    long i;
+
+    for(i = 0 ; i < 16 ; i++) ids[i] = peCreateTimeEvent(loop , 60000 , alloc_timer_cb , NULL , NULL);
+    start = bench_ustime();
+    for(i = 0 ; i < ALLOC_OPS / 4 ; i++){
+        peDeleteTimeEvent(loop , ids[i % 16]);
+        ids[i % 16] = peCreateTimeEvent(loop , 60000 , alloc_timer_cb , NULL , NULL);
+    }
+    start = bench_ustime() - start;
+    printf("timer create+delete : %.0f ns\n" , start * 1000.0 / (ALLOC_OPS / 4));
+    peDeleteEventLoop(loop);
+}
+
+/* an iteration parsing a batch of requests : many small pieces of scratch */
+#define ARENA_PIECES 1000
+#define ARENA_ITERS  2000
+
+static void
+arena_iter_hook(struct peEventLoop *loop , void *clientData){
+    void *pieces[ARENA_PIECES];
+    int i , arena = (int)(intptr_t)clientData;
+
+    for(i = 0 ; i < ARENA_PIECES ; i++){
+        size_t n = 16 + (i * 37) % 200;
+
+        pieces[i] = arena ? peArenaAlloc(loop , n) : pmalloc(n);
+        memset(pieces[i] , 0 , 8);
+    }
+    if(!arena) for(i = 0 ; i < ARENA_PIECES ; i++) pfree(pieces[i]);
+}
+
+static void
+alloc_arena_bench(int arena){
+    peEventLoop *loop = peCreateEventLoop(64);
+    long long start;
+    int i;
+
+    peCreateHook(loop , PE_HOOK_PREPARE , arena_iter_hook , (void *)(intptr_t)arena);
+    start = bench_ustime();
+    for(i = 0 ; i < ARENA_ITERS ; i++) peProcessEvents(loop , PE_ALL_EVENTS|PE_DONT_WAIT);
+    start = bench_ustime() - start;
+    printf("%d scratch allocations per iteration , %s : %.1f us/iteration" , ARENA_PIECES ,
+           arena ? "arena   " : "pmalloc " , (double)start / ARENA_ITERS);
+    if(arena) printf(" , arena memory %zu , high-water %zu" , pmalloc_arena_memory() , loop->arena.highwater);
+    printf("\n");
+    peDeleteEventLoop(loop);
+}
+
+/* millions of small objects , e.g. list nodes and short strings */
+#define SMALL_OBJS (4 * 1000 * 1000)
+#define SMALL_SIZE 24
+
+static void
+alloc_small_bench(void){
+    void **objs = malloc(sizeof(void *) * SMALL_OBJS);
+    size_t rss = pmalloc_get_rss() , used = pmalloc_used_memory();
+    long long start = bench_ustime();
+    long i;
+
+    for(i = 0 ; i < SMALL_OBJS ; i++) objs[i] = pmalloc(SMALL_SIZE);
+    start = bench_ustime() - start;
+    rss = pmalloc_get_rss() - rss;
+    used = pmalloc_used_memory() - used;
+    printf("%s : %d objects of %d bytes , rss +%zu MB (%.1f bytes/object) , accounted %.1f bytes/object , %.0f ns/pmalloc\n" ,
+           PMALLOC_MODE , SMALL_OBJS , SMALL_SIZE , rss >> 20 , (double)rss / SMALL_OBJS ,
+           (double)used / SMALL_OBJS , start * 1000.0 / SMALL_OBJS);
+    start = bench_ustime();
+    for(i = 0 ; i < SMALL_OBJS ; i++) pfree(objs[i]);
+    printf("%s : %.0f ns/pfree\n" , PMALLOC_MODE , (bench_ustime() - start) * 1000.0 / SMALL_OBJS);
+    free(objs);
+}
+
+/* with -DPMALLOC_PROFILE : what is live at the end , by call site */
+static void
+pmalloc_profile_dump(void){
+    char line[256];
+    FILE *fp;
+    void *keep[1000];
+    int i;
+
+    for(i = 0 ; i < 1000 ; i++) keep[i] = i % 2 ? pmalloc(4096) : pstrdup("kept");
+    if(pmalloc_dump_profile("/tmp/pmalloc.heap") == -1 ||
+       pmalloc_dump_sites("/tmp/pmalloc.sites") == -1){
+        printf("profiling not compiled in\n");
+    } else if((fp = fopen("/tmp/pmalloc.sites" , "r")) != NULL){
+        printf("heap profile in /tmp/pmalloc.heap , call sites :\n");
+        for(i = 0 ; i < 8 && fgets(line , sizeof(line) , fp) ; i++) printf("%s" , line);
+        fclose(fp);
+    }
+    for(i = 0 ; i < 1000 ; i++) pfree(keep[i]);
+}
+
+/* memory introspection : kernel reads against sampled values , with
+ * a few thousand mappings for smaps to list */
+#define RSS_MAPS  2000
+#define RSS_CALLS 2000
+
+static double
+rss_time(size_t (*get)(void) , size_t *value){
+    long long start = bench_ustime();
+    int i;
+
+    for(i = 0 ; i < RSS_CALLS ; i++) *value = get();
+    return (bench_ustime() - start) / (double)RSS_CALLS;
+}
+
+static size_t
+rss_smaps_private_dirty(void){
+    char line[1024];
+    size_t pd = 0;
+    FILE *fp = fopen("/proc/self/smaps" , "r");
+
+    if(!fp) return 0;
+    while(fgets(line , sizeof(line) , fp) != NULL)
+        if(strncmp(line , "Private_Dirty:" , 14) == 0) pd += strtol(line + 14 , NULL , 10) * 1024;
+    fclose(fp);
+    return pd;
+}
+
+static void
+alloc_rss_bench(void){
+    static void *maps[RSS_MAPS];
+    size_t rss , pd;
+    double t;
+    int i;
+
+    for(i = 0 ; i < RSS_MAPS ; i++){
+        maps[i] = pmalloc(256 * 1024);
+        memset(maps[i] , 1 , 4096);
+    }
+    t = rss_time(pmalloc_get_rss , &rss);
+    printf("rss           : %.2f us/call from the kernel , %zu MB\n" , t , rss >> 20);
+    t = rss_time(pmalloc_get_private_dirty , &pd);
+    printf("private dirty : %.2f us/call from the kernel , %zu MB\n" , t , pd >> 20);
+    {
+        long long start = bench_ustime();
+        pd = rss_smaps_private_dirty();
+        printf("private dirty : %lld us for a full smaps read , %zu MB\n" , bench_ustime() - start , pd >> 20);
+    }
+    pmalloc_start_sampler(0);
+    t = rss_time(pmalloc_get_rss , &rss);
+    printf("rss           : %.3f us/call sampled , %zu MB\n" , t , rss >> 20);
+    t = rss_time(pmalloc_get_private_dirty , &pd);
+    printf("private dirty : %.3f us/call sampled , %zu MB\n" , t , pd >> 20);
+    pmalloc_stop_sampler();
+    for(i = 0 ; i < RSS_MAPS ; i++) pfree(maps[i]);
+}
+
+void
+Pmalloc_bench(void){
+    pthread_t threads[32];
+    long long start;
+    int i , n;
+
+    alloc_small_bench();
+    alloc_timer_bench();
+    alloc_arena_bench(0);
+    alloc_arena_bench(1);
+    alloc_rss_bench();
+    pmalloc_enable_thread_safeness();
+    for(n = 1 ; n <= 32 ; n *= 2){
+        start = bench_ustime();
+        for(i = 0 ; i < n ; i++)
+            pthread_create(&threads[i] , NULL , alloc_worker , (void *)(intptr_t)(ALLOC_OPS / n));
+        for(i = 0 ; i < n ; i++) pthread_join(threads[i] , NULL);
+        start = bench_ustime() - start;
+        printf("%2d threads : %.1f M pmalloc+pfree/s , used memory %zu\n" , n ,
+               ALLOC_OPS / (double)start , pmalloc_used_memory());
+    }
+    pmalloc_profile_dump();
+}
+/* pmalloc bench ================= End ====================*/
+
+/* read buffer bench ============= Start ===================*/
+#define RB_CONNS    4000
+#define RB_PRIVATE  16384
+
+typedef struct rbConn {
+    peReadBuffer rb;
+    char *priv;
+    size_t privlen;
+} rbConn;
+
+static rbConn rb_conns[RB_CONNS * 2 + 64];
+static int rb_shared;
+
+void
+rb_server_cb(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    rbConn *c = &rb_conns[fd];
+    char *data , *p , *nl;
+    ssize_t n;
+    NOT_USED(clientData);
+    NOT_USED(mask);
+
+    if(rb_shared){
+        n = peReadBufferRead(&c->rb , fd , &data);
+    } else {
+        n = read(fd , c->priv + c->privlen , RB_PRIVATE - c->privlen);
+        if(n > 0) n += c->privlen;
+        data = c->priv;
+    }
+    if(n <= 0){
+        peDeleteFileEvent(loop , fd , PE_READABLE);
+        close(fd);
+        return;
+    }
+    /* answer every complete line , keep the partial one */
+    p = data;
+    while((nl = memchr(p , '\n' , data + n - p)) != NULL){
+        write(fd , p , nl - p + 1);
+        p = nl + 1;
+    }
+    if(rb_shared){
+        peReadBufferKeep(&c->rb , p , data + n - p);
+    } else {
+        memmove(c->priv , p , data + n - p);
+        c->privlen = data + n - p;
+    }
+}
+
+static void
+rb_drain(peEventLoop *loop){
+    while(peProcessEvents(loop , PE_FILE_EVENTS|PE_DONT_WAIT) > 0);
+}
+
+static void
+rb_run(int shared){
+    peEventLoop *loop = peCreateEventLoop(RB_CONNS * 2 + 64);
+    char msg[BENCH_MSG];
+    int client[RB_CONNS] , server[RB_CONNS];
+    size_t base , active , idle;
+    long long start;
+    int i , sv[2];
+
+    rb_shared = shared;
+    memset(msg , 'x' , BENCH_MSG - 1);
+    msg[BENCH_MSG - 1] = '\n';
+    base = pmalloc_used_memory();
+    for(i = 0 ; i < RB_CONNS ; i++){
+        socketpair(AF_UNIX , SOCK_STREAM , 0 , sv);
+        client[i] = sv[0];
+        server[i] = sv[1];
+        if(shared)
+            peReadBufferInit(loop , &rb_conns[sv[1]].rb);
+        else
+            rb_conns[sv[1]].priv = pmalloc(RB_PRIVATE);
+        rb_conns[sv[1]].privlen = 0;
+        peCreateFileEvent(loop , sv[1] , PE_READABLE , rb_server_cb , NULL);
+    }
+
+    /* every connection sees a request in two parts */
+    for(i = 0 ; i < RB_CONNS ; i++) write(client[i] , "GET /" , 5);
+    rb_drain(loop);
+    for(i = 0 ; i < RB_CONNS ; i++) write(client[i] , "\n" , 1);
+    rb_drain(loop);
+    active = pmalloc_used_memory() - base;
+
+    /* all quiet for a while */
+    peSetReadBufferIdle(loop , 50);
+    for(i = 0 ; i < 20 ; i++){
+        peProcessEvents(loop , PE_ALL_EVENTS|PE_DONT_WAIT);
+        usleep(10000);
+    }
+    idle = pmalloc_used_memory() - base;
+
+    bench_active = BENCH_CONNS;
+    for(i = 0 ; i < BENCH_CONNS ; i++){
+        char junk[64];
+
+        while(read(client[i] , junk , sizeof(junk)) == sizeof(junk));
+        bench_rounds[client[i]] = BENCH_ROUNDS;
+        peCreateFileEvent(loop , client[i] , PE_READABLE , bench_client_cb , NULL);
+        write(client[i] , msg , BENCH_MSG);
+    }
+    start = bench_ustime();
+    peMain(loop);
+    start = bench_ustime() - start;
+
+    printf("%s : %zu bytes/conn after a request , %zu bytes/conn idle , "
+           "%.0f ns/round trip\n" , shared ? "shared buffer " : "private buffer" ,
+           active / RB_CONNS , idle / RB_CONNS ,
+           start * 1000.0 / ((double)BENCH_CONNS * BENCH_ROUNDS));
+
+    for(i = 0 ; i < RB_CONNS ; i++){
+        if(i >= BENCH_CONNS) close(client[i]);
+        peDeleteFileEvent(loop , server[i] , PE_READABLE);
+        close(server[i]);
+        if(shared)
+            peReadBufferFree(&rb_conns[server[i]].rb);
+        else
+            pfree(rb_conns[server[i]].priv);
+    }
+    peDeleteEventLoop(loop);
+}
+
+void
+ReadBuffer_bench(void){
+    rb_run(0);
+    rb_run(1);
+}
+/* read buffer bench ============== End ====================*/
+
+/* broadcast bench =============== Start ===================*/
+#define BC_SUBS  1000
+#define BC_MSGS  64
+#define BC_SIZE  1024
+
+static peBufQueue bc_queues[BC_SUBS * 2 + 64];
+static size_t bc_received[BC_SUBS * 2 + 64];
+static int bc_pending;
+
+void
+bc_write_cb(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    NOT_USED(loop);
+    NOT_USED(clientData);
+    NOT_USED(mask);
+
+    if(peBufQueueFlush(&bc_queues[fd]) == PE_ERR) peBufQueueFree(&bc_queues[fd]);
+}
+
+void
+bc_read_cb(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    static char buf[65536];
+    ssize_t n;
+    NOT_USED(clientData);
+    NOT_USED(mask);
+
+    while((n = read(fd , buf , sizeof(buf))) > 0){
+        bc_received[fd] += n;
+        if(bc_received[fd] == BC_MSGS * BC_SIZE && --bc_pending == 0) peStop(loop);
+    }
+}
+
+static void
+bc_run(int shared){
+    peEventLoop *loop = peCreateEventLoop(BC_SUBS * 2 + 64);
+    int client[BC_SUBS] , server[BC_SUBS];
+    char msg[BC_SIZE];
+    long long publish , total;
+    size_t base , peak;
+    int i , j , sv[2];
+
+    memset(msg , 'm' , BC_SIZE);
+    for(i = 0 ; i < BC_SUBS ; i++){
+        int sndbuf = BC_SIZE * 4;
+
+        socketpair(AF_UNIX , SOCK_STREAM , 0 , sv);
+        /* slow subscribers: most of the backlog stays in the queues */
+        setsockopt(sv[1] , SOL_SOCKET , SO_SNDBUF , &sndbuf , sizeof(sndbuf));
+        fcntl(sv[0] , F_SETFL , O_NONBLOCK);
+        fcntl(sv[1] , F_SETFL , O_NONBLOCK);
+        client[i] = sv[0];
+        server[i] = sv[1];
+        bc_received[sv[0]] = 0;
+        peBufQueueInit(loop , &bc_queues[sv[1]] , sv[1] , bc_write_cb , NULL);
+    }
+    bc_pending = BC_SUBS;
+
+    base = pmalloc_used_memory();
+    total = publish = bench_ustime();
+    for(j = 0 ; j < BC_MSGS ; j++){
+        peBuf *buf = shared ? peBufCreate(msg , BC_SIZE) : NULL;
+
+        for(i = 0 ; i < BC_SUBS ; i++){
+            if(shared){
+                peBufQueuePush(&bc_queues[server[i]] , buf , 0 , BC_SIZE);
+            } else {
+                peBuf *copy = peBufCreate(msg , BC_SIZE);
+
+                peBufQueuePush(&bc_queues[server[i]] , copy , 0 , BC_SIZE);
+                peBufRelease(copy);
+            }
+        }
+        if(shared) peBufRelease(buf);
+        /* the publisher yields to the loop between messages */
+        peProcessEvents(loop , PE_ALL_EVENTS|PE_DONT_WAIT);
+    }
+    publish = bench_ustime() - publish;
+    peak = pmalloc_used_memory() - base;
+
+    for(i = 0 ; i < BC_SUBS ; i++)
+        peCreateFileEvent(loop , client[i] , PE_READABLE , bc_read_cb , NULL);
+    peMain(loop);
+    total = bench_ustime() - total;
+
+    printf("%s : publish %lld us , queued %zu KB , delivered in %lld us\n" ,
+           shared ? "shared buffers" : "copies        " , publish , peak / 1024 , total);
+
+    for(i = 0 ; i < BC_SUBS ; i++){
+        peBufQueueFree(&bc_queues[server[i]]);
+        peDeleteFileEvent(loop , client[i] , PE_READABLE);
+        close(client[i]);
+        close(server[i]);
+    }
+    peDeleteEventLoop(loop);
+}
+
+void
+Broadcast_bench(void){
+    bc_run(0);
+    bc_run(1);
+}
+/* broadcast bench ================ End ====================*/
+
+/* framing bench ================= Start ===================*/
+#define FR_SIZE   (32 * 1024 * 1024)
+#define FR_LOOPS  4
+
+static double
+fr_run(const char *data , size_t len , int type){
+    peFrame frames[PE_FRAME_BATCH];
+    peFramer framer;
+    long long start;
+    size_t off , consumed;
+    int i , n;
+
+    start = bench_ustime();
+    for(i = 0 ; i < FR_LOOPS ; i++){
+        peFramerInit(&framer , type , 0);
+        off = 0;
+        do{
+            n = peFramerDecode(&framer , data + off , len - off ,
+                               frames , PE_FRAME_BATCH , &consumed);
+            off += consumed;
+        }while(n > 0);
+    }
+    start = bench_ustime() - start;
+    return (double)len * FR_LOOPS / start / 1000.0;
+}
+
+void
+Frame_bench(void){
+    const char *names[] = {"scalar" , "sse2  " , "avx2  "};
+    char *data = pmalloc(FR_SIZE);
+    size_t len;
+    int level , framelen;
+
+    for(framelen = 16 ; framelen <= 4096 ; framelen *= 16){
+        for(len = 0 ; len + framelen <= FR_SIZE ; len += framelen){
+            memset(data + len , 'a' + len % 26 , framelen - 2);
+            data[len + framelen - 2] = '\r';
+            data[len + framelen - 1] = '\n';
+        }
+        for(level = PE_FRAME_SCALAR ; level <= PE_FRAME_AVX2 ; level++){
+            if(peFrameSetSimd(level) != level) continue;
+            printf("%4d byte frames , %s : LF %.2f GB/s , CRLF %.2f GB/s\n" ,
+                   framelen , names[level] , fr_run(data , len , PE_FRAME_LF) ,
+                   fr_run(data , len , PE_FRAME_CRLF));
+        }
+    }
+    peFrameSetSimd(-1);
+    pfree(data);
+}
+/* framing bench ================== End ====================*/
+
+/* background job bench ========== Start ===================*/
+#define JOB_WORK 2000
+
+static volatile unsigned long job_sink;
+
+int
+job_step(struct peEventLoop *loop , void *clientData){
+    int i;
+    NOT_USED(loop);
+    NOT_USED(clientData);
+
+    /* a slice of incremental work , e.g. rehashing a few buckets */
+    for(i = 0 ; i < JOB_WORK ; i++) job_sink += i;
+    return 0;
+}
+
+int
+job_stop_cb(struct peEventLoop *loop , long long id , void *clientData){
+    NOT_USED(id);
+    NOT_USED(clientData);
+    peStop(loop);
+    return PE_NOMORE;
+}
+
+static void
+job_run(int withjob , int traffic){
+    peEventLoop *loop = peCreateEventLoop(1024);
+    char msg[BENCH_MSG] = {0};
+    long long job = -1 , start;
+    peJobStats stats;
+    int i , sv[2];
+
+    memset(&stats , 0 , sizeof(stats));
+    if(withjob) job = peCreateBackgroundJob(loop , job_step , NULL);
+    if(traffic){
+        bench_active = BENCH_CONNS;
+        for(i = 0 ; i < BENCH_CONNS ; i++){
+            socketpair(AF_UNIX , SOCK_STREAM , 0 , sv);
+            bench_rounds[sv[0]] = BENCH_ROUNDS;
+            peCreateFileEvent(loop , sv[0] , PE_READABLE , bench_client_cb , NULL);
+            peCreateFileEvent(loop , sv[1] , PE_READABLE , bench_echo_cb , NULL);
+            write(sv[0] , msg , BENCH_MSG);
+        }
+    } else {
+        peCreateTimeEvent(loop , 200 , job_stop_cb , NULL , NULL);
+    }
+    start = bench_ustime();
+    peMain(loop);
+    start = bench_ustime() - start;
+    if(withjob) peGetBackgroundJobStats(loop , job , &stats);
+
+    printf("%s , %s : %lld us" , traffic ? "echo traffic" : "idle        " ,
+           withjob ? "job   " : "no job" , start);
+    if(traffic)
+        printf(" , %.0f ns/round trip" , start * 1000.0 / ((double)BENCH_CONNS * BENCH_ROUNDS));
+    if(withjob)
+        printf(" , %llu steps , %.0f%% of the time , max lag %lld us" , stats.steps ,
+               stats.usec * 100.0 / start , stats.maxlag);
+    printf("\n");
+    if(traffic) while(peProcessEvents(loop , PE_ALL_EVENTS|PE_DONT_WAIT) > 0);
+    peDeleteEventLoop(loop);
+}
+
+static int job_left;
+
+/* a compaction that runs out of work : parks itself until there is more */
+int
+job_parking_step(struct peEventLoop *loop , void *clientData){
+    NOT_USED(loop);
+    NOT_USED(clientData);
+    if(job_left == 0) return PE_JOB_IDLE;
+    job_left--;
+    return 0;
+}
+
+int
+job_finite_step(struct peEventLoop *loop , void *clientData){
+    job_step(loop , clientData);
+    return --job_left ? 0 : PE_NOMORE;
+}
+
+static long long
+job_cpu_usec(void){
+    struct rusage ru;
+    getrusage(RUSAGE_SELF , &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* An idle loop with a job : the job either keeps the loop polling , or
+ * parks and lets it block. A finished job still reports its stats. */
+static void
+job_idle_run(peJobProc *proc , const char *name){
+    peEventLoop *loop = peCreateEventLoop(64);
+    long long job , wall , cpu;
+    peJobStats stats;
+
+    job_left = 1000;
+    job = peCreateBackgroundJob(loop , proc , NULL);
+    peCreateTimeEvent(loop , 200 , job_stop_cb , NULL , NULL);
+    wall = bench_ustime();
+    cpu = job_cpu_usec();
+    peMain(loop);
+    cpu = job_cpu_usec() - cpu;
+    wall = bench_ustime() - wall;
+    memset(&stats , 0 , sizeof(stats));
+    if(peGetBackgroundJobStats(loop , job , &stats) == PE_ERR) printf("no stats for %s\n" , name);
+    printf("idle         , %s : %lld us , %.0f%% cpu , %llu steps , %s\n" , name , wall , cpu * 100.0 / wall ,
+           stats.steps , stats.finished ? "finished" : "not finished");
+    peDeleteEventLoop(loop);
+}
+
+void
+Job_bench(void){
+    job_run(1 , 0);
+    job_run(0 , 1);
+    job_run(1 , 1);
+    job_idle_run(job_parking_step , "parked job");
+    job_idle_run(job_finite_step , "finite job");
+}
+/* background job bench =========== End ====================*/
+
+/* overload bench ================ Start ===================*/
+#define OV_BULK     32
+#define OV_REQ      64
+#define OV_COST     20    /* usec of work per bulk request */
+#define OV_RUN      1000  /* ms per mode */
+
+static int ov_bulk[OV_BULK] , ov_ctl[2];
+static volatile int ov_running;
+static long long ov_served , ov_ctlcount , ov_ctlsum , ov_ctlmax;
+
+static void *
+ov_feeder(void *arg){
+    char req[OV_REQ * 16] = {0};
+    long long lastctl = 0;
+    int i;
+    NOT_USED(arg);
+
+    /* bulk clients send as fast as the server lets them , every request
+     * stamped with its send time , a control client sends a timestamp
+     * every 2 ms */
+    while(ov_running){
+        long long now = bench_ustime();
+        for(i = 0 ; i < OV_REQ * 16 ; i += OV_REQ) memcpy(req + i , &now , sizeof(now));
+        for(i = 0 ; i < OV_BULK ; i++) write(ov_bulk[i] , req , sizeof(req));
+        if(bench_ustime() - lastctl >= 2000){
+            lastctl = bench_ustime();
+            write(ov_ctl[0] , &lastctl , sizeof(lastctl));
+        }
+        usleep(100);
+    }
+    return NULL;
+}
+
+void
+ov_bulk_cb(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    char buf[4096];
+    ssize_t n , i;
+    long long t;
+    NOT_USED(loop);
+    NOT_USED(clientData);
+    NOT_USED(mask);
+
+    if((n = read(fd , buf , sizeof(buf))) <= 0) return;
+    for(i = 0 ; i + OV_REQ <= n ; i += OV_REQ){
+        t = bench_ustime();
+        while(bench_ustime() - t < OV_COST);
+        ov_served++;
+    }
+}
+
+void
+ov_ctl_cb(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    long long ts[64] , now = bench_ustime();
+    ssize_t n , i;
+    NOT_USED(loop);
+    NOT_USED(clientData);
+    NOT_USED(mask);
+
+    if((n = read(fd , ts , sizeof(ts))) <= 0) return;
+    for(i = 0 ; i < n / (ssize_t)sizeof(long long) ; i++){
+        ov_ctlcount++;
+        ov_ctlsum += now - ts[i];
+        if(now - ts[i] > ov_ctlmax) ov_ctlmax = now - ts[i];
+    }
+}
+
+static void
+ov_run(int protect){
+    peEventLoop *loop = peCreateEventLoop(1024);
+    peOverload *ov = NULL;
+    pthread_t feeder;
+    int i , sv[2] , sndbuf = 16384;
+
+    ov_served = ov_ctlcount = ov_ctlsum = ov_ctlmax = 0;
+    for(i = 0 ; i < OV_BULK ; i++){
+        socketpair(AF_UNIX , SOCK_STREAM , 0 , sv);
+        fcntl(sv[0] , F_SETFL , O_NONBLOCK);
+        setsockopt(sv[0] , SOL_SOCKET , SO_SNDBUF , &sndbuf , sizeof(sndbuf));
+        ov_bulk[i] = sv[0];
+        peCreateFileEvent(loop , sv[1] , PE_READABLE , ov_bulk_cb , NULL);
+        peSetFileEventPriority(loop , sv[1] , PE_PRIO_LOW);
+    }
+    socketpair(AF_UNIX , SOCK_STREAM , 0 , ov_ctl);
+    fcntl(ov_ctl[0] , F_SETFL , O_NONBLOCK);
+    peCreateFileEvent(loop , ov_ctl[1] , PE_READABLE , ov_ctl_cb , NULL);
+    peSetFileEventPriority(loop , ov_ctl[1] , PE_PRIO_HIGH);
+    peCreateTimeEvent(loop , OV_RUN , job_stop_cb , NULL , NULL);
+    if(protect){
+        ov = peCreateOverload(loop , NULL , NULL);
+        peSetOverloadThresholds(ov , 5 , 5000 , 20);
+    }
+
+    ov_running = 1;
+    pthread_create(&feeder , NULL , ov_feeder , NULL);
+    peMain(loop);
+    ov_running = 0;
+    pthread_join(feeder , NULL);
+
+    printf("%s : %lld bulk requests/s , control latency avg %lld us max %lld us" ,
+           protect ? "shedding   " : "no shedding" , ov_served * 1000 / OV_RUN ,
+           ov_ctlcount ? ov_ctlsum / ov_ctlcount : 0 , ov_ctlmax);
+    if(ov) printf(" , %llu overload episodes" , ov->episodes);
+    printf("\n");
+    if(ov) peDeleteOverload(ov);
+    for(i = 0 ; i <= loop->maxfd ; i++){
+        if(loop->events[i].mask != PE_NONE) close(i);
+    }
+    for(i = 0 ; i < OV_BULK ; i++) close(ov_bulk[i]);
+    close(ov_ctl[0]);
+    peDeleteEventLoop(loop);
+}
+
+/* A server that reads whatever arrives into an unbounded user space queue
+ * and works it off in slices : without shedding the queue , and the wait
+ * of every request , only grows , and hardly any reply makes its
+ * deadline. Shedding keeps the backlog in the kernel , where it pushes
+ * back on the clients. */
+#define OVQ_SLO    20000 /* usec a request may wait to count as goodput */
+#define OVQ_SLICE  5000  /* usec of queued work per iteration */
+
+static long long *ovq , ovq_good , ovq_max;
+static size_t ovq_head , ovq_tail , ovq_size;
+
+void
+ovq_read_cb(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    char buf[4096];
+    ssize_t n , i;
+    NOT_USED(loop);
+    NOT_USED(clientData);
+    NOT_USED(mask);
+
+    if((n = read(fd , buf , sizeof(buf))) <= 0) return;
+    for(i = 0 ; i + OV_REQ <= n ; i += OV_REQ){
+        if(ovq_tail == ovq_size){
+            ovq_size = ovq_size ? ovq_size * 2 : 1024;
+            ovq = prealloc(ovq , ovq_size * sizeof(long long));
+        }
+        memcpy(&ovq[ovq_tail++] , buf + i , sizeof(long long));
+    }
+    if((long long)(ovq_tail - ovq_head) > ovq_max) ovq_max = ovq_tail - ovq_head;
+}
+
+static void
+ovq_work(struct peEventLoop *loop , void *clientData){
+    long long start = bench_ustime() , t;
+    NOT_USED(loop);
+    NOT_USED(clientData);
+
+    while(ovq_head < ovq_tail && (t = bench_ustime()) - start < OVQ_SLICE){
+        if(t - ovq[ovq_head] <= OVQ_SLO) ovq_good++;
+        ovq_head++;
+        while(bench_ustime() - t < OV_COST);
+        ov_served++;
+    }
+    if(ovq_head == ovq_tail) ovq_head = ovq_tail = 0;
+}
+
+static void
+ovq_run(int protect){
+    peEventLoop *loop = peCreateEventLoop(1024);
+    peOverload *ov = NULL;
+    pthread_t feeder;
+    int i , sv[2] , sndbuf = 16384;
+
+    ov_served = ovq_good = ovq_max = 0;
+    ovq_head = ovq_tail = 0;
+    for(i = 0 ; i < OV_BULK ; i++){
+        socketpair(AF_UNIX , SOCK_STREAM , 0 , sv);
+        fcntl(sv[0] , F_SETFL , O_NONBLOCK);
+        setsockopt(sv[0] , SOL_SOCKET , SO_SNDBUF , &sndbuf , sizeof(sndbuf));
+        ov_bulk[i] = sv[0];
+        peCreateFileEvent(loop , sv[1] , PE_READABLE , ovq_read_cb , NULL);
+        peSetFileEventPriority(loop , sv[1] , PE_PRIO_LOW);
+    }
+    socketpair(AF_UNIX , SOCK_STREAM , 0 , ov_ctl);
+    fcntl(ov_ctl[0] , F_SETFL , O_NONBLOCK);
+    peCreateFileEvent(loop , ov_ctl[1] , PE_READABLE , ov_ctl_cb , NULL);
+    peSetFileEventPriority(loop , ov_ctl[1] , PE_PRIO_HIGH);
+    /* after the poll , so the slice counts as iteration work */
+    peCreateHook(loop , PE_HOOK_CHECK , ovq_work , NULL);
+    peCreateTimeEvent(loop , OV_RUN , job_stop_cb , NULL , NULL);
+    if(protect){
+        ov = peCreateOverload(loop , NULL , NULL);
+        peSetOverloadThresholds(ov , 5 , OVQ_SLICE / 2 , 20);
+    }
+
+    ov_running = 1;
+    pthread_create(&feeder , NULL , ov_feeder , NULL);
+    peMain(loop);
+    ov_running = 0;
+    pthread_join(feeder , NULL);
+
+    printf("%s , queue : %lld requests/s , goodput %lld requests/s within %d ms , longest queue %lld\n" ,
+           protect ? "shedding   " : "no shedding" , ov_served * 1000 / OV_RUN ,
+           ovq_good * 1000 / OV_RUN , OVQ_SLO / 1000 , ovq_max);
+    if(ov) peDeleteOverload(ov);
+    for(i = 0 ; i <= loop->maxfd ; i++){
+        if(loop->events[i].mask != PE_NONE) close(i);
+    }
+    for(i = 0 ; i < OV_BULK ; i++) close(ov_bulk[i]);
+    close(ov_ctl[0]);
+    peDeleteEventLoop(loop);
+    pfree(ovq);
+    ovq = NULL;
+    ovq_size = 0;
+}
+
+void
+Overload_bench(void){
+    ov_run(0);
+    ov_run(1);
+    ovq_run(0);
+    ovq_run(1);
+}
+/* overload bench ================= End ====================*/
+
+/* pipe bench ==================== Start ===================*/
+#define PIPE_MSGS   (4 * 1024 * 1024)
+
+static unsigned long pipe_sent , pipe_recv , pipe_sum;
+static int pipe_batch;
+
+void
+pipe_consume(struct peEventLoop *loop , pePipe *pipe , void **msgs , int count , void *clientData){
+    int i;
+    NOT_USED(pipe);
+    NOT_USED(clientData);
+
+    for(i = 0 ; i < count ; i++){
+        /* messages are sequence numbers : check the order on the way */
+        if((uintptr_t)msgs[i] != pipe_recv + 1) printf("pipe : out of order message\n");
+        pipe_recv++;
+        pipe_sum += (uintptr_t)msgs[i];
+    }
+    if(pipe_recv == PIPE_MSGS) peStop(loop);
+}
+
+void
+pipe_produce(struct peEventLoop *loop , pePipe *pipe , void *clientData){
+    void *msgs[PE_PIPE_BATCH];
+    int i , n , count;
+    NOT_USED(clientData);
+
+    /* write until the ring is full , the writable callback resumes */
+    while(pipe_sent < PIPE_MSGS){
+        count = pipe_batch;
+        if(count > (int)(PIPE_MSGS - pipe_sent)) count = PIPE_MSGS - pipe_sent;
+        for(i = 0 ; i < count ; i++) msgs[i] = (void *)(uintptr_t)(pipe_sent + i + 1);
+        n = pePipeWrite(pipe , msgs , count);
+        pipe_sent += n;
+        if(n < count) return;
+    }
+    peStop(loop);
+}
+
+static void
+pipe_start(struct peEventLoop *loop , void *clientData){
+    pipe_produce(loop , clientData , NULL);
+}
+
+static void *
+pipe_thread(void *arg){
+    peMain(arg);
+    return NULL;
+}
+
+static void
+pipe_run(int batch){
+    peEventLoop *producer = peCreateEventLoop(64) , *consumer = peCreateEventLoop(64);
+    pePipe *pipe = peCreatePipe(producer , consumer , 0 , pipe_consume , pipe_produce , NULL);
+    pthread_t threads[2];
+    long long start;
+
+    pipe_batch = batch;
+    pipe_sent = pipe_recv = pipe_sum = 0;
+    peRunInLoop(producer , pipe_start , pipe);
+    start = bench_ustime();
+    pthread_create(&threads[0] , NULL , pipe_thread , consumer);
+    pthread_create(&threads[1] , NULL , pipe_thread , producer);
+    pthread_join(threads[0] , NULL);
+    pthread_join(threads[1] , NULL);
+    start = bench_ustime() - start;
+
+    printf("batch %3d : %.1f Mmsg/s , %llu wakeups , %s\n" , batch ,
+           PIPE_MSGS / (double)start , pipe->wakeups ,
+           pipe_sum == (unsigned long)PIPE_MSGS * (PIPE_MSGS + 1) / 2 ? "checksum ok" : "checksum MISMATCH");
+    peDeletePipe(pipe);
+    peDeleteEventLoop(producer);
+    peDeleteEventLoop(consumer);
+}
+
+void
+Pipe_bench(void){
+    pipe_run(1);
+    pipe_run(16);
+    pipe_run(PE_PIPE_BATCH);
+}
+/* pipe bench ==================== End ====================*/
+
+/* admin bench =================== Start ===================*/
+#define ADMIN_IDLE  2000  /* idle connections making the fd table large */
+#define ADMIN_PATH  "/tmp/pe_admin_bench.sock"
+
+static volatile int admin_running , admin_done;
+static long long admin_scrapes , admin_scrapeusec , admin_maxiter;
+static char admin_last[8192];
+
+static void
+admin_query(const char *req , char *reply , size_t size){
+    struct sockaddr_un sa;
+    size_t len = 0;
+    ssize_t n;
+    int fd = socket(AF_UNIX , SOCK_STREAM , 0);
+
+    memset(&sa , 0 , sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path , ADMIN_PATH);
+    if(connect(fd , (struct sockaddr *)&sa , sizeof(sa)) == 0){
+        write(fd , req , strlen(req));
+        while(len < size - 1 && (n = read(fd , reply + len , size - 1 - len)) > 0) len += n;
+    }
+    reply[len] = '\0';
+    close(fd);
+}
+
+static void *
+admin_scraper(void *arg){
+    char reply[sizeof(admin_last)];
+    long long t;
+    NOT_USED(arg);
+
+    while(admin_running){
+        t = bench_ustime();
+        admin_query(admin_scrapes % 2 ? "stats\r\n" : "GET /metrics HTTP/1.0\r\n\r\n" ,
+                    reply , sizeof(reply));
+        admin_scrapeusec += bench_ustime() - t;
+        if(admin_scrapes++ % 2) memcpy(admin_last , reply , sizeof(reply));
+        usleep(5000);
+    }
+    admin_done = 1;
+    return NULL;
+}
+
+static void
+admin_iter_hook(struct peEventLoop *loop , void *clientData){
+    NOT_USED(clientData);
+    if(loop->iterusec > admin_maxiter) admin_maxiter = loop->iterusec;
+}
+
+static void
+admin_run(int scrape){
+    peEventLoop *loop = peCreateEventLoop(8192);
+    char msg[BENCH_MSG] = {0};
+    peAdmin *admin = NULL;
+    pthread_t scraper;
+    long long start;
+    int i , sv[2] , idle[ADMIN_IDLE * 2];
+
+    peSetAccounting(loop , 1);
+    peSetIterationTiming(loop , 1);
+    peCreateHook(loop , PE_HOOK_PREPARE , admin_iter_hook , NULL);
+    bench_active = BENCH_CONNS;
+    for(i = 0 ; i < BENCH_CONNS ; i++){
+        socketpair(AF_UNIX , SOCK_STREAM , 0 , sv);
+        bench_rounds[sv[0]] = BENCH_ROUNDS * 5;
+        peCreateFileEvent(loop , sv[0] , PE_READABLE , bench_client_cb , NULL);
+        peCreateFileEvent(loop , sv[1] , PE_READABLE , bench_echo_cb , NULL);
+        write(sv[0] , msg , BENCH_MSG);
+    }
+    for(i = 0 ; i < ADMIN_IDLE ; i++){
+        socketpair(AF_UNIX , SOCK_STREAM , 0 , &idle[i * 2]);
+        peCreateFileEvent(loop , idle[i * 2] , PE_READABLE , bench_echo_cb , NULL);
+    }
+    admin_scrapes = admin_scrapeusec = admin_maxiter = 0;
+    admin_done = 0;
+    if(scrape){
+        admin = peCreateAdmin(loop , ADMIN_PATH , 5);
+        admin_running = 1;
+        pthread_create(&scraper , NULL , admin_scraper , NULL);
+    }
+    start = bench_ustime();
+    peMain(loop);
+    start = bench_ustime() - start;
+    if(scrape){
+        admin_running = 0;
+        /* serve the last request while the scraper finishes */
+        while(!admin_done) peProcessEvents(loop , PE_ALL_EVENTS|PE_DONT_WAIT);
+        pthread_join(scraper , NULL);
+        peDeleteAdmin(admin);
+    }
+
+    printf("%s : %.0f ns/round trip" , scrape ? "scraped    " : "not scraped" ,
+           start * 1000.0 / ((double)BENCH_CONNS * BENCH_ROUNDS * 5));
+    printf(" , longest iteration %lld us" , admin_maxiter);
+    if(scrape)
+        printf(" , %lld scrapes , %lld us each" , admin_scrapes ,
+               admin_scrapes ? admin_scrapeusec / admin_scrapes : 0);
+    printf("\n");
+    while(peProcessEvents(loop , PE_ALL_EVENTS|PE_DONT_WAIT) > 0);
+    for(i = 0 ; i < ADMIN_IDLE * 2 ; i++) close(idle[i]);
+    peDeleteEventLoop(loop);
+}
+
+void
+Admin_bench(void){
+    admin_run(0);
+    admin_run(1);
+    printf("last plain text reply :\n%s" , admin_last);
+}
+/* admin bench =================== End ====================*/
+
+/* memory watermark bench ========= Start ==================*/
+#define MEM_BLOCK  (256*1024)
+#define MEM_BLOCKS 1024
+#define MEM_SOFT   (32*1024*1024)
+#define MEM_HARD   (48*1024*1024)
+
+static void *mem_cache[MEM_BLOCKS];
+static int mem_cached = 0 , mem_level = PMALLOC_LEVEL_OK , mem_allocated = 0;
+static int mem_notified[3];
+static size_t mem_peak = 0;
+
+static void
+mem_evict(int keep){
+    while(mem_cached > keep) pfree(mem_cache[--mem_cached]);
+}
+
+/* cache fill : one block per call , unless memory is tight */
+static int
+mem_fill(struct peEventLoop *loop , long long id , void *clientData){
+    size_t used = pmalloc_used_memory();
+    NOT_USED(id);
+    NOT_USED(clientData);
+
+    if(used > mem_peak) mem_peak = used;
+    if(mem_allocated == MEM_BLOCKS){
+        peStop(loop);
+        return PE_NOMORE;
+    }
+    if(mem_level == PMALLOC_LEVEL_HARD || mem_cached == MEM_BLOCKS) return 1;
+    mem_cache[mem_cached++] = pmalloc(MEM_BLOCK);
+    mem_allocated++;
+    return 1;
+}
+
+static void
+mem_proc(struct peEventLoop *loop , int level , size_t used , void *clientData){
+    NOT_USED(loop);
+    NOT_USED(clientData);
+
+    mem_level = level;
+    mem_notified[level]++;
+    /* soft : shed half the cache , hard : stop filling and shed it all */
+    if(level == PMALLOC_LEVEL_SOFT) mem_evict(mem_cached / 2);
+    if(level == PMALLOC_LEVEL_HARD) mem_evict(0);
+    if(mem_notified[0] + mem_notified[1] + mem_notified[2] <= 8)
+        printf("level %d at %zu MB , cache now %d blocks\n" , level , used >> 20 , mem_cached);
+}
+
+static double
+mem_alloc_rate(void){
+    long long start = bench_ustime();
+    int i;
+
+    for(i = 0 ; i < 10000000 ; i++) pfree(pmalloc(64));
+    return 10000000 / (double)(bench_ustime() - start);
+}
+
+void
+Memory_bench(void){
+    peEventLoop *loop = peCreateEventLoop(64);
+    size_t base = pmalloc_used_memory();
+    double off , on;
+
+    pmalloc_enable_thread_safeness();
+    off = mem_alloc_rate();
+    pmalloc_set_watermarks(base + MEM_SOFT , base + MEM_HARD);
+    on = mem_alloc_rate();
+    printf("pmalloc+pfree : %.1f M/s without watermarks , %.1f M/s with\n" , off , on);
+
+    peSetMemoryProc(loop , mem_proc , NULL);
+    peCreateTimeEvent(loop , 1 , mem_fill , NULL , NULL);
+    peMain(loop);
+    printf("%d blocks of %d KB allocated , peak %zu MB (hard mark %d MB) , %d soft %d hard %d ok notifications\n" ,
+           mem_allocated , MEM_BLOCK / 1024 , (mem_peak - base) >> 20 , MEM_HARD >> 20 ,
+           mem_notified[PMALLOC_LEVEL_SOFT] , mem_notified[PMALLOC_LEVEL_HARD] , mem_notified[PMALLOC_LEVEL_OK]);
+    mem_evict(0);
+    pmalloc_set_watermarks(0 , 0);
+    peDeleteEventLoop(loop);
+}
+/* memory watermark bench ========= End ====================*/
+
+/* allocator bench ================ Start ==================*/
+/* producer loops allocate messages of mixed sizes and pipe them to a
+ * consumer loop , which keeps the last AP_KEEP at random slots and frees
+ * the ones they replace : every free is done by another thread than the
+ * allocation , and the live set keeps churning over all sizes */
+#define AP_PRODUCERS 2
+#define AP_MSGS      2000000
+#define AP_KEEP      65536
+#define AP_BATCH     16
+
+typedef struct apProducer {
+    peEventLoop *loop;
+    pePipe *pipe;
+    unsigned long sent;
+    unsigned int seed;
+    void *pending[AP_BATCH];
+    int npending;
+} apProducer;
+
+static void *ap_keep[AP_KEEP];
+static unsigned long ap_recv;
+static unsigned int ap_seed;
+static size_t ap_used , ap_rss;
+
+static unsigned int
+ap_rand(unsigned int *seed){
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+/* 3 in 4 small (16 - 256 bytes) , the rest up to 4KB */
+static size_t
+ap_size(unsigned int r){
+    return (r & 3) ? 16 + (r >> 8) % 240 : 256 + (r >> 8) % 3840;
+}
+
+static void
+ap_consume(struct peEventLoop *loop , pePipe *pipe , void **msgs , int count , void *clientData){
+    int i;
+    NOT_USED(pipe);
+    NOT_USED(clientData);
+
+    for(i = 0 ; i < count ; i++){
+        unsigned int slot = ap_rand(&ap_seed) % AP_KEEP;
+
+        pfree(ap_keep[slot]);
+        ap_keep[slot] = msgs[i];
+    }
+    ap_recv += count;
+    /* steady state , before the first producer is done */
+    if(ap_used == 0 && ap_recv >= (unsigned long)AP_MSGS * AP_PRODUCERS / 2){
+        ap_used = pmalloc_used_memory();
+        ap_rss = pmalloc_get_rss();
+    }
+    if(ap_recv == (unsigned long)AP_MSGS * AP_PRODUCERS) peStop(loop);
+}
+
+static void
+ap_produce(struct peEventLoop *loop , pePipe *pipe , void *clientData){
+    apProducer *p = clientData;
+    int n;
+
+    while(p->sent < AP_MSGS){
+        while(p->npending < AP_BATCH && p->sent + p->npending < AP_MSGS){
+            size_t size = ap_size(ap_rand(&p->seed));
+            char *msg = pmalloc(size);
+
+            memset(msg , 0 , 16);
+            p->pending[p->npending++] = msg;
+        }
+        n = pePipeWrite(pipe , p->pending , p->npending);
+        p->sent += n;
+        if(n < p->npending){
+            memmove(p->pending , p->pending + n , (p->npending - n) * sizeof(void *));
+            p->npending -= n;
+            return;
+        }
+        p->npending = 0;
+    }
+    peStop(loop);
+}
+
+static void
+ap_start(struct peEventLoop *loop , void *clientData){
+    apProducer *p = clientData;
+
+    ap_produce(loop , p->pipe , p);
+}
+
+void
+Allocator_bench(void){
+    peEventLoop *consumer;
+    apProducer producers[AP_PRODUCERS];
+    pthread_t threads[AP_PRODUCERS + 1];
+    size_t used , rss;
+    long long start;
+    int i;
+
+    pmalloc_enable_thread_safeness();
+    consumer = peCreateEventLoop(64);
+    memset(ap_keep , 0 , sizeof(ap_keep));
+    ap_recv = 0;
+    ap_seed = 1;
+    ap_used = ap_rss = 0;
+    for(i = 0 ; i < AP_PRODUCERS ; i++){
+        apProducer *p = &producers[i];
+
+        memset(p , 0 , sizeof(*p));
+        p->seed = 12345 + i;
+        p->loop = peCreateEventLoop(64);
+        p->pipe = peCreatePipe(p->loop , consumer , 0 , ap_consume , ap_produce , p);
+        peRunInLoop(p->loop , ap_start , p);
+    }
+
+    start = bench_ustime();
+    pthread_create(&threads[0] , NULL , pipe_thread , consumer);
+    for(i = 0 ; i < AP_PRODUCERS ; i++)
+        pthread_create(&threads[i + 1] , NULL , pipe_thread , producers[i].loop);
+    for(i = 0 ; i <= AP_PRODUCERS ; i++) pthread_join(threads[i] , NULL);
+    start = bench_ustime() - start;
+
+    printf("%s : %d producer loops , %.2f M msgs/s , half way : live %zu MB , rss %zu MB , rss/used %.2f\n" ,
+           PMALLOC_MODE , AP_PRODUCERS , (double)AP_MSGS * AP_PRODUCERS / start ,
+           ap_used >> 20 , ap_rss >> 20 , (double)ap_rss / ap_used);
+    used = pmalloc_used_memory();
+    rss = pmalloc_get_rss();
+    printf("%s : at the end : live %zu MB , rss %zu MB , rss/used %.2f\n" ,
+           PMALLOC_MODE , used >> 20 , rss >> 20 , (double)rss / used);
+    for(i = 0 ; i < AP_KEEP ; i++) pfree(ap_keep[i]);
+    printf("%s : rss %zu MB once the live set is freed\n" , PMALLOC_MODE , pmalloc_get_rss() >> 20);
+#if defined(USE_PTALLOC)
+    {
+        ptalloc_stats stats;
+
+        ptalloc_get_stats(&stats);
+        printf("ptalloc : %zu spans (%zu empty , %zu released) , %zu remote frees , %zu central batches , %zu large , %d caches\n" ,
+               stats.spans + stats.empty , stats.empty , stats.released ,
+               stats.remote , stats.central , stats.large , stats.caches);
+    }
+#endif
+    for(i = 0 ; i < AP_PRODUCERS ; i++){
+        peDeletePipe(producers[i].pipe);
+        peDeleteEventLoop(producers[i].loop);
+    }
+    peDeleteEventLoop(consumer);
+}
+/* allocator bench ================ End ====================*/
+
+/* large table bench ============== Start ==================*/
+/* dispatch-like random accesses to a setsize-sized events table , from
+ * pmalloc and from pmalloc_large , and the tables of a big loop */
+#define LT_SETSIZE  (1 << 20)
+#define LT_ACCESSES 20000000
+
+static const char *
+lt_backing(int backing){
+    static const char *names[] = { "heap" , "pages" , "thp" , "hugetlb" };
+    return names[backing];
+}
+
+static double
+lt_walk(peFileEvent *events){
+    unsigned int seed = 2463534242U;
+    unsigned long long sum = 0;
+    long long start;
+    int i;
+
+    memset(events , 0 , sizeof(peFileEvent) * LT_SETSIZE);
+    start = bench_ustime();
+    for(i = 0 ; i < LT_ACCESSES ; i++){
+        peFileEvent *fe = &events[ap_rand(&seed) & (LT_SETSIZE - 1)];
+
+        /* the next fd depends on this load , as in a dispatch loop */
+        sum += fe->mask;
+        seed ^= (unsigned int)fe->calls++ & 1;
+    }
+    start = bench_ustime() - start;
+    if(sum) printf("unexpected mask\n");
+    return start * 1000.0 / LT_ACCESSES;
+}
+
+void
+LargeTable_bench(void){
+    size_t size = sizeof(peFileEvent) * LT_SETSIZE;
+    peFileEvent *plain = pmalloc(size) , *large;
+    peEventLoop *loop;
+    double t;
+
+    t = lt_walk(plain);
+    printf("%d MB events table , pmalloc       : %.1f ns/access\n" , (int)(size >> 20) , t);
+    pfree(plain);
+    large = pmalloc_large(size , PMALLOC_LARGE_HUGE|PMALLOC_LARGE_LOCAL);
+    t = lt_walk(large);
+    printf("%d MB events table , pmalloc_large : %.1f ns/access , %s , node %d\n" , (int)(size >> 20) , t ,
+           lt_backing(pmalloc_large_backing(large)) , pmalloc_large_node(large));
+    pfree_large(large);
+
+    loop = peCreateEventLoop(LT_SETSIZE);
+    printf("loop of setsize %d : events %s , fired %s , node %d\n" , LT_SETSIZE ,
+           lt_backing(pmalloc_large_backing(loop->events)) ,
+           lt_backing(pmalloc_large_backing(loop->fired)) , pmalloc_large_node(loop->events));
+    peDeleteEventLoop(loop);
+    loop = peCreateEventLoop(64);
+    printf("loop of setsize 64 : events %s\n" , lt_backing(pmalloc_large_backing(loop->events)));
+    peDeleteEventLoop(loop);
+}
+/* large table bench ============== End ====================*/
+
+/* shared loop bench ============== Start ==================*/
+#define SH_CONNS  64
+#define SH_ROUNDS 200
+#define SH_LIGHT  20   /* usec of work per light request */
+#define SH_HEAVY  1000 /* usec of work per heavy request */
+#define SH_HOT    8    /* heavy connections */
+
+typedef struct sh_conn {
+    int fd;          /* client end */
+    int heavy;
+    int rounds;
+    long long sent;
+} sh_conn;
+
+static sh_conn sh_conns[SH_CONNS];
+static long long sh_lat[SH_CONNS * SH_ROUNDS];
+static int sh_nlat , sh_finished , sh_threads;
+
+static void
+sh_spin(long long usec){
+    long long end = bench_ustime() + usec;
+    while(bench_ustime() < end);
+}
+
+/* server side : one byte in , some work , one byte out */
+static void
+sh_serve(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    char c;
+    NOT_USED(loop);
+    NOT_USED(mask);
+
+    if(read(fd , &c , 1) != 1) return;
+    sh_spin(clientData ? SH_HEAVY : SH_LIGHT);
+    if(write(fd , &c , 1) != 1) return;
+}
+
+static void
+sh_reply(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    sh_conn *conn = clientData;
+    long long now;
+    char c;
+    NOT_USED(mask);
+
+    if(read(fd , &c , 1) != 1) return;
+    now = bench_ustime();
+    if(!conn->heavy) sh_lat[sh_nlat++] = now - conn->sent;
+    if(++conn->rounds == SH_ROUNDS){
+        peDeleteFileEvent(loop , fd , PE_READABLE);
+        if(++sh_finished == SH_CONNS) peStop(loop);
+        return;
+    }
+    conn->sent = now;
+    if(write(fd , "x" , 1) != 1) return;
+}
+
+static void *
+sh_shared_thread(void *arg){
+    peMainShared(arg , sh_threads);
+    return NULL;
+}
+
+static int
+sh_cmp(const void *a , const void *b){
+    long long x = *(const long long *)a , y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* The heavy connections are among the ones that spreading connections
+ * round robin over the loops puts on the first loop */
+static void
+sh_run(int shared){
+    peEventLoop *client = peCreateEventLoop(1024) , *loops[64];
+    pthread_t threads[64];
+    int sv[2] , i , nloops = shared ? 1 : sh_threads;
+    long long start;
+
+    for(i = 0 ; i < nloops ; i++) loops[i] = peCreateEventLoop(1024);
+    sh_nlat = sh_finished = 0;
+    for(i = 0 ; i < SH_CONNS ; i++){
+        socketpair(AF_UNIX , SOCK_STREAM , 0 , sv);
+        sh_conns[i].fd = sv[0];
+        sh_conns[i].heavy = i % sh_threads == 0 && i / sh_threads < SH_HOT;
+        sh_conns[i].rounds = 0;
+        peCreateFileEvent(loops[i % nloops] , sv[1] , PE_READABLE , sh_serve ,
+                          sh_conns[i].heavy ? (void *)1 : NULL);
+        peCreateFileEvent(client , sv[0] , PE_READABLE , sh_reply , &sh_conns[i]);
+    }
+    for(i = 0 ; i < nloops ; i++)
+        pthread_create(&threads[i] , NULL , shared ? sh_shared_thread : pipe_thread , loops[i]);
+
+    start = bench_ustime();
+    for(i = 0 ; i < SH_CONNS ; i++){
+        sh_conns[i].sent = start;
+        if(write(sh_conns[i].fd , "x" , 1) != 1) return;
+    }
+    peMain(client);
+    start = bench_ustime() - start;
+
+    for(i = 0 ; i < nloops ; i++){
+        peStop(loops[i]);
+        pthread_join(threads[i] , NULL);
+    }
+    qsort(sh_lat , sh_nlat , sizeof(long long) , sh_cmp);
+    printf("%-22s : %6.0f req/s , light requests p50 %5lld us p99 %6lld us\n" ,
+           shared ? "peMainShared" : "one loop per thread" ,
+           SH_CONNS * SH_ROUNDS * 1000000.0 / start , sh_lat[sh_nlat / 2] , sh_lat[sh_nlat * 99 / 100]);
+
+    for(i = 0 ; i < SH_CONNS ; i++) close(sh_conns[i].fd);
+    for(i = 0 ; i < nloops ; i++){
+        int fd;
+        for(fd = 0 ; fd <= loops[i]->maxfd ; fd++)
+            if(loops[i]->events[fd].mask != PE_NONE) close(fd);
+        peDeleteEventLoop(loops[i]);
+    }
+    peDeleteEventLoop(client);
+}
+
+void
+Shared_bench(void){
+    sh_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(sh_threads < 2) sh_threads = 2;
+    if(sh_threads > 64) sh_threads = 64;
+    printf("%d threads , %d connections , %d heavy (%d us vs %d us per request)\n" ,
+           sh_threads , SH_CONNS , SH_HOT , SH_HEAVY , SH_LIGHT);
+    sh_run(0);
+    sh_run(1);
+}
+/* shared loop bench =============== End ====================*/
+
+/* restart bench ================== Start ==================*/
+#define UP_ADDR    "/tmp/pe_upgrade_bench.sock"
+#define UP_CTL     "/tmp/pe_upgrade_bench.ctl"
+#define UP_STARTUP 50000 /* usec of initialization of the new process */
+#define UP_BEFORE  1000  /* connections before the restart */
+#define UP_AFTER   1000  /* connections served by the new process */
+
+static peEventLoop *up_oldloop , *volatile up_newloop;
+static peListener *up_oldlistener , *up_newlistener;
+static volatile int up_served[2] , up_oldclosed , up_newdone;
+static long long up_first;
+
+/* one request per connection : echo a byte and hang up */
+static void
+up_echo(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    char c;
+    NOT_USED(clientData);
+    NOT_USED(mask);
+
+    if(read(fd , &c , 1) == 1 && write(fd , &c , 1) != 1) c = 0;
+    peDeleteFileEvent(loop , fd , PE_READABLE);
+    close(fd);
+}
+
+static void
+up_accept(struct peEventLoop *loop , int fd , struct sockaddr *sa , socklen_t salen , void *clientData){
+    NOT_USED(sa);
+    NOT_USED(salen);
+    (*(volatile int *)clientData)++;
+    peCreateFileEvent(loop , fd , PE_READABLE , up_echo , NULL);
+}
+
+static void
+up_old_proc(struct peEventLoop *loop , struct peUpgrade *upgrade , int event , void *clientData){
+    NOT_USED(loop);
+    NOT_USED(upgrade);
+    NOT_USED(clientData);
+    if(event == PE_UPGRADE_FAILED) printf("handoff failed\n");
+}
+
+static void
+up_inherit(struct peEventLoop *loop , int type , int fd , const char *data , size_t len , void *clientData){
+    NOT_USED(len);
+    NOT_USED(clientData);
+    if(type == PE_UPGRADE_LISTENER)
+        up_newlistener = peCreateListenerFromFd(loop , fd , data , NULL , up_accept , (void *)&up_served[1]);
+    else
+        close(fd);
+}
+
+static void
+up_close_old(struct peEventLoop *loop , void *clientData){
+    NOT_USED(loop);
+    NOT_USED(clientData);
+    peDeleteListener(up_oldlistener);
+    up_oldclosed = 1;
+}
+
+/* The new process : a cold restart starts once the old one stopped
+ * listening , a handoff while it still serves */
+static void *
+up_new_thread(void *arg){
+    peEventLoop *loop;
+    int handoff = *(int *)arg;
+    long long start;
+
+    if(!handoff){
+        peRunInLoop(up_oldloop , up_close_old , NULL);
+        while(!up_oldclosed) usleep(100);
+    }
+    start = bench_ustime();
+    loop = peCreateEventLoop(1024);
+    usleep(UP_STARTUP);
+    if(handoff)
+        peUpgradeInherit(loop , UP_CTL , up_inherit , NULL);
+    else
+        up_newlistener = peCreateListener(loop , UP_ADDR , 128 , NULL , up_accept , (void *)&up_served[1]);
+    up_newloop = loop;
+    peMain(loop);
+    up_first = up_newlistener && up_newlistener->stats.firstaccept ?
+               up_newlistener->stats.firstaccept - start : -1;
+    peDeleteEventLoop(loop);
+    up_newdone = 1;
+    return NULL;
+}
+
+static int
+up_request(void){
+    struct sockaddr_un sa;
+    int fd = socket(AF_UNIX , SOCK_STREAM , 0) , ok = 0;
+    char c = 'x';
+
+    memset(&sa , 0 , sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path , UP_ADDR);
+    if(connect(fd , (struct sockaddr *)&sa , sizeof(sa)) == 0 &&
+       write(fd , &c , 1) == 1 && read(fd , &c , 1) == 1)
+        ok = 1;
+    close(fd);
+    return ok;
+}
+
+static void
+up_run(int handoff){
+    peUpgrade *upgrade = NULL;
+    pthread_t old , new;
+    int i = 0 , dropped = 0;
+    long long deadline;
+
+    up_served[0] = up_served[1] = up_oldclosed = up_newdone = 0;
+    up_newlistener = NULL;
+    up_newloop = NULL;
+    up_oldloop = peCreateEventLoop(1024);
+    up_oldlistener = peCreateListener(up_oldloop , UP_ADDR , 128 , NULL , up_accept , (void *)&up_served[0]);
+    if(handoff) upgrade = peUpgradeListen(up_oldloop , UP_CTL , up_old_proc , NULL);
+    pthread_create(&old , NULL , pipe_thread , up_oldloop);
+
+    deadline = bench_ustime() + 5000000;
+    while(up_served[1] < UP_AFTER && bench_ustime() < deadline){
+        if(i++ == UP_BEFORE) pthread_create(&new , NULL , up_new_thread , &handoff);
+        if(!up_request()) dropped++;
+    }
+
+    /* until the new process is running , a stop would be lost */
+    while(!up_newdone){
+        if(up_newloop) peStop(up_newloop);
+        usleep(1000);
+    }
+    pthread_join(new , NULL);
+    peStop(up_oldloop);
+    pthread_join(old , NULL);
+    if(upgrade) peUpgradeClose(upgrade);
+    printf("%-12s : first accept %6lld us after start (%d us of init) , %d requests , %d by the old process , %d dropped\n" ,
+           handoff ? "handoff" : "cold restart" , up_first , UP_STARTUP , i , up_served[0] , dropped);
+    peDeleteEventLoop(up_oldloop);
+    unlink(UP_ADDR);
+}
+
+void
+Upgrade_bench(void){
+    up_run(0);
+    up_run(1);
+}
+/* restart bench =================== End ====================*/
+
+/* loop test ===================== Start ==================*/
+static int lt_failed = 0;
+static int lt_order[16] , lt_served = 0;
+
+static void
+lt_check(int cond , const char *name){
+    printf("%-48s %s\n" , name , cond ? "ok" : "FAIL");
+    if(!cond) lt_failed++;
+}
+
+static void
+lt_read(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    char c;
+    NOT_USED(loop);
+    NOT_USED(mask);
+
+    if(read(fd , &c , 1) != 1) c = -1;
+    if(lt_served < 16) lt_order[lt_served] = (int)(long)clientData;
+    lt_served++;
+}
+
+/* n socketpairs with one byte waiting on sv[i][0] */
+static void
+lt_pairs(int (*sv)[2] , int n){
+    int i;
+    for(i = 0 ; i < n ; i++){
+        socketpair(AF_UNIX , SOCK_STREAM , 0 , sv[i]);
+        if(write(sv[i][1] , "x" , 1) != 1) lt_check(0 , "socketpair write");
+    }
+}
+
+static void
+lt_close(int (*sv)[2] , int n){
+    int i;
+    for(i = 0 ; i < n ; i++){
+        close(sv[i][0]);
+        close(sv[i][1]);
+    }
+}
+
+static void
+lt_priority(void){
+    peEventLoop *loop = peCreateEventLoop(64);
+    int sv[3][2] , prio[3] = {PE_PRIO_LOW , PE_PRIO_NORMAL , PE_PRIO_HIGH} , i;
+
+    lt_pairs(sv , 3);
+    for(i = 0 ; i < 3 ; i++){
+        peCreateFileEvent(loop , sv[i][0] , PE_READABLE , lt_read , (void *)(long)i);
+        peSetFileEventPriority(loop , sv[i][0] , prio[i]);
+    }
+    lt_served = 0;
+    peProcessEvents(loop , PE_FILE_EVENTS|PE_DONT_WAIT);
+    lt_check(lt_served == 3 && lt_order[0] == 2 && lt_order[1] == 1 && lt_order[2] == 0 ,
+             "priority : high , normal , low");
+    lt_close(sv , 3);
+    peDeleteEventLoop(loop);
+}
+
+static void
+lt_budget(void){
+    peEventLoop *loop = peCreateEventLoop(64);
+    int sv[3][2] , i , once = 1;
+
+    lt_pairs(sv , 3);
+    for(i = 0 ; i < 3 ; i++)
+        peCreateFileEvent(loop , sv[i][0] , PE_READABLE , lt_read , (void *)(long)i);
+    peSetProcessBudget(loop , 1 , 0);
+    lt_served = 0;
+    for(i = 0 ; i < 3 ; i++){
+        peProcessEvents(loop , PE_FILE_EVENTS|PE_DONT_WAIT);
+        if(lt_served != i + 1) once = 0;
+    }
+    lt_check(once , "budget : one callback per iteration");
+    lt_check(lt_served == 3 && lt_order[0] != lt_order[1] && lt_order[1] != lt_order[2] &&
+             lt_order[0] != lt_order[2] , "budget : carried over fds all served once");
+    peProcessEvents(loop , PE_FILE_EVENTS|PE_DONT_WAIT);
+    lt_check(lt_served == 3 , "budget : nothing left after the carry over");
+    lt_close(sv , 3);
+    peDeleteEventLoop(loop);
+}
+
+/* An fd deleted while its event is carried over , whose number is then
+ * reused : the new owner must not get the old event */
+static void
+lt_stale(void){
+    peEventLoop *loop = peCreateEventLoop(64);
+    int sv[2][2] , fresh[2] , i , victim;
+
+    lt_pairs(sv , 2);
+    for(i = 0 ; i < 2 ; i++)
+        peCreateFileEvent(loop , sv[i][0] , PE_READABLE , lt_read , (void *)(long)i);
+    peSetProcessBudget(loop , 1 , 0);
+    lt_served = 0;
+    peProcessEvents(loop , PE_FILE_EVENTS|PE_DONT_WAIT);
+    victim = lt_order[0] == 0 ? 1 : 0;
+    peDeleteFileEvent(loop , sv[victim][0] , PE_READABLE);
+    close(sv[victim][0]);
+    close(sv[victim][1]);
+    socketpair(AF_UNIX , SOCK_STREAM , 0 , fresh);
+    lt_check(fresh[0] == sv[victim][0] || fresh[1] == sv[victim][0] , "stale : fd number reused");
+    peCreateFileEvent(loop , fresh[0] , PE_READABLE , lt_read , (void *)(long)7);
+    peCreateFileEvent(loop , fresh[1] , PE_READABLE , lt_read , (void *)(long)7);
+    for(i = 0 ; i < 3 ; i++) peProcessEvents(loop , PE_FILE_EVENTS|PE_DONT_WAIT);
+    lt_check(lt_served == 1 , "stale : reused fd not served an old event");
+    close(fresh[0]);
+    close(fresh[1]);
+    close(sv[!victim][0]);
+    close(sv[!victim][1]);
+    peDeleteEventLoop(loop);
+}
+
+static char lt_trace[64];
+static int lt_tracelen = 0;
+static long long lt_idlehook = -1;
+
+static void
+lt_hook(struct peEventLoop *loop , void *clientData){
+    NOT_USED(loop);
+    if(lt_tracelen < 63) lt_trace[lt_tracelen++] = *(char *)clientData;
+}
+
+static void
+lt_idle_once(struct peEventLoop *loop , void *clientData){
+    lt_hook(loop , clientData);
+    peDeleteHook(loop , lt_idlehook);
+}
+
+static int
+lt_never(struct peEventLoop *loop , long long id , void *clientData){
+    NOT_USED(loop);
+    NOT_USED(id);
+    NOT_USED(clientData);
+    return PE_NOMORE;
+}
+
+/* An idle loop blocked in the poll would never run its idle hooks : they
+ * must run within the iteration , long before the guard timer fires */
+static void
+lt_hooks(void){
+    peEventLoop *loop = peCreateEventLoop(64);
+    int sv[2];
+    long long start;
+
+    socketpair(AF_UNIX , SOCK_STREAM , 0 , sv);
+    peCreateFileEvent(loop , sv[0] , PE_READABLE , lt_read , NULL);
+    peCreateTimeEvent(loop , 1000 , lt_never , NULL , NULL);
+    peCreateHook(loop , PE_HOOK_PREPARE , lt_hook , "p");
+    peCreateHook(loop , PE_HOOK_CHECK , lt_hook , "c");
+    lt_idlehook = peCreateHook(loop , PE_HOOK_IDLE , lt_idle_once , "i");
+    lt_tracelen = 0;
+    start = bench_ustime();
+    peProcessEvents(loop , PE_ALL_EVENTS);
+    lt_trace[lt_tracelen] = '\0';
+    lt_check(!strcmp(lt_trace , "pci") , "hooks : prepare , check , idle in order");
+    lt_check(bench_ustime() - start < 500000 , "hooks : idle loop does not block");
+
+    /* the idle hook deleted itself , a busy iteration skips idle hooks */
+    lt_idlehook = peCreateHook(loop , PE_HOOK_IDLE , lt_idle_once , "j");
+    if(write(sv[1] , "x" , 1) != 1) lt_check(0 , "socketpair write");
+    lt_tracelen = 0;
+    lt_served = 0;
+    peProcessEvents(loop , PE_FILE_EVENTS|PE_DONT_WAIT);
+    lt_trace[lt_tracelen] = '\0';
+    lt_check(lt_served == 1 && !strcmp(lt_trace , "pc") , "hooks : no idle hook on a busy iteration");
+    peDeleteHook(loop , lt_idlehook);
+    close(sv[0]);
+    close(sv[1]);
+    peDeleteEventLoop(loop);
+}
+
+static int lt_deferred = 0;
+
+static void
+lt_defer(struct peEventLoop *loop , void *clientData){
+    NOT_USED(loop);
+    NOT_USED(clientData);
+    lt_deferred++;
+}
+
+static void
+lt_defer_again(struct peEventLoop *loop , void *clientData){
+    lt_defer(loop , clientData);
+    if(lt_deferred < 3) peDefer(loop , lt_defer_again , NULL);
+}
+
+static void
+lt_defer_ring(void){
+    peEventLoop *loop = peCreateEventLoop(64);
+    int i , ok = 1;
+
+    lt_check(peSetDeferQueueSize(loop , 3) == PE_OK , "defer : ring resized");
+    for(i = 0 ; i < 4 ; i++)
+        if(peDefer(loop , lt_defer , NULL) != PE_OK) ok = 0;
+    lt_check(ok , "defer : ring rounded up to 4 slots");
+    lt_check(peDefer(loop , lt_defer , NULL) == PE_ERR , "defer : full ring refuses");
+    lt_check(peSetDeferQueueSize(loop , 64) == PE_ERR , "defer : busy ring not resized");
+    lt_deferred = 0;
+    peProcessEvents(loop , PE_ALL_EVENTS|PE_DONT_WAIT);
+    lt_check(lt_deferred == 4 , "defer : queued callbacks run once");
+
+    /* a callback deferring itself runs once per iteration */
+    lt_deferred = 0;
+    peDefer(loop , lt_defer_again , NULL);
+    for(i = 0 ; i < 3 ; i++){
+        peProcessEvents(loop , PE_ALL_EVENTS|PE_DONT_WAIT);
+        if(lt_deferred != i + 1) ok = 0;
+    }
+    lt_check(ok , "defer : re-deferred callback waits an iteration");
+    peDeleteEventLoop(loop);
+}
+
+#define LT_PATH  "/tmp/pe_loop_test.sock"
+#define LT_CONNS 10
+
+static int lt_accepted = 0;
+
+static void
+lt_accept(struct peEventLoop *loop , int fd , struct sockaddr *sa , socklen_t salen , void *clientData){
+    NOT_USED(loop);
+    NOT_USED(sa);
+    NOT_USED(salen);
+    NOT_USED(clientData);
+    lt_accepted++;
+    close(fd);
+}
+
+static int
+lt_connect(void){
+    struct sockaddr_un sa;
+    int fd = socket(AF_UNIX , SOCK_STREAM , 0);
+
+    memset(&sa , 0 , sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path , LT_PATH);
+    if(connect(fd , (struct sockaddr *)&sa , sizeof(sa)) == -1) lt_check(0 , "listener connect");
+    return fd;
+}
+
+static void
+lt_listener(void){
+    peEventLoop *loop = peCreateEventLoop(1024);
+    peListenerOptions opts = {4 , 0 , 0 , 0};
+    peListener *listener = peCreateListener(loop , LT_PATH , 64 , &opts , lt_accept , NULL);
+    int conns[LT_CONNS * 2] , i , spare;
+    unsigned long long wakeups;
+    struct rlimit rl , tight;
+    long long start;
+
+    for(i = 0 ; i < LT_CONNS ; i++) conns[i] = lt_connect();
+    lt_accepted = 0;
+    peProcessEvents(loop , PE_FILE_EVENTS|PE_DONT_WAIT);
+    lt_check(lt_accepted == 4 && listener->stats.lastbatch == 4 , "listener : one batch per wakeup");
+    for(i = 0 ; i < 3 ; i++) peProcessEvents(loop , PE_FILE_EVENTS|PE_DONT_WAIT);
+    lt_check(lt_accepted == LT_CONNS && listener->stats.wakeups == 3 , "listener : queue drained in batches");
+
+    /* Out of fds with no reserve : the listener must pause , not spin */
+    for(i = LT_CONNS ; i < LT_CONNS * 2 ; i++) conns[i] = lt_connect();
+    close(listener->reservefd);
+    listener->reservefd = -1;
+    spare = dup(0);
+    close(spare);
+    getrlimit(RLIMIT_NOFILE , &rl);
+    tight = rl;
+    tight.rlim_cur = spare;
+    setrlimit(RLIMIT_NOFILE , &tight);
+    peProcessEvents(loop , PE_FILE_EVENTS|PE_DONT_WAIT);
+    wakeups = listener->stats.wakeups;
+    for(i = 0 ; i < 10 ; i++) peProcessEvents(loop , PE_FILE_EVENTS|PE_DONT_WAIT);
+    lt_check(listener->paused && listener->stats.starved == 1 , "listener : paused when out of fds");
+    lt_check(listener->stats.wakeups == wakeups , "listener : no wakeups while paused");
+    setrlimit(RLIMIT_NOFILE , &rl);
+    start = bench_ustime();
+    while(listener->paused && bench_ustime() - start < 1000000)
+        peProcessEvents(loop , PE_ALL_EVENTS);
+    for(i = 0 ; i < 10 ; i++) peProcessEvents(loop , PE_FILE_EVENTS|PE_DONT_WAIT);
+    lt_check(!listener->paused && lt_accepted == LT_CONNS * 2 && listener->reservefd != -1 ,
+             "listener : resumed by the retry timer");
+
+    for(i = 0 ; i < LT_CONNS * 2 ; i++) close(conns[i]);
+    /* the loop owns its listeners */
+    peDeleteEventLoop(loop);
+    unlink(LT_PATH);
+}
+
+static peEventLoop *lt_readloop , *lt_timerloop , *lt_doneloop;
+static int lt_donestatus = -2;
+
+static void
+lt_migrated_read(struct peEventLoop *loop , int fd , void *clientData , int mask){
+    char c;
+    NOT_USED(clientData);
+    NOT_USED(mask);
+    if(read(fd , &c , 1) == 1) lt_readloop = loop;
+}
+
+static int
+lt_migrated_timer(struct peEventLoop *loop , long long id , void *clientData){
+    NOT_USED(id);
+    NOT_USED(clientData);
+    lt_timerloop = loop;
+    return PE_NOMORE;
+}
+
+static void
+lt_migrated(struct peEventLoop *loop , int fd , void *clientData , int status){
+    NOT_USED(fd);
+    NOT_USED(clientData);
+    lt_doneloop = loop;
+    lt_donestatus = status;
+}
+
+/* One blocking iteration , woken by what was posted to the loop or by a
+ * guard timer if nothing was */
+static void
+lt_pump(peEventLoop *loop){
+    long long guard = peCreateTimeEvent(loop , 1000 , lt_never , NULL , NULL);
+
+    peProcessEvents(loop , PE_ALL_EVENTS);
+    peDeleteTimeEvent(loop , guard);
+}
+
+/* A live fd with a timer bound to it moves with the timer , and comes back
+ * when the destination cannot take it and there is no done callback */
+static void
+lt_migrate(void){
+    peEventLoop *src = peCreateEventLoop(1024) , *dst = peCreateEventLoop(1024);
+    peEventLoop *small = peCreateEventLoop(8);
+    int sv[2] , fd;
+    long long id , start;
+
+    socketpair(AF_UNIX , SOCK_STREAM , 0 , sv);
+    fd = fcntl(sv[0] , F_DUPFD , 100);
+    close(sv[0]);
+    peCreateFileEvent(src , fd , PE_READABLE , lt_migrated_read , NULL);
+    id = peCreateTimeEvent(src , 50 , lt_migrated_timer , NULL , NULL);
+    peSetTimeEventFd(src , id , fd);
+
+    lt_check(peMigrateFd(src , fd , dst , lt_migrated) == PE_OK , "migrate : posted");
+    lt_check(src->events[fd].mask == PE_NONE && src->numtimers == 0 , "migrate : fd and timer left the source");
+    lt_pump(dst);
+    lt_check(lt_doneloop == dst && lt_donestatus == PE_OK && dst->numtimers == 1 &&
+             dst->events[fd].mask == PE_READABLE ,
+             "migrate : adopted with its timer");
+    if(write(sv[1] , "x" , 1) != 1) lt_check(0 , "socketpair write");
+    peProcessEvents(dst , PE_ALL_EVENTS|PE_DONT_WAIT);
+    lt_check(lt_readloop == dst , "migrate : reads served by the destination");
+    start = bench_ustime();
+    while(lt_timerloop == NULL && bench_ustime() - start < 1000000)
+        peProcessEvents(dst , PE_ALL_EVENTS);
+    lt_check(lt_timerloop == dst , "migrate : pending timer fires on the destination");
+
+    /* fd 100 does not fit a loop of setsize 8 */
+    id = peCreateTimeEvent(dst , 10000 , lt_migrated_timer , NULL , NULL);
+    peSetTimeEventFd(dst , id , fd);
+    peMigrateFd(dst , fd , small , NULL);
+    lt_pump(small);
+    lt_pump(dst);
+    lt_check(dst->events[fd].mask == PE_READABLE && dst->numtimers == 1 ,
+             "migrate : refused fd back on the source");
+
+    close(fd);
+    close(sv[1]);
+    peDeleteEventLoop(small);
+    peDeleteEventLoop(dst);
+    peDeleteEventLoop(src);
+}
+
+static int lt_pipe_got = 0 , lt_pipe_deleted = 0;
+
+static void
+lt_pipe_proc(struct peEventLoop *loop , pePipe *pipe , void **msgs , int count , void *clientData){
+    NOT_USED(loop);
+    NOT_USED(pipe);
+    NOT_USED(msgs);
+    NOT_USED(clientData);
+    lt_pipe_got += count;
+}
+
+static int
+lt_pipe_delete(struct peEventLoop *loop , long long id , void *clientData){
+    NOT_USED(loop);
+    NOT_USED(id);
+    peDeletePipe(clientData);
+    lt_pipe_deleted = 1;
+    return PE_NOMORE;
+}
+
+/* A timer deletes the pipe after the prepare hook deferred a drain of the
+ * queued messages: the drain must neither run nor touch freed memory */
+static void
+lt_pipe(void){
+    peEventLoop *loop = peCreateEventLoop(64);
+    pePipe *pipe = peCreatePipe(loop , loop , 16 , lt_pipe_proc , NULL , NULL);
+    void *msgs[4] = {NULL , NULL , NULL , NULL};
+
+    lt_check(pePipeWrite(pipe , msgs , 4) == 4 , "pipe : messages queued");
+    peCreateTimeEvent(loop , 0 , lt_pipe_delete , pipe , NULL);
+    peProcessEvents(loop , PE_ALL_EVENTS|PE_DONT_WAIT);
+    lt_check(lt_pipe_deleted && lt_pipe_got == 0 , "pipe : deleted from a timer , drain dropped");
+    peProcessEvents(loop , PE_ALL_EVENTS|PE_DONT_WAIT);
+    peDeleteEventLoop(loop);
+}
+
+void
+Loop_test(void){
+    lt_priority();
+    lt_budget();
+    lt_stale();
+    lt_hooks();
+    lt_defer_ring();
+    lt_listener();
+    lt_migrate();
+    lt_pipe();
+    printf("%s\n" , lt_failed ? "loop test FAILED" : "loop test passed");
+    if(lt_failed) exit(1);
+}
+/* loop test ===================== End ====================*/
+
 int
 main(int argv , char * args[])
 {
     if(argv > 1){
         void (*fun[])(void) = {
             pmalloc_test,
-            TimeEvent_test
+            TimeEvent_test,
+            Coroutine_bench,
+            ReadBuffer_bench,
+            Broadcast_bench,
+            Frame_bench,
+            Job_bench,
+            Overload_bench,
+            Pipe_bench,
+            Admin_bench,
+            Memory_bench,
+            Allocator_bench,
+            LargeTable_bench,
+            Loop_test,
+            Shared_bench,
+            Upgrade_bench,
+            Pmalloc_bench
         };
         putestInitWithFuncs(fun ,(int) *args[1]);
     }
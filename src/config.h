@@ -9,6 +9,29 @@
 #define HAVE_PROC_SMAPS 1
 #endif
 
+/* Allocator able to tell the usable size of a block, letting pmalloc drop
+ * its size header. Build with -DPMALLOC_NO_MALLOC_SIZE to keep it. The
+ * profiling build (PMALLOC_PROFILE) needs the header. Build with
+ * -DUSE_PTALLOC for the thread caching allocator of ptalloc.c instead of
+ * libc. */
+#if defined(USE_PTALLOC)
+#if !defined(PMALLOC_NO_MALLOC_SIZE) && !defined(PMALLOC_PROFILE)
+#define HAVE_MALLOC_SIZE 1
+#define pmalloc_usable_size(p) ptalloc_usable_size(p)
+#endif
+#elif defined(__GLIBC__) && !defined(PMALLOC_NO_MALLOC_SIZE) && !defined(PMALLOC_PROFILE)
+#include <malloc.h>
+#define HAVE_MALLOC_SIZE 1
+#define pmalloc_usable_size(p) malloc_usable_size(p)
+#endif
+
+/* Large blocks mapped on their own, with huge pages and NUMA placement,
+ * see pmalloc_large */
+#ifdef __linux__
+#define HAVE_MMAP 1
+#define HAVE_NUMA 1
+#endif
+
 /* For polling API */
 #ifdef __linux__
 #define HAVE_EPOLL 1
@@ -1,5 +1,9 @@
 
+#include <sys/eventfd.h>
+#include <errno.h>
+
 #include "pe.h"
+#include "pe_listener.h"
 
 /* Include the best multiplexing layer supported by this system.
  * The following should be ordered by performances, descending. */
@@ -10,37 +14,131 @@
     #include "pe_select.c"
 #endif
 
+/* Time event ids are unique across loops, so that a timer keeps its id
+ * when it migrates with its fd. */
+static long long peTimeEventNextId = 0;
+
+/* Loops with a memory proc, woken when pmalloc changes its level */
+static peEventLoop *peMemoryLoops[PE_MEMORY_LOOPS];
+static pthread_mutex_t peMemoryLock = PTHREAD_MUTEX_INITIALIZER;
+static int peMemoryInstalled = 0;
+/* Handler of the application installed before the loops', called in turn */
+static pmalloc_watermark_proc *peMemoryPrev = NULL;
+
+/* In shared mode several threads dispatch the same loop */
+#define peLockShared(el, lock) do { \
+    if ((el)->shared) pthread_mutex_lock(&(el)->lock); \
+    } while(0)
+
+#define peUnlockShared(el, lock) do { \
+    if ((el)->shared) pthread_mutex_unlock(&(el)->lock); \
+    } while(0)
 
 peEventLoop *
 peCreateEventLoop(int setsize) {
     peEventLoop *eventLoop;
     int i;
 
-    if ((eventLoop = pmalloc(sizeof(*eventLoop))) == NULL) goto err;
+    if ((eventLoop = pcalloc(sizeof(*eventLoop))) == NULL) goto err;
 
-    eventLoop->events = pmalloc(sizeof(peFileEvent)*setsize);
-    eventLoop->fired = pmalloc(sizeof(peFiredEvent)*setsize);
-    if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
+    eventLoop->events = pmalloc_large(sizeof(peFileEvent)*setsize, PE_TABLE_FLAGS);
+    eventLoop->fired = pmalloc_large(sizeof(peFiredEvent)*setsize, PE_TABLE_FLAGS);
+    eventLoop->pending = pmalloc_large(sizeof(peFiredEvent)*setsize, PE_TABLE_FLAGS);
+    if (eventLoop->events == NULL || eventLoop->fired == NULL ||
+        eventLoop->pending == NULL) goto err;
     eventLoop->setsize = setsize;
     eventLoop->lastTime = time(NULL);
 
     eventLoop->timeEventHead = NULL;
-    eventLoop->timeEventNextId = 0;
+    eventLoop->numtimers = 0;
+    eventLoop->nexttimer = 0;
 
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
+    eventLoop->npending = 0;
+    eventLoop->maxcallbacks = 0;
+    eventLoop->maxusec = 0;
+    for (i = 0; i < PE_HOOK_TYPES; i++) {
+        eventLoop->hooks[i] = NULL;
+        eventLoop->numhooks[i] = 0;
+    }
+    eventLoop->hookNextId = 0;
+    eventLoop->deferhead = eventLoop->defertail = 0;
+    eventLoop->defersize = PE_DEFER_QUEUE_SIZE;
+    eventLoop->listeners = NULL;
+    eventLoop->readbuf = NULL;
+    eventLoop->readbufsize = 0;
+    eventLoop->readbuffers = NULL;
+    eventLoop->readbufidle = 0;
+    eventLoop->readbufsweep = -1;
+    eventLoop->readbufepoch = 0;
+    eventLoop->flushqueues = NULL;
+    eventLoop->flushhook = -1;
+    eventLoop->jobs = NULL;
+    eventLoop->jobNextId = 0;
+    eventLoop->jobbudget = PE_JOB_BUDGET;
+    eventLoop->jobcur = PE_JOB_BUDGET;
+    for (i = 0; i < PE_JOB_KEEP; i++)
+        eventLoop->jobsdone[i] = NULL;
+    eventLoop->jobsdonepos = 0;
+    eventLoop->timing = 0;
+    eventLoop->iterusec = 0;
+    eventLoop->timerlate = 0;
+    eventLoop->shedding = 0;
+    eventLoop->shedmaxfd = -1;
+    eventLoop->memproc = NULL;
+    eventLoop->memdata = NULL;
+    eventLoop->memlevel = PMALLOC_LEVEL_OK;
+    eventLoop->woken = 0;
+    eventLoop->asynchead = eventLoop->asynctail = NULL;
+    pthread_mutex_init(&eventLoop->asynclock, NULL);
+    pthread_mutex_init(&eventLoop->sharedlock, NULL);
+    {
+        pthread_mutexattr_t attr;
+
+        /* Timer callbacks create and delete timers */
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&eventLoop->timelock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    eventLoop->shared = 0;
+    eventLoop->accounting = 0;
+    eventLoop->busyusec = 0;
+    eventLoop->deferred = pmalloc(sizeof(peDeferred)*PE_DEFER_QUEUE_SIZE);
+    if (eventLoop->deferred == NULL) goto err;
+    eventLoop->timerpool = pmalloc_pool_create(sizeof(peTimeEvent));
+    if (eventLoop->timerpool == NULL) goto err;
+    pmalloc_arena_init(&eventLoop->arena, 0);
+    eventLoop->wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (eventLoop->wakefd == -1) goto err;
     if (peApiCreate(eventLoop) == -1) goto err;
+    if (peApiAddWake(eventLoop) == -1) {
+        peApiFree(eventLoop);
+        goto err;
+    }
     /* Events with mask == PE_NONE are not set. So let's initialize the
      * vector with it. */
-    for (i = 0; i < setsize; i++)
+    for (i = 0; i < setsize; i++) {
         eventLoop->events[i].mask = PE_NONE;
+        eventLoop->events[i].priority = PE_PRIO_NORMAL;
+        eventLoop->events[i].pending = 0;
+        eventLoop->events[i].flags = 0;
+        eventLoop->events[i].busy = 0;
+        eventLoop->events[i].usec = 0;
+        eventLoop->events[i].calls = 0;
+    }
     return eventLoop;
 
  err:
     if (eventLoop) {
-        pfree(eventLoop->events);
-        pfree(eventLoop->fired);
+        if (eventLoop->wakefd > 0) close(eventLoop->wakefd);
+        pfree_large(eventLoop->events);
+        pfree_large(eventLoop->fired);
+        pfree_large(eventLoop->pending);
+        pfree(eventLoop->deferred);
+        pmalloc_pool_destroy(eventLoop->timerpool);
         pfree(eventLoop);
     }
     return NULL;
@@ -48,15 +146,49 @@ peCreateEventLoop(int setsize) {
 
 void 
 peDeleteEventLoop(peEventLoop *eventLoop) {
+    peAsync *async;
+    peJob *job;
+    int i;
+
+    while (eventLoop->listeners)
+        peDeleteListener(eventLoop->listeners);
+    peSetMemoryProc(eventLoop, NULL, NULL);
     peApiFree(eventLoop);
-    pfree(eventLoop->events);
-    pfree(eventLoop->fired);
+    close(eventLoop->wakefd);
+    while ((async = eventLoop->asynchead) != NULL) {
+        eventLoop->asynchead = async->next;
+        pfree(async);
+    }
+    pthread_mutex_destroy(&eventLoop->asynclock);
+    pthread_mutex_destroy(&eventLoop->sharedlock);
+    pthread_mutex_destroy(&eventLoop->timelock);
+    pfree_large(eventLoop->events);
+    pfree_large(eventLoop->fired);
+    pfree_large(eventLoop->pending);
+    for (i = 0; i < PE_HOOK_TYPES; i++)
+        pfree(eventLoop->hooks[i]);
+    pfree(eventLoop->deferred);
+    pfree(eventLoop->readbuf);
+    /* Frees the timers still registered too */
+    pmalloc_pool_destroy(eventLoop->timerpool);
+    pmalloc_arena_free(&eventLoop->arena);
+    while ((job = eventLoop->jobs) != NULL) {
+        eventLoop->jobs = job->next;
+        pfree(job);
+    }
+    for (i = 0; i < PE_JOB_KEEP; i++)
+        pfree(eventLoop->jobsdone[i]);
     pfree(eventLoop);
 }
 
+/* Also interrupts the poll, so it can be called from another thread */
 void 
 peStop(peEventLoop *eventLoop) {
+    uint64_t one = 1;
+
     eventLoop->stop = 1;
+    while (write(eventLoop->wakefd, &one, sizeof(one)) == -1 &&
+           errno == EINTR);
 }
 
 int 
@@ -65,9 +197,19 @@ peCreateFileEvent(peEventLoop *eventLoop, int fd, int mask,
     if (fd >= eventLoop->setsize) return PE_ERR;
     peFileEvent *fe = &eventLoop->events[fd];
 
-    if (peApiAddEvent(eventLoop, fd, mask) == -1)
+    peLockShared(eventLoop, sharedlock);
+    if (peApiAddEvent(eventLoop, fd, mask) == -1) {
+        peUnlockShared(eventLoop, sharedlock);
         return PE_ERR;
+    }
 
+    if (fe->mask == PE_NONE && !(fe->flags & PE_FE_SHED)) {
+        fe->flags = 0;
+        fe->usec = 0;
+        fe->calls = 0;
+        fe->bytes = 0;
+    }
+    if (mask & PE_READABLE) fe->flags &= ~PE_FE_SHED;
     fe->mask |= mask;
     if (mask & PE_READABLE) fe->rfileProc = proc;
     if (mask & PE_WRITABLE) fe->wfileProc = proc;
@@ -76,6 +218,7 @@ peCreateFileEvent(peEventLoop *eventLoop, int fd, int mask,
 
     if (fd > eventLoop->maxfd)
         eventLoop->maxfd = fd;
+    peUnlockShared(eventLoop, sharedlock);
 
     return PE_OK;
 }
@@ -85,9 +228,30 @@ peDeleteFileEvent(peEventLoop *eventLoop, int fd, int mask){
     if (fd >= eventLoop->setsize) return;
     peFileEvent *fe = &eventLoop->events[fd];
 
-    if (fe->mask == PE_NONE) return;
+    peLockShared(eventLoop, sharedlock);
+    if (mask & PE_READABLE) fe->flags &= ~PE_FE_SHED;
+    if (fe->mask == PE_NONE) {
+        if (!(fe->flags & PE_FE_SHED)) {
+            fe->priority = PE_PRIO_NORMAL;
+            fe->flags = 0;
+        }
+        peUnlockShared(eventLoop, sharedlock);
+        return;
+    }
 
     fe->mask = fe->mask & (~mask);
+    /* Work carried over by the budget must not reach the next owner of
+     * the fd number */
+    if (fe->mask == PE_NONE && fe->pending) {
+        eventLoop->pending[fe->pending-1].mask = PE_NONE;
+        fe->pending = 0;
+    }
+    /* The fd number will be reused by someone else: forget its class,
+     * unless reading is only suspended */
+    if (fe->mask == PE_NONE && !(fe->flags & PE_FE_SHED)) {
+        fe->priority = PE_PRIO_NORMAL;
+        fe->flags = 0;
+    }
     if (fd == eventLoop->maxfd && fe->mask == PE_NONE) {
         int j;
 
@@ -97,6 +261,7 @@ peDeleteFileEvent(peEventLoop *eventLoop, int fd, int mask){
     }
 
     peApiDelEvent(eventLoop, fd, mask);
+    peUnlockShared(eventLoop, sharedlock);
 }
 
 int 
@@ -107,6 +272,36 @@ peGetFileEvents(peEventLoop *eventLoop, int fd) {
     return fe->mask;
 }
 
+/* Set the dispatch class of an already registered fd. Within an iteration
+ * every fired PE_PRIO_HIGH fd is served before any PE_PRIO_NORMAL one and
+ * so on, so that control connections are not starved by bulk traffic. */
+int 
+peSetFileEventPriority(peEventLoop *eventLoop, int fd, int priority) {
+    if (fd >= eventLoop->setsize) return PE_ERR;
+    if (priority < 0 || priority >= PE_PRIO_CLASSES) return PE_ERR;
+    peFileEvent *fe = &eventLoop->events[fd];
+
+    if (fe->mask == PE_NONE) return PE_ERR;
+    fe->priority = priority;
+    return PE_OK;
+}
+
+int 
+peGetFileEventPriority(peEventLoop *eventLoop, int fd) {
+    if (fd >= eventLoop->setsize) return PE_ERR;
+    return eventLoop->events[fd].priority;
+}
+
+/* Bound the work of a single iteration: at most maxcallbacks fired fds are
+ * served, and no new fd is served once maxusec microseconds have been spent
+ * in file callbacks. What is left is carried over and served first in the
+ * next iteration, after timers had a chance to run. Zero means unlimited. */
+void 
+peSetProcessBudget(peEventLoop *eventLoop, int maxcallbacks, long long maxusec) {
+    eventLoop->maxcallbacks = maxcallbacks > 0 ? maxcallbacks : 0;
+    eventLoop->maxusec = maxusec > 0 ? maxusec : 0;
+}
+
 static void 
 peGetTime(long *seconds, long *milliseconds){
     struct timeval tv;
@@ -116,6 +311,15 @@ peGetTime(long *seconds, long *milliseconds){
     *milliseconds = tv.tv_usec/1000;
 }
 
+/* Monotonic clock in microseconds, used to measure callbacks */
+static long long 
+peUstime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
 static void 
 peAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
     long cur_sec, cur_ms, when_sec, when_ms;
@@ -137,21 +341,27 @@ long long
 peCreateTimeEvent(peEventLoop *eventLoop, long long milliseconds,
                             peTimeProc *proc, void *clientData,
                             peEventFinalizerProc *finalizerProc){
-    long long id = eventLoop->timeEventNextId++;
+    long long id = __atomic_fetch_add(&peTimeEventNextId, 1, __ATOMIC_RELAXED);
     peTimeEvent *te;
 
-    te = pmalloc(sizeof(*te));
-    if (te == NULL) return PE_ERR;
-
+    peLockShared(eventLoop, timelock);
+    te = pmalloc_pool_get(eventLoop->timerpool);
+    if (te == NULL) {
+        peUnlockShared(eventLoop, timelock);
+        return PE_ERR;
+    }
     te->id = id;
 
     peAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
+    te->fd = -1;
 
     te->next = eventLoop->timeEventHead;
     eventLoop->timeEventHead = te;
+    eventLoop->numtimers++;
+    peUnlockShared(eventLoop, timelock);
 
     return id;
 }
@@ -160,6 +370,7 @@ int
 peDeleteTimeEvent(peEventLoop *eventLoop, long long id){
     peTimeEvent *te, *prev = NULL;
 
+    peLockShared(eventLoop, timelock);
     te = eventLoop->timeEventHead;
     while(te) {
         if (te->id == id) {
@@ -167,18 +378,42 @@ peDeleteTimeEvent(peEventLoop *eventLoop, long long id){
                 eventLoop->timeEventHead = te->next;
             else
                 prev->next = te->next;
+            eventLoop->numtimers--;
 
             if (te->finalizerProc)
                 te->finalizerProc(eventLoop, te->clientData);
-            pfree(te);
+            pmalloc_pool_put(eventLoop->timerpool, te);
+            peUnlockShared(eventLoop, timelock);
             return PE_OK;
         }
         prev = te;
         te = te->next;
     }
+    peUnlockShared(eventLoop, timelock);
     return PE_ERR; 
 }
 
+static peTimeEvent *
+peFindTimeEvent(peEventLoop *eventLoop, long long id) {
+    peTimeEvent *te = eventLoop->timeEventHead;
+
+    while (te && te->id != id) te = te->next;
+    return te;
+}
+
+/* Bind a timer to fd: when the fd migrates to another loop the timer goes
+ * with it, keeping its id and its deadline. */
+int 
+peSetTimeEventFd(peEventLoop *eventLoop, long long id, int fd) {
+    peTimeEvent *te;
+
+    peLockShared(eventLoop, timelock);
+    te = peFindTimeEvent(eventLoop, id);
+    if (te) te->fd = fd;
+    peUnlockShared(eventLoop, timelock);
+    return te ? PE_OK : PE_ERR;
+}
+
 /* Search the first timer to fire.
  * This operation is useful to know how many time the select can be
  * put in sleep without to delay any event.
@@ -232,7 +467,7 @@ static int processTimeEvents(peEventLoop *eventLoop) {
     eventLoop->lastTime = now;
 
     te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
+    maxId = __atomic_load_n(&peTimeEventNextId, __ATOMIC_RELAXED)-1;
     while(te) {
         long now_sec, now_ms;
         long long id;
@@ -250,6 +485,8 @@ static int processTimeEvents(peEventLoop *eventLoop) {
                 int retval;
 
                 id = te->id;
+                eventLoop->timerlate = (long long)(now_sec-te->when_sec)*1000 +
+                                       (now_ms-te->when_ms);
                 retval = te->timeProc(eventLoop, id, te->clientData);
                 processed++;
                 /* After an event is processed our time event list may
@@ -266,9 +503,11 @@ static int processTimeEvents(peEventLoop *eventLoop) {
                  * deletion (putting references to the nodes to delete into
                  * another linked list). */
 
-                if (retval != PE_NOMORE) {
+                /* The callback may have deleted or migrated the timer */
+                te = peFindTimeEvent(eventLoop, id);
+                if (te && retval != PE_NOMORE) {
                     peAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-                } else {
+                } else if (te) {
                     peDeleteTimeEvent(eventLoop, id);
                 }
 
@@ -280,6 +519,240 @@ static int processTimeEvents(peEventLoop *eventLoop) {
     return processed;
 }
 
+/* Run the hooks of the given type registered so far. Hooks added by a
+ * hook only run the next time, deleted ones are reclaimed here. */
+static void 
+processHooks(peEventLoop *eventLoop, int type) {
+    int j, n = eventLoop->numhooks[type], live = 0;
+
+    for (j = 0; j < n; j++) {
+        peHook *h = &eventLoop->hooks[type][j];
+
+        if (h->proc) h->proc(eventLoop, h->clientData);
+    }
+    for (j = 0; j < eventLoop->numhooks[type]; j++) {
+        peHook *h = &eventLoop->hooks[type][j];
+
+        if (h->proc) eventLoop->hooks[type][live++] = *h;
+    }
+    eventLoop->numhooks[type] = live;
+}
+
+/* Run the callbacks deferred so far. The ones deferred while draining
+ * belong to the next iteration, so that a callback re-deferring itself
+ * can't keep the loop from polling. */
+static void 
+processDeferred(peEventLoop *eventLoop) {
+    unsigned long tail = eventLoop->defertail;
+
+    while (eventLoop->deferhead != tail) {
+        peDeferred *d = &eventLoop->deferred[eventLoop->deferhead &
+                                             (eventLoop->defersize-1)];
+
+        eventLoop->deferhead++;
+        d->proc(eventLoop, d->clientData);
+    }
+}
+
+/* Run the callbacks other threads posted with peRunInLoop */
+static void 
+processAsync(peEventLoop *eventLoop) {
+    peAsync *async;
+    uint64_t count;
+
+    eventLoop->woken = 0;
+    while (read(eventLoop->wakefd, &count, sizeof(count)) == -1 &&
+           errno == EINTR);
+    pthread_mutex_lock(&eventLoop->asynclock);
+    async = eventLoop->asynchead;
+    eventLoop->asynchead = eventLoop->asynctail = NULL;
+    pthread_mutex_unlock(&eventLoop->asynclock);
+
+    if (eventLoop->memproc) {
+        int level = pmalloc_memory_level();
+
+        if (__atomic_exchange_n(&eventLoop->memlevel, level,
+                                __ATOMIC_RELAXED) != level)
+            eventLoop->memproc(eventLoop, level, pmalloc_used_memory(),
+                               eventLoop->memdata);
+    }
+
+    while (async) {
+        peAsync *next = async->next;
+
+        async->proc(eventLoop, async->clientData);
+        pfree(async);
+        async = next;
+    }
+}
+
+/* Dispatch the events returned by the last poll together with the ones
+ * carried over from the previous iteration, by priority class first and by
+ * arrival order within a class, until the iteration budget is exhausted. */
+static int 
+processFileEvents(peEventLoop *eventLoop, int numevents) {
+    int j, prio, n = eventLoop->npending, processed = 0, left = 0;
+    int timed = eventLoop->maxusec || eventLoop->accounting;
+    long long start = timed ? peUstime() : 0, last = start;
+
+    /* Queue the fresh events behind the carried over ones, merging the
+     * masks of fds that are already waiting. */
+    for (j = 0; j < numevents; j++) {
+        peFiredEvent *fired = &eventLoop->fired[j];
+        peFileEvent *fe = &eventLoop->events[fired->fd];
+
+        if (fired->mask == PE_NONE) continue;
+        if (fe->pending) {
+            eventLoop->pending[fe->pending-1].mask |= fired->mask;
+        } else {
+            eventLoop->pending[n] = *fired;
+            fe->pending = ++n;
+        }
+    }
+
+    for (prio = 0; prio < PE_PRIO_CLASSES; prio++) {
+        for (j = 0; j < n; j++) {
+            peFiredEvent *fired = &eventLoop->pending[j];
+            peFileEvent *fe = &eventLoop->events[fired->fd];
+            int mask = fired->mask;
+            int fd = fired->fd;
+            int rfired = 0;
+
+            if (mask == PE_NONE || fe->priority != prio) continue;
+            if (eventLoop->maxcallbacks && processed >= eventLoop->maxcallbacks)
+                goto out;
+            if (eventLoop->maxusec && processed &&
+                last-start >= eventLoop->maxusec)
+                goto out;
+            fired->mask = PE_NONE;
+            fe->pending = 0;
+
+            /* note the fe->mask & mask & ... code: maybe an already processed
+             * event removed an element that fired and we still didn't
+             * processed, so we check if the event is still valid. */
+            if (fe->mask & mask & PE_READABLE) {
+                rfired = 1; 
+                fe->rfileProc(eventLoop,fd,fe->clientData,mask);
+            }
+            if (fe->mask & mask & PE_WRITABLE) {
+                if (!rfired || fe->wfileProc != fe->rfileProc)
+                    fe->wfileProc(eventLoop,fd,fe->clientData,mask);
+            }
+
+            if (timed) {
+                long long now = peUstime();
+
+                if (eventLoop->accounting) {
+                    fe->usec += now-last;
+                    fe->calls++;
+                }
+                eventLoop->busyusec += now-last;
+                last = now;
+            }
+            processed++;
+        }
+    }
+
+ out:
+    /* Keep what was not served, in order, for the next iteration. Entries
+     * of fds deleted in the meantime are dropped. */
+    for (j = 0; j < n; j++) {
+        peFiredEvent *fired = &eventLoop->pending[j];
+        peFileEvent *fe = &eventLoop->events[fired->fd];
+
+        if (fired->mask == PE_NONE) continue;
+        if (fe->mask == PE_NONE) {
+            fe->pending = 0;
+            continue;
+        }
+        eventLoop->pending[left] = *fired;
+        fe->pending = ++left;
+    }
+    eventLoop->npending = left;
+    return processed;
+}
+
+/* Jobs with work to do */
+static int 
+peJobsReady(peEventLoop *eventLoop) {
+    peJob *job;
+    int ready = 0;
+
+    for (job = eventLoop->jobs; job; job = job->next)
+        if (job->proc && !job->idle) ready++;
+    return ready;
+}
+
+/* Give the background jobs their share of the iteration budget, in turn.
+ * The budget follows the load of the last iterations: it doubles after
+ * every iteration whose poll returned nothing, up to PE_JOB_BUDGET_SCALE
+ * times the configured budget, and moves halfway to a fraction of the
+ * time the callbacks took after every busy one. So maintenance work
+ * speeds up on an idle loop and gets out of the way of a busy one, without
+ * swinging on a single quiet or loud iteration. Every job runs at least
+ * one step per iteration. */
+static void 
+processJobs(peEventLoop *eventLoop, int idle, long long busy) {
+    long long budget, share, now;
+    long long max = eventLoop->jobbudget*PE_JOB_BUDGET_SCALE;
+    peJob *job, **jp;
+    int live = peJobsReady(eventLoop), ret;
+
+    if (live) {
+        budget = eventLoop->jobcur;
+        if (idle)
+            budget *= 2;
+        else
+            budget = (budget + busy/PE_JOB_BUDGET_SCALE)/2;
+        if (budget > max) budget = max;
+        eventLoop->jobcur = budget;
+        share = budget/live;
+        now = peUstime();
+        for (job = eventLoop->jobs; job && live; job = job->next) {
+            long long start = now;
+
+            if (job->proc == NULL || job->idle) continue;
+            live--;
+            job->stats.lag = now-job->lastrun;
+            if (job->stats.lag > job->stats.maxlag)
+                job->stats.maxlag = job->stats.lag;
+            job->stats.runs++;
+            do {
+                job->stats.steps++;
+                ret = job->proc(eventLoop, job->clientData);
+                if (ret == PE_NOMORE && job->proc) {
+                    job->proc = NULL;
+                    job->stats.finished = 1;
+                } else if (ret == PE_JOB_IDLE) {
+                    job->idle = 1;
+                }
+                now = peUstime();
+            } while (job->proc && !job->idle && now-start < share);
+            job->stats.usec += now-start;
+            job->lastrun = now;
+        }
+    }
+
+    /* Reclaim deleted jobs, keep the last finished ones for their stats */
+    jp = &eventLoop->jobs;
+    while ((job = *jp) != NULL) {
+        if (job->proc == NULL) {
+            *jp = job->next;
+            if (job->stats.finished) {
+                peJob **slot = &eventLoop->jobsdone[eventLoop->jobsdonepos];
+
+                pfree(*slot);
+                *slot = job;
+                eventLoop->jobsdonepos = (eventLoop->jobsdonepos+1) % PE_JOB_KEEP;
+            } else {
+                pfree(job);
+            }
+        } else {
+            jp = &job->next;
+        }
+    }
+}
+
 /* Process every pending time event, then every pending file event
  * (that may be registered by time event callbacks just processed).
  *
@@ -301,24 +774,40 @@ static int processTimeEvents(peEventLoop *eventLoop) {
  */
 int 
 peProcessEvents(peEventLoop *eventLoop, int flags){
-    int processed = 0, numevents;
+    int processed = 0, numevents = 0;
+    int timed = eventLoop->jobs || eventLoop->timing;
+    long long start = timed ? peUstime() : 0;
 
     /* Nothing to do? return ASAP */
     if (!(flags & PE_TIME_EVENTS) && !(flags & PE_FILE_EVENTS)) return 0;
 
+    processHooks(eventLoop, PE_HOOK_PREPARE);
+
     /* Note that we want call select() even if there are no
      * file events to process as long as we want to process time
      * events, in order to sleep until the next time event is ready
      * to fire. */
     if (eventLoop->maxfd != -1 ||
         ((flags & PE_TIME_EVENTS) && !(flags & PE_DONT_WAIT))) {
-        int j;
         peTimeEvent *shortest = NULL;
         struct timeval tv, *tvp;
 
-        if (flags & PE_TIME_EVENTS && !(flags & PE_DONT_WAIT))
+        if (flags & PE_TIME_EVENTS && !(flags & PE_DONT_WAIT)) {
             shortest = peSearchNearestTimer(eventLoop);
-        if (shortest) {
+            eventLoop->nexttimer = shortest ?
+                (long long)shortest->when_sec*1000 + shortest->when_ms : 0;
+        }
+        if ((eventLoop->npending && (flags & PE_FILE_EVENTS)) ||
+            eventLoop->deferhead != eventLoop->defertail ||
+            peJobsReady(eventLoop) || eventLoop->numhooks[PE_HOOK_IDLE]) {
+            /* Events carried over by the budget, callbacks deferred by
+             * the prepare hooks and background jobs with work to do are
+             * ready right now.
+             * Idle hooks keep the loop from blocking, as in libuv: they
+             * run on every iteration that found nothing to do. */
+            tv.tv_sec = tv.tv_usec = 0;
+            tvp = &tv;
+        } else if (shortest) {
             long now_sec, now_ms;
 
             /* Calculate the time missing for the nearest
@@ -350,33 +839,29 @@ peProcessEvents(peEventLoop *eventLoop, int flags){
         }
 
         numevents = peApiPoll(eventLoop, tvp);
-        for (j = 0; j < numevents; j++) {
-            peFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
-
-            int mask = eventLoop->fired[j].mask;
-            int fd = eventLoop->fired[j].fd;
-            int rfired = 0;
-
-            /* note the fe->mask & mask & ... code: maybe an already processed
-             * event removed an element that fired and we still didn't
-                * processed, so we check if the event is still valid. */
-            if (fe->mask & mask & PE_READABLE) {
-                rfired = 1; 
-                fe->rfileProc(eventLoop,fd,fe->clientData,mask);
-            }
-            if (fe->mask & mask & PE_WRITABLE) {
-                if (!rfired || fe->wfileProc != fe->rfileProc)
-                    fe->wfileProc(eventLoop,fd,fe->clientData,mask);
-            }
-
-            processed++;
-        }
+        if (timed) start = peUstime();
+        processHooks(eventLoop, PE_HOOK_CHECK);
+        if (eventLoop->woken) processAsync(eventLoop);
+        processed += processFileEvents(eventLoop, numevents);
     }
 
     /* Check time events */
     if (flags & PE_TIME_EVENTS)
         processed += processTimeEvents(eventLoop);
 
+    if (eventLoop->jobs)
+        processJobs(eventLoop, numevents == 0 && processed == 0,
+                    peUstime()-start);
+
+    if (processed == 0)
+        processHooks(eventLoop, PE_HOOK_IDLE);
+
+    processDeferred(eventLoop);
+
+    pmalloc_arena_reset(&eventLoop->arena);
+
+    if (eventLoop->timing) eventLoop->iterusec = peUstime()-start;
+
     return processed; /* return the number of processed file/time events */
 }
 
@@ -403,6 +888,127 @@ peWait(int fd, int mask, long long milliseconds) {
     }
 }
 
+/* Leader/follower dispatch, run by every thread of peMainShared. Each
+ * thread polls the shared epoll set for PE_SHARED_BATCH events on its own
+ * stack: fds are armed one-shot, so a ready fd is handed to exactly one
+ * thread and armed again only once its callback returned. Timers are run
+ * by whichever thread gets their lock first.
+ *
+ * Another thread registering events for an fd that was just handed out,
+ * but not yet claimed, arms it again and it may be handed to a second
+ * thread. So every fired fd is claimed under sharedlock before any
+ * callback runs, and an fd already claimed is left to its owner: its
+ * rearm reports the readiness again, the poller being level triggered. */
+static void 
+peSharedRun(peEventLoop *eventLoop) {
+    peFiredEvent fired[PE_SHARED_BATCH];
+    int claimed[PE_SHARED_BATCH];
+    uint64_t one = 1;
+
+    while (!eventLoop->stop) {
+        peTimeEvent *shortest;
+        int j, numevents, timeout = -1, woken = 0;
+
+        pthread_mutex_lock(&eventLoop->timelock);
+        if ((shortest = peSearchNearestTimer(eventLoop)) != NULL) {
+            long now_sec, now_ms;
+
+            peGetTime(&now_sec, &now_ms);
+            timeout = (shortest->when_sec - now_sec)*1000 +
+                      shortest->when_ms - now_ms;
+            if (timeout < 0) timeout = 0;
+        }
+        pthread_mutex_unlock(&eventLoop->timelock);
+
+        numevents = peApiPollShared(eventLoop, fired, PE_SHARED_BATCH,
+                                    timeout, &woken);
+        if (eventLoop->stop) break;
+        if (woken) processAsync(eventLoop);
+
+        pthread_mutex_lock(&eventLoop->sharedlock);
+        for (j = 0; j < numevents; j++) {
+            peFileEvent *fe = &eventLoop->events[fired[j].fd];
+
+            claimed[j] = !fe->busy;
+            fe->busy = 1;
+        }
+        pthread_mutex_unlock(&eventLoop->sharedlock);
+
+        for (j = 0; j < numevents; j++) {
+            peFileEvent *fe = &eventLoop->events[fired[j].fd];
+            int mask = fired[j].mask;
+            int fd = fired[j].fd;
+            int rfired = 0;
+
+            if (!claimed[j]) continue; /* dispatched by another thread */
+            if (fe->mask & mask & PE_READABLE) {
+                rfired = 1;
+                fe->rfileProc(eventLoop,fd,fe->clientData,mask);
+            }
+            if (fe->mask & mask & PE_WRITABLE) {
+                if (!rfired || fe->wfileProc != fe->rfileProc)
+                    fe->wfileProc(eventLoop,fd,fe->clientData,mask);
+            }
+
+            pthread_mutex_lock(&eventLoop->sharedlock);
+            fe->busy = 0;
+            if (fe->mask != PE_NONE) peApiRearm(eventLoop, fd);
+            pthread_mutex_unlock(&eventLoop->sharedlock);
+        }
+
+        if (pthread_mutex_trylock(&eventLoop->timelock) == 0) {
+            processTimeEvents(eventLoop);
+            pthread_mutex_unlock(&eventLoop->timelock);
+        }
+    }
+
+    /* The thread that consumed the wake up of peStop passes it on */
+    while (write(eventLoop->wakefd, &one, sizeof(one)) == -1 &&
+           errno == EINTR);
+}
+
+static void *
+peSharedThread(void *arg) {
+    peSharedRun(arg);
+    return NULL;
+}
+
+/* Run the loop with numthreads threads (the caller included) sharing the
+ * same poller, until peStop. Any idle thread picks up the next ready fd,
+ * which balances workloads with very uneven per-request cost better than
+ * pinning fds to loops. Callbacks of different fds run concurrently, the
+ * ones of a single fd never do. Only file and time events are dispatched:
+ * hooks, deferred callbacks and the iteration budget are not used in this
+ * mode. Needs the epoll backend, returns PE_ERR otherwise. */
+int 
+peMainShared(peEventLoop *eventLoop, int numthreads) {
+    pthread_t *threads;
+    int j, started = 0;
+
+    if (numthreads < 1) return PE_ERR;
+    if (peApiSetShared(eventLoop, 1) == -1) {
+        peApiSetShared(eventLoop, 0);
+        return PE_ERR;
+    }
+    eventLoop->stop = 0;
+    eventLoop->shared = 1;
+
+    threads = pmalloc(sizeof(pthread_t)*numthreads);
+    for (j = 1; j < numthreads; j++) {
+        if (pthread_create(&threads[j], NULL, peSharedThread, eventLoop) != 0)
+            break;
+        started++;
+    }
+    peSharedRun(eventLoop);
+    for (j = 1; j <= started; j++)
+        pthread_join(threads[j], NULL);
+    pfree(threads);
+
+    eventLoop->shared = 0;
+    peApiSetShared(eventLoop, 0);
+    return PE_OK;
+}
+
 void 
 peMain(peEventLoop *eventLoop) {
 
@@ -426,3 +1032,352 @@ void
 peSetBeforeSleepProc(peEventLoop *eventLoop, peBeforeSleepProc *beforesleep) {
     eventLoop->beforesleep = beforesleep;
 }
+
+/* Register a hook of one of the PE_HOOK_* types. Any number of hooks can
+ * be registered, they run in registration order. Returns the hook id.
+ * While an idle hook is registered the loop polls without blocking, so
+ * delete it once there is no more idle work. */
+long long 
+peCreateHook(peEventLoop *eventLoop, int type, peHookProc *proc, void *clientData) {
+    peHook *hooks;
+    int n;
+
+    if (type < 0 || type >= PE_HOOK_TYPES || proc == NULL) return PE_ERR;
+    n = eventLoop->numhooks[type];
+    hooks = prealloc(eventLoop->hooks[type], sizeof(peHook)*(n+1));
+    if (hooks == NULL) return PE_ERR;
+    hooks[n].id = eventLoop->hookNextId++;
+    hooks[n].proc = proc;
+    hooks[n].clientData = clientData;
+    eventLoop->hooks[type] = hooks;
+    eventLoop->numhooks[type] = n+1;
+    return hooks[n].id;
+}
+
+/* Hooks may be deleted from inside a hook: the slot is only marked here
+ * and reclaimed after the hooks of that type ran. */
+int 
+peDeleteHook(peEventLoop *eventLoop, long long id) {
+    int type, j;
+
+    for (type = 0; type < PE_HOOK_TYPES; type++) {
+        for (j = 0; j < eventLoop->numhooks[type]; j++) {
+            peHook *h = &eventLoop->hooks[type][j];
+
+            if (h->id == id && h->proc) {
+                h->proc = NULL;
+                return PE_OK;
+            }
+        }
+    }
+    return PE_ERR;
+}
+
+/* Run proc repeatedly between events until it returns PE_NOMORE, within
+ * the background budget of every iteration (see peSetBackgroundBudget).
+ * Each call should do a small, bounded step of the work. While a job has
+ * work the loop polls without blocking: a step returning PE_JOB_IDLE
+ * parks the job, so that the loop can block again, until
+ * peResumeBackgroundJob. Not for loops run by peMainShared. */
+long long 
+peCreateBackgroundJob(peEventLoop *eventLoop, peJobProc *proc, void *clientData) {
+    peJob *job;
+
+    if (proc == NULL || (job = pcalloc(sizeof(*job))) == NULL) return PE_ERR;
+    job->id = eventLoop->jobNextId++;
+    job->proc = proc;
+    job->clientData = clientData;
+    job->lastrun = peUstime();
+    job->next = eventLoop->jobs;
+    eventLoop->jobs = job;
+    return job->id;
+}
+
+/* Also safe from the step of the job itself */
+int 
+peDeleteBackgroundJob(peEventLoop *eventLoop, long long id) {
+    peJob *job;
+
+    for (job = eventLoop->jobs; job; job = job->next) {
+        if (job->id == id && job->proc) {
+            job->proc = NULL;
+            return PE_OK;
+        }
+    }
+    return PE_ERR;
+}
+
+/* Run a job parked by PE_JOB_IDLE again, typically from the callback that
+ * gave it work. */
+int 
+peResumeBackgroundJob(peEventLoop *eventLoop, long long id) {
+    peJob *job;
+
+    for (job = eventLoop->jobs; job; job = job->next) {
+        if (job->id == id && job->proc) {
+            if (job->idle) job->lastrun = peUstime();
+            job->idle = 0;
+            return PE_OK;
+        }
+    }
+    return PE_ERR;
+}
+
+/* Microseconds of job steps per iteration, shared by all the jobs */
+void 
+peSetBackgroundBudget(peEventLoop *eventLoop, long long usec) {
+    eventLoop->jobbudget = usec > 0 ? usec : PE_JOB_BUDGET;
+    eventLoop->jobcur = eventLoop->jobbudget;
+}
+
+/* Stats of a running job, or of one of the last PE_JOB_KEEP jobs that
+ * finished on the loop. */
+int 
+peGetBackgroundJobStats(peEventLoop *eventLoop, long long id, peJobStats *stats) {
+    peJob *job;
+    int i;
+
+    for (job = eventLoop->jobs; job; job = job->next) {
+        if (job->id == id && (job->proc || job->stats.finished)) {
+            *stats = job->stats;
+            return PE_OK;
+        }
+    }
+    for (i = 0; i < PE_JOB_KEEP; i++) {
+        job = eventLoop->jobsdone[i];
+        if (job && job->id == id) {
+            *stats = job->stats;
+            return PE_OK;
+        }
+    }
+    return PE_ERR;
+}
+
+/* Queue proc to run once at the end of the current iteration, after file
+ * and time events, so that handlers can coalesce work done per event into
+ * work done per iteration. The ring is preallocated: when it is full
+ * PE_ERR is returned instead of allocating. */
+int 
+peDefer(peEventLoop *eventLoop, peDeferProc *proc, void *clientData) {
+    peDeferred *d;
+
+    if (eventLoop->defertail - eventLoop->deferhead == eventLoop->defersize)
+        return PE_ERR;
+    d = &eventLoop->deferred[eventLoop->defertail & (eventLoop->defersize-1)];
+    d->proc = proc;
+    d->clientData = clientData;
+    eventLoop->defertail++;
+    return PE_OK;
+}
+
+/* Resize the deferred callbacks ring, rounding size up to a power of two.
+ * Only allowed while the ring is empty. */
+int 
+peSetDeferQueueSize(peEventLoop *eventLoop, unsigned long size) {
+    unsigned long realsize = 1;
+    peDeferred *deferred;
+
+    if (eventLoop->deferhead != eventLoop->defertail) return PE_ERR;
+    while (realsize < size) realsize <<= 1;
+    if ((deferred = pmalloc(sizeof(peDeferred)*realsize)) == NULL)
+        return PE_ERR;
+    pfree(eventLoop->deferred);
+    eventLoop->deferred = deferred;
+    eventLoop->defersize = realsize;
+    eventLoop->deferhead = eventLoop->defertail = 0;
+    return PE_OK;
+}
+
+/* Run proc on the thread of eventLoop, at its next iteration. This is the
+ * only function that may be called from another thread: posted callbacks
+ * run in FIFO order and interrupt a loop blocked in the poll. */
+int 
+peRunInLoop(peEventLoop *eventLoop, peAsyncProc *proc, void *clientData) {
+    peAsync *async = pmalloc(sizeof(*async));
+    uint64_t one = 1;
+    int wake;
+
+    if (async == NULL) return PE_ERR;
+    async->proc = proc;
+    async->clientData = clientData;
+    async->next = NULL;
+
+    pthread_mutex_lock(&eventLoop->asynclock);
+    wake = eventLoop->asynchead == NULL;
+    if (eventLoop->asynctail)
+        eventLoop->asynctail->next = async;
+    else
+        eventLoop->asynchead = async;
+    eventLoop->asynctail = async;
+    pthread_mutex_unlock(&eventLoop->asynclock);
+
+    /* A non empty queue means the loop was already woken up */
+    if (wake) {
+        while (write(eventLoop->wakefd, &one, sizeof(one)) == -1 &&
+               errno == EINTR);
+    }
+    return PE_OK;
+}
+
+/* Measure the time spent in every file callback, per fd (usec and calls
+ * of peFileEvent) and for the whole loop (busyusec). */
+void 
+peSetAccounting(peEventLoop *eventLoop, int enable) {
+    eventLoop->accounting = enable;
+}
+
+/* Measure how long every iteration works, from the return of the poll to
+ * the end of the deferred callbacks, in iterusec */
+void 
+peSetIterationTiming(peEventLoop *eventLoop, int enable) {
+    eventLoop->timing = enable;
+}
+
+/* Suspend (shed != 0) or resume reading from the fds of class
+ * PE_PRIO_LOW, leaving their registration in place: under overload the
+ * kernel socket buffers fill and push back on those clients, while the
+ * other classes keep being served. Returns the number of fds affected.
+ * Fds made PE_PRIO_LOW while shedding are only suspended by the next
+ * call, so is an fd resumed by peResumeLowPriority. */
+int 
+peShedLowPriority(peEventLoop *eventLoop, int shed) {
+    int j, count = 0;
+
+    if (eventLoop->shared) return 0;
+    if (!shed) return peResumeLowPriority(eventLoop, eventLoop->setsize);
+    eventLoop->shedding = 1;
+    for (j = 0; j <= eventLoop->maxfd; j++) {
+        peFileEvent *fe = &eventLoop->events[j];
+
+        if (fe->priority != PE_PRIO_LOW || !(fe->mask & PE_READABLE))
+            continue;
+        fe->mask &= ~PE_READABLE;
+        fe->flags |= PE_FE_SHED;
+        peApiDelEvent(eventLoop, j, PE_READABLE);
+        if (j > eventLoop->shedmaxfd) eventLoop->shedmaxfd = j;
+        count++;
+    }
+    return count;
+}
+
+/* Resume reading from at most max of the fds suspended by
+ * peShedLowPriority, so that a loop leaving overload takes its load back
+ * gradually. Returns the number of fds resumed; shedding ends once none
+ * is left suspended. */
+int 
+peResumeLowPriority(peEventLoop *eventLoop, int max) {
+    int j, count = 0;
+
+    if (!eventLoop->shedding) return 0;
+    for (j = 0; j <= eventLoop->shedmaxfd; j++) {
+        peFileEvent *fe = &eventLoop->events[j];
+
+        if (!(fe->flags & PE_FE_SHED)) continue;
+        if (count == max) return count;
+        fe->flags &= ~PE_FE_SHED;
+        if (peApiAddEvent(eventLoop, j, PE_READABLE) == -1) continue;
+        fe->mask |= PE_READABLE;
+        if (j > eventLoop->maxfd) eventLoop->maxfd = j;
+        count++;
+    }
+    eventLoop->shedding = 0;
+    eventLoop->shedmaxfd = -1;
+    return count;
+}
+
+int 
+peSetFileEventFlags(peEventLoop *eventLoop, int fd, int flags) {
+    if (fd >= eventLoop->setsize) return PE_ERR;
+    peFileEvent *fe = &eventLoop->events[fd];
+
+    if (fe->mask == PE_NONE) return PE_ERR;
+    fe->flags = flags;
+    return PE_OK;
+}
+
+/* Scratch memory released all at once at the end of the iteration, after
+ * the deferred callbacks: parsed requests, reply fragments and the like,
+ * without a pfree for each. Not to be kept across iterations (a
+ * coroutine waiting for an event, a callback deferred from a deferred
+ * callback), and not for loops run by peMainShared, which get NULL. */
+void *
+peArenaAlloc(peEventLoop *eventLoop, size_t size) {
+    if (eventLoop->shared) return NULL;
+    return pmalloc_arena_alloc(&eventLoop->arena, size);
+}
+
+/* Open a nested scope: peArenaPop gives back what was allocated since,
+ * for callbacks looping over many requests in one iteration. */
+pmalloc_arena_mark 
+peArenaPush(peEventLoop *eventLoop) {
+    return pmalloc_arena_save(&eventLoop->arena);
+}
+
+void 
+peArenaPop(peEventLoop *eventLoop, pmalloc_arena_mark mark) {
+    pmalloc_arena_restore(&eventLoop->arena, mark);
+}
+
+/* Called by pmalloc on the allocating thread: only wakes the loops up,
+ * processAsync reads the level and calls their memory proc. */
+static void 
+peMemoryNotify(int level, size_t used) {
+    pmalloc_watermark_proc *prev = __atomic_load_n(&peMemoryPrev, __ATOMIC_ACQUIRE);
+    uint64_t one = 1;
+    int i;
+
+    if (prev) prev(level, used);
+    pthread_mutex_lock(&peMemoryLock);
+    for (i = 0; i < PE_MEMORY_LOOPS; i++) {
+        if (peMemoryLoops[i] == NULL) continue;
+        while (write(peMemoryLoops[i]->wakefd, &one, sizeof(one)) == -1 &&
+               errno == EINTR);
+    }
+    pthread_mutex_unlock(&peMemoryLock);
+}
+
+/* Call proc on the loop whenever pmalloc_used_memory() crosses one of the
+ * watermarks set with pmalloc_set_watermarks, with the new PMALLOC_LEVEL_*:
+ * time to evict caches, stop reading from clients or refuse connections
+ * before allocations fail. A level already reached is reported at the
+ * next iteration. NULL removes the proc. Up to PE_MEMORY_LOOPS loops.
+ * The first call installs the watermark handler of the loops, which calls
+ * the one the application installed before; one installed later must
+ * call the handler it replaced. */
+int 
+peSetMemoryProc(peEventLoop *eventLoop, peMemoryProc *proc, void *clientData) {
+    uint64_t one = 1;
+    int i, slot = -1;
+
+    pthread_mutex_lock(&peMemoryLock);
+    for (i = 0; i < PE_MEMORY_LOOPS; i++) {
+        if (peMemoryLoops[i] == eventLoop) {
+            peMemoryLoops[i] = NULL;
+            slot = i;
+        } else if (peMemoryLoops[i] == NULL && slot == -1) {
+            slot = i;
+        }
+    }
+    if (proc && slot == -1) {
+        pthread_mutex_unlock(&peMemoryLock);
+        return PE_ERR;
+    }
+    eventLoop->memproc = proc;
+    eventLoop->memdata = clientData;
+    eventLoop->memlevel = PMALLOC_LEVEL_OK;
+    if (proc) peMemoryLoops[slot] = eventLoop;
+    if (proc && !peMemoryInstalled) {
+        pmalloc_watermark_proc *prev = pmalloc_set_watermark_handler(peMemoryNotify);
+
+        __atomic_store_n(&peMemoryPrev, prev, __ATOMIC_RELEASE);
+        peMemoryInstalled = 1;
+    }
+    pthread_mutex_unlock(&peMemoryLock);
+    if (proc == NULL) return PE_OK;
+
+    if (pmalloc_memory_level() != PMALLOC_LEVEL_OK) {
+        while (write(eventLoop->wakefd, &one, sizeof(one)) == -1 &&
+               errno == EINTR);
+    }
+    return PE_OK;
+}
@@ -9,6 +9,7 @@
 #include <poll.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "pmalloc.h"
 
@@ -32,6 +33,50 @@
 
 #define PE_NOTUSED(V) ((void) V)
 
+/* FileEvent priority classes, dispatched in ascending order */
+#define PE_PRIO_HIGH     0  /* control plane, replication */
+#define PE_PRIO_NORMAL   1  /* default for new registrations */
+#define PE_PRIO_LOW      2  /* bulk client traffic */
+#define PE_PRIO_CLASSES  3
+
+/* Iteration hook types */
+#define PE_HOOK_PREPARE  0  /* before polling */
+#define PE_HOOK_CHECK    1  /* after polling, before callbacks */
+#define PE_HOOK_IDLE     2  /* after an iteration that processed nothing,
+                               * the loop does not block while one exists */
+#define PE_HOOK_TYPES    3
+
+/* Events a thread takes per poll in shared mode: one keeps the others
+ * free to pick up the next ready fd */
+#define PE_SHARED_BATCH  1
+
+/* FileEvent flags */
+#define PE_FE_MIGRATABLE 1  /* the rebalancer may move the fd to another loop */
+#define PE_FE_SHED       2  /* reading suspended by peShedLowPriority */
+
+/* Default capacity of the deferred callbacks ring */
+#define PE_DEFER_QUEUE_SIZE 1024
+
+/* Background jobs: default microseconds of steps per iteration, and the
+ * factor bounding how far it grows on an idle loop. When events fire the
+ * budget converges to the time of their callbacks divided by the same
+ * factor. Finished jobs whose stats stay readable, per loop. */
+#define PE_JOB_BUDGET       1000
+#define PE_JOB_BUDGET_SCALE 4
+#define PE_JOB_KEEP         16
+
+/* Returned by a job step that has nothing to do for now, see
+ * peResumeBackgroundJob */
+#define PE_JOB_IDLE -2
+
+/* Tables sized by setsize (registered and fired events, the poll array):
+ * huge pages, on the node of the thread creating the loop. Create a loop
+ * on the thread that runs it. */
+#define PE_TABLE_FLAGS      (PMALLOC_LARGE_HUGE|PMALLOC_LARGE_LOCAL)
+
+/* Loops told of pmalloc watermark crossings, see peSetMemoryProc */
+#define PE_MEMORY_LOOPS     64
+
 /* Event Process Status */
 struct peEventLoop;
 
@@ -40,6 +85,11 @@ typedef void peFileProc(struct peEventLoop *eventLoop, int fd, void *clientData,
 typedef int  peTimeProc(struct peEventLoop *eventLoop, long long id, void *clientData);
 typedef void peEventFinalizerProc(struct peEventLoop *eventLoop, void *clientData);
 typedef void peBeforeSleepProc(struct peEventLoop *eventLoop);
+typedef void peHookProc(struct peEventLoop *eventLoop, void *clientData);
+typedef void peDeferProc(struct peEventLoop *eventLoop, void *clientData);
+typedef void peAsyncProc(struct peEventLoop *eventLoop, void *clientData);
+typedef int  peJobProc(struct peEventLoop *eventLoop, void *clientData);
+typedef void peMemoryProc(struct peEventLoop *eventLoop, int level, size_t used, void *clientData);
 
 /* File event structure */
 typedef struct peFileEvent {
@@ -49,12 +99,21 @@ typedef struct peFileEvent {
     peFileProc *wfileProc;
    
     void *clientData;
+
+    int priority; /* one of PE_PRIO_* */
+    int pending;  /* index+1 of the fd in eventLoop->pending, 0 if none */
+    int flags;    /* PE_FE_* */
+    int busy;     /* being dispatched by a thread, in shared mode */
+
+    long long usec;            /* time spent in callbacks, when accounting */
+    unsigned long long calls;  /* callbacks run, when accounting */
+    unsigned long long bytes;  /* read and written through pe_readbuf and pe_buf */
 } peFileEvent;
 
 /* Time event structure */
 typedef struct peTimeEvent {
 
-    long long id; /* time event identifier. */
+    long long id; /* time event identifier, unique across loops. */
 
     long when_sec; /* seconds */
     long when_ms; /* milliseconds */
@@ -65,6 +124,8 @@ typedef struct peTimeEvent {
 
     void *clientData;
 
+    int fd; /* fd the timer belongs to and migrates with, -1 if none */
+
     struct peTimeEvent *next;
 
 } peTimeEvent;
@@ -75,27 +136,158 @@ typedef struct peFiredEvent {
     int mask;
 } peFiredEvent;
 
+/* Iteration hook */
+typedef struct peHook {
+    long long id;
+    peHookProc *proc; /* NULL once deleted, until the slot is reclaimed */
+    void *clientData;
+} peHook;
+
+/* Callback posted to the loop by another thread */
+typedef struct peAsync {
+    peAsyncProc *proc;
+    void *clientData;
+    struct peAsync *next;
+} peAsync;
+
+/* Callback deferred to the end of the iteration */
+typedef struct peDeferred {
+    peDeferProc *proc;
+    void *clientData;
+} peDeferred;
+
+/* Progress of a background job */
+typedef struct peJobStats {
+    unsigned long long steps; /* calls to the step proc */
+    unsigned long long runs;  /* iterations the job got time in */
+    long long usec;           /* time spent in steps */
+    long long lag;            /* microseconds it waited before its last run */
+    long long maxlag;         /* longest wait between two runs */
+    int finished;             /* the step returned PE_NOMORE */
+} peJobStats;
+
+/* Incremental work run between events */
+typedef struct peJob {
+    long long id;
+    peJobProc *proc; /* NULL once finished or deleted, until reclaimed */
+    void *clientData;
+    int idle;          /* waiting for peResumeBackgroundJob */
+    long long lastrun; /* monotonic microseconds */
+    peJobStats stats;
+    struct peJob *next;
+} peJob;
+
 /* State of an event based program */
 typedef struct peEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
 
     int setsize; /* max number of file descriptors tracked */
 
-    long long timeEventNextId;
-
     time_t lastTime;     /* Used to detect system clock skew */
 
     peFileEvent *events; /* Registered events */
 
     peFiredEvent *fired; /* Fired events */
 
+    peFiredEvent *pending; /* Fired events waiting for dispatch */
+
+    int npending; /* Events the budget carried over to the next iteration */
+
+    int maxcallbacks; /* Max file callbacks per iteration, 0 = unlimited */
+
+    long long maxusec; /* Max microseconds of file callbacks per iteration */
+
     peTimeEvent *timeEventHead;
 
+    int numtimers; /* time events registered */
+
+    pmalloc_pool *timerpool; /* time event nodes */
+
+    pmalloc_arena arena; /* scratch memory of the iteration, see peArenaAlloc */
+
+    long long nexttimer; /* unix ms of the nearest timer at the last poll, 0 if none */
+
     int stop;
 
     void *apidata; /* This is used for polling API specific data */
 
     peBeforeSleepProc *beforesleep;
+
+    peHook *hooks[PE_HOOK_TYPES]; /* Registered hooks, by type */
+
+    int numhooks[PE_HOOK_TYPES];
+
+    long long hookNextId;
+
+    peDeferred *deferred; /* Ring of deferred callbacks */
+
+    unsigned long defersize; /* Ring capacity, a power of two */
+
+    unsigned long deferhead, defertail; /* Read and write positions */
+
+    struct peListener *listeners; /* Listeners accepting on this loop */
+
+    char *readbuf; /* Read buffer shared by connections, see pe_readbuf.c */
+
+    size_t readbufsize;
+
+    struct peReadBuffer *readbuffers; /* Connection buffers holding memory */
+
+    long long readbufidle; /* ms before an unused one is released, 0 = default */
+
+    long long readbufsweep; /* id of the sweep timer, -1 if none */
+
+    unsigned long readbufepoch; /* sweeps done so far */
+
+    struct peBufQueue *flushqueues; /* Output queues to flush before polling */
+
+    long long flushhook; /* id of the prepare hook flushing them, -1 if none */
+
+    peJob *jobs; /* Background jobs */
+
+    long long jobNextId;
+
+    long long jobbudget; /* usec of job steps per iteration */
+
+    long long jobcur; /* budget of the next iteration, follows the load */
+
+    peJob *jobsdone[PE_JOB_KEEP]; /* Last finished jobs, for their stats */
+
+    int jobsdonepos;
+
+    int timing; /* measure iterations, see peSetIterationTiming */
+
+    long long iterusec; /* time the last iteration spent working, when timing */
+
+    long long timerlate; /* ms the running or last timer fired late */
+
+    int shedding; /* reading from PE_PRIO_LOW fds is suspended */
+
+    int shedmaxfd; /* highest fd suspended */
+
+    peMemoryProc *memproc; /* told of PMALLOC_LEVEL_* changes */
+
+    void *memdata;
+
+    int memlevel; /* last level memproc was told of */
+
+    int wakefd; /* eventfd other threads write to interrupt the poll */
+
+    int woken;  /* the last poll was interrupted through wakefd */
+
+    pthread_mutex_t asynclock;
+
+    peAsync *asynchead, *asynctail; /* Callbacks posted by other threads */
+
+    int accounting; /* measure the time spent in every callback */
+
+    long long busyusec; /* time spent in file callbacks, when measured */
+
+    int shared; /* dispatched by several threads, see peMainShared */
+
+    pthread_mutex_t sharedlock; /* registrations, in shared mode */
+
+    pthread_mutex_t timelock;   /* time events, in shared mode */
 } peEventLoop;
 
 
@@ -106,14 +298,38 @@ int    peCreateFileEvent(peEventLoop *eventLoop, int fd, int mask,
                          peFileProc *proc, void *clientData);
 void   peDeleteFileEvent(peEventLoop *eventLoop, int fd, int mask);
 int    peGetFileEvents(peEventLoop *eventLoop, int fd);
+int    peSetFileEventPriority(peEventLoop *eventLoop, int fd, int priority);
+int    peGetFileEventPriority(peEventLoop *eventLoop, int fd);
+void   peSetProcessBudget(peEventLoop *eventLoop, int maxcallbacks, long long maxusec);
 long long peCreateTimeEvent(peEventLoop *eventLoop, long long milliseconds,
                             peTimeProc *proc, void *clientData, peEventFinalizerProc *finalizerProc);
 int    peDeleteTimeEvent(peEventLoop *eventLoop, long long id);
 int    peProcessEvents(peEventLoop *eventLoop, int flags);
 int    peWait(int fd, int mask, long long milliseconds);
 void   peMain(peEventLoop *eventLoop);
+int    peMainShared(peEventLoop *eventLoop, int numthreads);
 char  *peGetApiName(void);
 void   peSetBeforeSleepProc(peEventLoop *eventLoop, peBeforeSleepProc *beforesleep);
+long long peCreateHook(peEventLoop *eventLoop, int type, peHookProc *proc, void *clientData);
+int    peDeleteHook(peEventLoop *eventLoop, long long id);
+int    peDefer(peEventLoop *eventLoop, peDeferProc *proc, void *clientData);
+int    peSetDeferQueueSize(peEventLoop *eventLoop, unsigned long size);
+int    peRunInLoop(peEventLoop *eventLoop, peAsyncProc *proc, void *clientData);
+int    peSetTimeEventFd(peEventLoop *eventLoop, long long id, int fd);
+void   peSetAccounting(peEventLoop *eventLoop, int enable);
+int    peSetFileEventFlags(peEventLoop *eventLoop, int fd, int flags);
+long long peCreateBackgroundJob(peEventLoop *eventLoop, peJobProc *proc, void *clientData);
+int    peDeleteBackgroundJob(peEventLoop *eventLoop, long long id);
+int    peResumeBackgroundJob(peEventLoop *eventLoop, long long id);
+void   peSetBackgroundBudget(peEventLoop *eventLoop, long long usec);
+int    peGetBackgroundJobStats(peEventLoop *eventLoop, long long id, peJobStats *stats);
+void   peSetIterationTiming(peEventLoop *eventLoop, int enable);
+int    peShedLowPriority(peEventLoop *eventLoop, int shed);
+int    peResumeLowPriority(peEventLoop *eventLoop, int max);
+void  *peArenaAlloc(peEventLoop *eventLoop, size_t size);
+pmalloc_arena_mark peArenaPush(peEventLoop *eventLoop);
+void   peArenaPop(peEventLoop *eventLoop, pmalloc_arena_mark mark);
+int    peSetMemoryProc(peEventLoop *eventLoop, peMemoryProc *proc, void *clientData);
 
 #endif
 
@@ -0,0 +1,405 @@
+#include <stdarg.h>
+#include <errno.h>
+
+#include "pe_admin.h"
+
+/* Admin endpoint.
+ *
+ * A listener on the loop itself, usually a Unix socket or a loopback
+ * port, answering one request per connection with the state of the loop
+ * and of the allocator:
+ *
+ *   GET /metrics       Prometheus text format, over HTTP
+ *   GET /<anything>    plain text, over HTTP
+ *   metrics            Prometheus text format, raw
+ *   <anything else>    plain text, raw
+ *
+ * The fd table is what costs: counting the registered fds and finding the
+ * hottest ones means looking at every slot up to maxfd. The scan is done
+ * PE_ADMIN_SCAN fds at a time in a deferred callback, one step per
+ * iteration, so a scrape of a loop with many connections is spread over a
+ * few iterations instead of stalling one. Everything else is read from
+ * counters the loop keeps up to date. Callback times are only measured
+ * with peSetAccounting. */
+
+static long long
+peAdminMstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000 + tv.tv_usec/1000;
+}
+
+static void
+peAdminFree(peAdminClient *c) {
+    peDeleteFileEvent(c->eventLoop, c->fd, PE_READABLE|PE_WRITABLE);
+    close(c->fd);
+    if (c->admin) {
+        if (c->prev)
+            c->prev->next = c->next;
+        else
+            c->admin->clients = c->next;
+        if (c->next) c->next->prev = c->prev;
+        c->admin->numclients--;
+    }
+    pfree(c->out);
+    pfree(c);
+}
+
+static void
+peAdminPrintf(peAdminClient *c, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    while (1) {
+        size_t room = c->outsize - c->outlen;
+
+        va_start(ap, fmt);
+        n = vsnprintf(c->out ? c->out+c->outlen : NULL, room, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < room) break;
+        {
+            size_t size = c->outsize ? c->outsize*2 : 4096;
+            char *out;
+
+            while (size - c->outlen <= (size_t)n) size *= 2;
+            if ((out = prealloc(c->out, size)) == NULL) return;
+            c->out = out;
+            c->outsize = size;
+        }
+    }
+    c->outlen += n;
+}
+
+/* Keep the top topn of list sorted by key, decreasing */
+static int
+peAdminRank(peAdminFd *list, int count, int topn, const peAdminFd *fd,
+            unsigned long long (*key)(const peAdminFd *)) {
+    int j;
+
+    if (count == topn && key(fd) <= key(&list[count-1])) return count;
+    if (count < topn) count++;
+    for (j = count-1; j > 0 && key(&list[j-1]) < key(fd); j--)
+        list[j] = list[j-1];
+    list[j] = *fd;
+    return count;
+}
+
+static unsigned long long
+peAdminKeyTime(const peAdminFd *fd) {
+    return fd->usec;
+}
+
+static unsigned long long
+peAdminKeyBytes(const peAdminFd *fd) {
+    return fd->bytes;
+}
+
+static void
+peAdminText(peAdminClient *c, size_t used, size_t rss, long long next) {
+    peEventLoop *eventLoop = c->eventLoop;
+    int j;
+
+    peAdminPrintf(c, "used_memory:%zu\r\n", used);
+    peAdminPrintf(c, "rss:%zu\r\n", rss);
+    peAdminPrintf(c, "fragmentation_ratio:%.2f\r\n", used ? (double)rss/used : 0);
+    peAdminPrintf(c, "memory_level:%d\r\n", pmalloc_memory_level());
+    peAdminPrintf(c, "arena_memory:%zu\r\n", pmalloc_arena_memory());
+    peAdminPrintf(c, "loop_arena_highwater:%zu\r\n", eventLoop->arena.highwater);
+    peAdminPrintf(c, "fds:%d\r\n", c->numfds);
+    peAdminPrintf(c, "maxfd:%d\r\n", eventLoop->maxfd);
+    peAdminPrintf(c, "setsize:%d\r\n", eventLoop->setsize);
+    peAdminPrintf(c, "timers:%d\r\n", eventLoop->numtimers);
+    peAdminPrintf(c, "next_timer_ms:%lld\r\n", next);
+    peAdminPrintf(c, "accounting:%d\r\n", eventLoop->accounting);
+    peAdminPrintf(c, "busy_usec:%lld\r\n", eventLoop->busyusec);
+    if (eventLoop->timing)
+        peAdminPrintf(c, "iteration_usec:%lld\r\n", eventLoop->iterusec);
+    peAdminPrintf(c, "admin_requests:%llu\r\n", c->admin->requests);
+    peAdminPrintf(c, "top_fds_by_time:\r\n");
+    for (j = 0; j < c->ntime; j++)
+        peAdminPrintf(c, "  fd=%d usec=%lld calls=%llu bytes=%llu\r\n",
+                      c->bytime[j].fd, c->bytime[j].usec,
+                      c->bytime[j].calls, c->bytime[j].bytes);
+    peAdminPrintf(c, "top_fds_by_bytes:\r\n");
+    for (j = 0; j < c->nbytes; j++)
+        peAdminPrintf(c, "  fd=%d usec=%lld calls=%llu bytes=%llu\r\n",
+                      c->bybytes[j].fd, c->bybytes[j].usec,
+                      c->bybytes[j].calls, c->bybytes[j].bytes);
+}
+
+static void
+peAdminGauge(peAdminClient *c, const char *name, const char *help,
+             const char *type, const char *fmt, ...) {
+    char value[64];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(value, sizeof(value), fmt, ap);
+    va_end(ap);
+    peAdminPrintf(c, "# HELP %s %s\n# TYPE %s %s\n%s %s\n",
+                  name, help, name, type, name, value);
+}
+
+static void
+peAdminProm(peAdminClient *c, size_t used, size_t rss, long long next) {
+    peEventLoop *eventLoop = c->eventLoop;
+    peAdminFd *all[PE_ADMIN_TOPMAX*2];
+    int j, k, n = 0;
+
+    peAdminGauge(c, "pe_used_memory_bytes", "Memory allocated through pmalloc.",
+                 "gauge", "%zu", used);
+    peAdminGauge(c, "pe_rss_bytes", "Resident set size of the process.",
+                 "gauge", "%zu", rss);
+    peAdminGauge(c, "pe_fragmentation_ratio", "RSS over allocated memory.",
+                 "gauge", "%.3f", used ? (double)rss/used : 0);
+    peAdminGauge(c, "pe_memory_level", "Watermark level of pmalloc: 0 ok, 1 soft, 2 hard.",
+                 "gauge", "%d", pmalloc_memory_level());
+    peAdminGauge(c, "pe_arena_bytes", "Memory held by pmalloc arenas.",
+                 "gauge", "%zu", pmalloc_arena_memory());
+    peAdminGauge(c, "pe_loop_arena_highwater_bytes", "Most scratch memory used by one iteration.",
+                 "gauge", "%zu", eventLoop->arena.highwater);
+    peAdminGauge(c, "pe_registered_fds", "File descriptors registered on the loop.",
+                 "gauge", "%d", c->numfds);
+    peAdminGauge(c, "pe_maxfd", "Highest registered file descriptor.",
+                 "gauge", "%d", eventLoop->maxfd);
+    peAdminGauge(c, "pe_timers", "Time events registered on the loop.",
+                 "gauge", "%d", eventLoop->numtimers);
+    peAdminGauge(c, "pe_next_timer_seconds", "Time before the nearest timer, -1 if none.",
+                 "gauge", "%.3f", next < 0 ? -1.0 : next/1000.0);
+    peAdminGauge(c, "pe_busy_seconds_total", "Time spent in file callbacks, when accounting.",
+                 "counter", "%.6f", eventLoop->busyusec/1e6);
+    peAdminGauge(c, "pe_admin_requests_total", "Admin requests served.",
+                 "counter", "%llu", c->admin->requests);
+
+    /* The union of both rankings, each fd once */
+    for (j = 0; j < c->ntime; j++) all[n++] = &c->bytime[j];
+    for (j = 0; j < c->nbytes; j++) {
+        for (k = 0; k < c->ntime; k++)
+            if (c->bytime[k].fd == c->bybytes[j].fd) break;
+        if (k == c->ntime) all[n++] = &c->bybytes[j];
+    }
+    peAdminPrintf(c, "# HELP pe_fd_callback_seconds_total Time spent in the callbacks of the hottest fds.\n"
+                     "# TYPE pe_fd_callback_seconds_total counter\n");
+    for (j = 0; j < n; j++)
+        peAdminPrintf(c, "pe_fd_callback_seconds_total{fd=\"%d\"} %.6f\n",
+                      all[j]->fd, all[j]->usec/1e6);
+    peAdminPrintf(c, "# HELP pe_fd_callbacks_total Callbacks run for the hottest fds.\n"
+                     "# TYPE pe_fd_callbacks_total counter\n");
+    for (j = 0; j < n; j++)
+        peAdminPrintf(c, "pe_fd_callbacks_total{fd=\"%d\"} %llu\n",
+                      all[j]->fd, all[j]->calls);
+    peAdminPrintf(c, "# HELP pe_fd_bytes_total Bytes read and written by the hottest fds.\n"
+                     "# TYPE pe_fd_bytes_total counter\n");
+    for (j = 0; j < n; j++)
+        peAdminPrintf(c, "pe_fd_bytes_total{fd=\"%d\"} %llu\n",
+                      all[j]->fd, all[j]->bytes);
+}
+
+static void
+peAdminWritable(struct peEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    peAdminClient *c = clientData;
+    PE_NOTUSED(eventLoop);
+    PE_NOTUSED(mask);
+
+    while (c->outpos < c->outlen) {
+        ssize_t n = write(fd, c->out+c->outpos, c->outlen-c->outpos);
+
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            break;
+        }
+        c->outpos += n;
+    }
+    peAdminFree(c);
+}
+
+static void
+peAdminReply(peAdminClient *c) {
+    size_t used = pmalloc_used_memory(), rss = pmalloc_get_rss(), hdr = 0;
+    long long next = -1;
+
+    if (c->eventLoop->nexttimer) {
+        next = c->eventLoop->nexttimer - peAdminMstime();
+        if (next < 0) next = 0;
+    }
+    if (c->http) {
+        /* Room for the header, filled once the body length is known */
+        peAdminPrintf(c, "%128s", "");
+        hdr = c->outlen;
+    }
+    if (c->format == PE_ADMIN_PROM)
+        peAdminProm(c, used, rss, next);
+    else
+        peAdminText(c, used, rss, next);
+    if (c->out == NULL) {
+        peAdminFree(c);
+        return;
+    }
+    if (c->http) {
+        char head[128];
+        int n = snprintf(head, sizeof(head),
+                         "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n"
+                         "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                         c->format == PE_ADMIN_PROM ?
+                         "text/plain; version=0.0.4" : "text/plain",
+                         c->outlen-hdr);
+
+        c->outpos = hdr-n;
+        memcpy(c->out+c->outpos, head, n);
+    }
+    if (peCreateFileEvent(c->eventLoop, c->fd, PE_WRITABLE,
+                          peAdminWritable, c) == PE_ERR) {
+        peAdminFree(c);
+        return;
+    }
+    /* The socket is most likely writable already */
+    peAdminWritable(c->eventLoop, c->fd, c, PE_WRITABLE);
+}
+
+static void
+peAdminScan(struct peEventLoop *eventLoop, void *clientData) {
+    peAdminClient *c = clientData;
+    int end = c->scanfd + PE_ADMIN_SCAN;
+
+    c->scanning = 0;
+    if (c->admin == NULL) {
+        peAdminFree(c);
+        return;
+    }
+    if (end > eventLoop->maxfd+1) end = eventLoop->maxfd+1;
+    for (; c->scanfd < end; c->scanfd++) {
+        peFileEvent *fe = &eventLoop->events[c->scanfd];
+        peAdminFd fd;
+
+        if (fe->mask == PE_NONE && !(fe->flags & PE_FE_SHED)) continue;
+        c->numfds++;
+        if (fe->usec == 0 && fe->bytes == 0) continue;
+        fd.fd = c->scanfd;
+        fd.usec = fe->usec;
+        fd.calls = fe->calls;
+        fd.bytes = fe->bytes;
+        if (fe->usec)
+            c->ntime = peAdminRank(c->bytime, c->ntime, c->topn, &fd, peAdminKeyTime);
+        if (fe->bytes)
+            c->nbytes = peAdminRank(c->bybytes, c->nbytes, c->topn, &fd, peAdminKeyBytes);
+    }
+    if (c->scanfd <= eventLoop->maxfd) {
+        if (peDefer(eventLoop, peAdminScan, c) == PE_OK) {
+            c->scanning = 1;
+            return;
+        }
+        /* The defer ring is full: reply with what was seen */
+    }
+    c->admin->requests++;
+    peAdminReply(c);
+}
+
+static void
+peAdminParse(peAdminClient *c) {
+    char *req = c->req, *end;
+
+    c->req[c->reqlen < PE_ADMIN_REQMAX ? c->reqlen : PE_ADMIN_REQMAX-1] = '\0';
+    if ((end = strpbrk(req, "\r\n")) != NULL) *end = '\0';
+    c->format = PE_ADMIN_TEXT;
+    if (strncmp(req, "GET ", 4) == 0) {
+        c->http = 1;
+        req += 4;
+        if (strncmp(req, "/metrics", 8) == 0 &&
+            (req[8] == ' ' || req[8] == '?' || req[8] == '\0'))
+            c->format = PE_ADMIN_PROM;
+    } else if (strcmp(req, "metrics") == 0) {
+        c->format = PE_ADMIN_PROM;
+    }
+}
+
+static void
+peAdminReadable(struct peEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    peAdminClient *c = clientData;
+    ssize_t n;
+    PE_NOTUSED(mask);
+
+    n = read(fd, c->req+c->reqlen, PE_ADMIN_REQMAX-1-c->reqlen);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n > 0) {
+        c->reqlen += n;
+        if (memchr(c->req+c->reqlen-n, '\n', n) == NULL &&
+            c->reqlen < PE_ADMIN_REQMAX-1)
+            return;
+    } else if (n == -1 || c->reqlen == 0) {
+        peAdminFree(c);
+        return;
+    }
+
+    /* A line, a full buffer or a request without newline before EOF */
+    peDeleteFileEvent(eventLoop, fd, PE_READABLE);
+    peAdminParse(c);
+    c->scanfd = 0;
+    c->scanning = 1;
+    peAdminScan(eventLoop, c);
+}
+
+static void
+peAdminAccept(struct peEventLoop *eventLoop, int fd, struct sockaddr *sa,
+              socklen_t salen, void *clientData) {
+    peAdmin *admin = clientData;
+    peAdminClient *c;
+    PE_NOTUSED(sa);
+    PE_NOTUSED(salen);
+
+    if (admin->numclients >= PE_ADMIN_CLIENTS ||
+        (c = pcalloc(sizeof(*c))) == NULL) {
+        admin->rejected++;
+        close(fd);
+        return;
+    }
+    c->admin = admin;
+    c->eventLoop = eventLoop;
+    c->fd = fd;
+    c->topn = admin->topn;
+    if (peCreateFileEvent(eventLoop, fd, PE_READABLE, peAdminReadable, c) == PE_ERR) {
+        close(fd);
+        pfree(c);
+        return;
+    }
+    c->next = admin->clients;
+    if (c->next) c->next->prev = c;
+    admin->clients = c;
+    admin->numclients++;
+}
+
+/* Serve the admin endpoint of eventLoop on addr, see peCreateListener for
+ * the address syntax. topn hottest fds are reported, 0 for the default. */
+peAdmin *
+peCreateAdmin(peEventLoop *eventLoop, const char *addr, int topn) {
+    peAdmin *admin;
+
+    if ((admin = pcalloc(sizeof(*admin))) == NULL) return NULL;
+    admin->eventLoop = eventLoop;
+    if (topn <= 0) topn = PE_ADMIN_TOPN;
+    admin->topn = topn > PE_ADMIN_TOPMAX ? PE_ADMIN_TOPMAX : topn;
+    admin->listener = peCreateListener(eventLoop, addr, 16, NULL,
+                                       peAdminAccept, admin);
+    if (admin->listener == NULL) {
+        pfree(admin);
+        return NULL;
+    }
+    return admin;
+}
+
+/* Close the listener and the connections. A request in the middle of a
+ * scan is dropped by its next step. */
+void
+peDeleteAdmin(peAdmin *admin) {
+    peAdminClient *c, *next;
+
+    peDeleteListener(admin->listener);
+    for (c = admin->clients; c; c = next) {
+        next = c->next;
+        c->admin = NULL;
+        if (!c->scanning) peAdminFree(c);
+    }
+    pfree(admin);
+}
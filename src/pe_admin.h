@@ -0,0 +1,63 @@
+#ifndef __PE_ADMIN_H__
+#define __PE_ADMIN_H__
+
+#include "pe.h"
+#include "pe_listener.h"
+
+/* Default number of hottest fds reported, and the max */
+#define PE_ADMIN_TOPN     10
+#define PE_ADMIN_TOPMAX   64
+
+/* Fds examined per loop iteration while answering a request */
+#define PE_ADMIN_SCAN     1024
+
+/* Longest request line, and admin connections served at once */
+#define PE_ADMIN_REQMAX   1024
+#define PE_ADMIN_CLIENTS  16
+
+/* Reply formats */
+#define PE_ADMIN_TEXT     0
+#define PE_ADMIN_PROM     1
+
+typedef struct peAdminFd {
+    int fd;
+    long long usec;
+    unsigned long long calls;
+    unsigned long long bytes;
+} peAdminFd;
+
+/* A request being answered */
+typedef struct peAdminClient {
+    struct peAdmin *admin; /* NULL once the admin is deleted */
+    peEventLoop *eventLoop;
+    int fd;
+    char req[PE_ADMIN_REQMAX];
+    size_t reqlen;
+    int http;       /* reply with an HTTP header */
+    int format;     /* PE_ADMIN_* */
+    int scanning;   /* a scan step is deferred */
+    int scanfd;     /* next fd to examine */
+    int numfds;     /* registered fds seen so far */
+    int topn;
+    int ntime, nbytes;
+    peAdminFd bytime[PE_ADMIN_TOPMAX];
+    peAdminFd bybytes[PE_ADMIN_TOPMAX];
+    char *out;      /* reply, written from outpos */
+    size_t outlen, outpos, outsize;
+    struct peAdminClient *prev, *next;
+} peAdminClient;
+
+typedef struct peAdmin {
+    peEventLoop *eventLoop;
+    peListener *listener;
+    int topn;
+    int numclients;
+    unsigned long long requests;
+    unsigned long long rejected; /* connections over PE_ADMIN_CLIENTS */
+    peAdminClient *clients;
+} peAdmin;
+
+peAdmin *peCreateAdmin(peEventLoop *eventLoop, const char *addr, int topn);
+void   peDeleteAdmin(peAdmin *admin);
+
+#endif
@@ -0,0 +1,211 @@
+#include <sys/uio.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "pe_buf.h"
+
+/* Zero copy fan-out.
+ *
+ * A message sent to many fds is stored once in a reference counted
+ * buffer, and every output queue holds a slice of it: a reference, an
+ * offset and a length. Queues are flushed with writev(), so a queue of
+ * many small messages costs one system call. Memory and CPU of a
+ * broadcast grow with the number of messages, not with messages times
+ * receivers.
+ *
+ * A queue that receives data while empty is not written at once but put
+ * on a list of the loop, flushed by a prepare hook before the next poll:
+ * everything pushed during an iteration goes out with a single writev(),
+ * without waiting for a writable event. PE_WRITABLE is only registered
+ * for what the kernel did not take. */
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Create a buffer holding a copy of data, or uninitialized if data is
+ * NULL, to be filled by the creator before it is shared. */
+peBuf *
+peBufCreate(const void *data, size_t len) {
+    peBuf *buf;
+
+    if ((buf = pmalloc(sizeof(*buf)+len)) == NULL) return NULL;
+    buf->refs = 1;
+    buf->len = len;
+    if (data) memcpy(buf->data, data, len);
+    return buf;
+}
+
+peBuf *
+peBufRetain(peBuf *buf) {
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+void
+peBufRelease(peBuf *buf) {
+    if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        pfree(buf);
+}
+
+/* writeProc is registered for PE_WRITABLE on fd, with clientData, while
+ * the queue holds data that could not be written at once: it must call
+ * peBufQueueFlush. */
+int
+peBufQueueInit(peEventLoop *eventLoop, peBufQueue *q, int fd,
+               peFileProc *writeProc, void *clientData) {
+    q->eventLoop = eventLoop;
+    q->fd = fd;
+    q->writeProc = writeProc;
+    q->clientData = clientData;
+    q->head = q->count = 0;
+    q->size = PE_BUFQ_INIT;
+    q->bytes = 0;
+    q->writing = 0;
+    q->flushing = 0;
+    q->prev = q->next = NULL;
+    if ((q->slices = pmalloc(sizeof(peBufSlice)*q->size)) == NULL) return PE_ERR;
+    return PE_OK;
+}
+
+static void
+peBufQueueUnlink(peBufQueue *q) {
+    if (q->prev)
+        q->prev->next = q->next;
+    else
+        q->eventLoop->flushqueues = q->next;
+    if (q->next) q->next->prev = q->prev;
+    q->prev = q->next = NULL;
+    q->flushing = 0;
+}
+
+static void
+peBufQueueFlushAll(struct peEventLoop *eventLoop, void *clientData) {
+    peBufQueue *q;
+    PE_NOTUSED(clientData);
+
+    while ((q = eventLoop->flushqueues) != NULL) {
+        peBufQueueUnlink(q);
+        /* Let writeProc see the error on its own flush */
+        if (peBufQueueFlush(q) == PE_ERR && !q->writing &&
+            peCreateFileEvent(eventLoop, q->fd, PE_WRITABLE,
+                              q->writeProc, q->clientData) == PE_OK)
+            q->writing = 1;
+    }
+}
+
+/* Drop what is still queued */
+void
+peBufQueueFree(peBufQueue *q) {
+    if (q->flushing) peBufQueueUnlink(q);
+    while (q->count) {
+        peBufRelease(q->slices[q->head].buf);
+        q->head = (q->head+1) % q->size;
+        q->count--;
+    }
+    if (q->writing) peDeleteFileEvent(q->eventLoop, q->fd, PE_WRITABLE);
+    q->writing = 0;
+    q->bytes = 0;
+    pfree(q->slices);
+    q->slices = NULL;
+}
+
+static int
+peBufQueueGrow(peBufQueue *q) {
+    peBufSlice *slices;
+    int j;
+
+    if ((slices = pmalloc(sizeof(peBufSlice)*q->size*2)) == NULL) return PE_ERR;
+    for (j = 0; j < q->count; j++)
+        slices[j] = q->slices[(q->head+j) % q->size];
+    pfree(q->slices);
+    q->slices = slices;
+    q->head = 0;
+    q->size *= 2;
+    return PE_OK;
+}
+
+/* Queue len bytes of buf from off, taking a reference. Written before
+ * the next poll, write errors are reported to writeProc by
+ * peBufQueueFlush. */
+int
+peBufQueuePush(peBufQueue *q, peBuf *buf, size_t off, size_t len) {
+    peBufSlice *slice;
+
+    if (len == 0) return PE_OK;
+    if (q->count == q->size && peBufQueueGrow(q) == PE_ERR) return PE_ERR;
+    slice = &q->slices[(q->head+q->count) % q->size];
+    slice->buf = peBufRetain(buf);
+    slice->off = off;
+    slice->len = len;
+    q->count++;
+    q->bytes += len;
+    if (!q->writing && !q->flushing) {
+        peEventLoop *eventLoop = q->eventLoop;
+
+        if (eventLoop->flushhook == -1 &&
+            (eventLoop->flushhook = peCreateHook(eventLoop, PE_HOOK_PREPARE,
+                                                 peBufQueueFlushAll, NULL)) == PE_ERR) {
+            eventLoop->flushhook = -1;
+            return peBufQueueFlush(q);
+        }
+        q->prev = NULL;
+        q->next = eventLoop->flushqueues;
+        if (q->next) q->next->prev = q;
+        eventLoop->flushqueues = q;
+        q->flushing = 1;
+    }
+    return PE_OK;
+}
+
+/* Write as much as possible, registering or deregistering writeProc as
+ * needed. Returns PE_ERR on write error. */
+int
+peBufQueueFlush(peBufQueue *q) {
+    struct iovec iov[IOV_MAX];
+
+    while (q->count) {
+        int j, n = q->count < IOV_MAX ? q->count : IOV_MAX;
+        ssize_t nwritten;
+
+        for (j = 0; j < n; j++) {
+            peBufSlice *slice = &q->slices[(q->head+j) % q->size];
+
+            iov[j].iov_base = slice->buf->data + slice->off;
+            iov[j].iov_len = slice->len;
+        }
+        nwritten = writev(q->fd, iov, n);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return PE_ERR;
+        }
+        q->bytes -= nwritten;
+        if (q->fd < q->eventLoop->setsize)
+            q->eventLoop->events[q->fd].bytes += nwritten;
+        while (nwritten > 0) {
+            peBufSlice *slice = &q->slices[q->head];
+
+            if ((size_t)nwritten < slice->len) {
+                slice->off += nwritten;
+                slice->len -= nwritten;
+                break;
+            }
+            nwritten -= slice->len;
+            peBufRelease(slice->buf);
+            q->head = (q->head+1) % q->size;
+            q->count--;
+        }
+    }
+
+    if (q->count && !q->writing) {
+        if (peCreateFileEvent(q->eventLoop, q->fd, PE_WRITABLE,
+                              q->writeProc, q->clientData) == PE_ERR)
+            return PE_ERR;
+        q->writing = 1;
+    } else if (q->count == 0 && q->writing) {
+        peDeleteFileEvent(q->eventLoop, q->fd, PE_WRITABLE);
+        q->writing = 0;
+    }
+    return PE_OK;
+}
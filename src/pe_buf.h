@@ -0,0 +1,48 @@
+#ifndef __PE_BUF_H__
+#define __PE_BUF_H__
+
+#include "pe.h"
+
+/* Initial number of slices of an output queue */
+#define PE_BUFQ_INIT 16
+
+/* Immutable reference counted buffer. The creator holds the first
+ * reference; buffers may be shared by queues of different loops. */
+typedef struct peBuf {
+    int refs;
+    size_t len;
+    char data[];
+} peBuf;
+
+/* A part of a buffer waiting to be written */
+typedef struct peBufSlice {
+    peBuf *buf;
+    size_t off;
+    size_t len;
+} peBufSlice;
+
+/* Output queue of a fd, flushed with writev() */
+typedef struct peBufQueue {
+    peEventLoop *eventLoop;
+    int fd;
+    peFileProc *writeProc;  /* calls peBufQueueFlush, registered while not empty */
+    void *clientData;
+    peBufSlice *slices;     /* ring */
+    int head, count, size;
+    size_t bytes;           /* bytes queued */
+    int writing;            /* PE_WRITABLE is registered */
+    int flushing;           /* in eventLoop->flushqueues */
+    struct peBufQueue *prev, *next;
+} peBufQueue;
+
+peBuf *peBufCreate(const void *data, size_t len);
+peBuf *peBufRetain(peBuf *buf);
+void   peBufRelease(peBuf *buf);
+
+int    peBufQueueInit(peEventLoop *eventLoop, peBufQueue *q, int fd,
+                      peFileProc *writeProc, void *clientData);
+void   peBufQueueFree(peBufQueue *q);
+int    peBufQueuePush(peBufQueue *q, peBuf *buf, size_t off, size_t len);
+int    peBufQueueFlush(peBufQueue *q);
+
+#endif
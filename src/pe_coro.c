@@ -0,0 +1,339 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "pe_coro.h"
+
+/* Stackful coroutines on top of the event loop.
+ *
+ * Every coroutine owns a stack taken from a per-thread pool. Stacks are
+ * mapped by slabs of PE_CORO_SLAB_STACKS with a PROT_NONE guard page below
+ * each of them, so an overflow faults instead of silently corrupting the
+ * neighbour, and are never returned to the system: spawning a coroutine
+ * costs a pop from a free list once the pool is warm. Every guard page
+ * splits the mapping in two, so a guarded stack costs two mappings.
+ * Guarded stacks may use at most half of vm.max_map_count, that is
+ * max_map_count/4 stacks (about 16k by default): beyond that new slabs
+ * are mapped unguarded rather than making mmap fail for everybody.
+ *
+ * The coroutine descriptor lives at the top of its own stack, so neither
+ * spawning nor awaiting allocates. Context switching only saves the callee
+ * saved registers and the stack pointer, no signal mask is touched. */
+
+typedef struct peCoro {
+    void *sp;      /* saved stack pointer of the suspended coroutine */
+    void *caller;  /* saved stack pointer of whoever resumed it */
+    peEventLoop *eventLoop;
+    peCoroProc *proc;
+    void *arg;
+    int done;
+    int mask;      /* result of the last awaited file event */
+    char *stack;   /* lowest usable address of the stack */
+    struct peCoro *parent; /* coroutine active when this one was resumed */
+    struct peCoro *next;   /* free list of the pool */
+} peCoro;
+
+static __thread peCoro *pe_coro_current = NULL;
+static __thread peCoro *pe_coro_free = NULL;
+static long pe_coro_guards = -1; /* guard pages left, -1 until known */
+
+void pe_coro_switch(void **from, void **to);
+void pe_coro_start(void);
+void pe_coro_main(peCoro *co) __attribute__((used, noinline, noreturn));
+
+#if defined(__x86_64__)
+#define PE_CORO_SUPPORTED 1
+__asm__(
+    ".text\n"
+    ".globl pe_coro_switch\n"
+    ".hidden pe_coro_switch\n"
+    ".type pe_coro_switch,@function\n"
+    "pe_coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size pe_coro_switch,.-pe_coro_switch\n"
+    ".globl pe_coro_start\n"
+    ".hidden pe_coro_start\n"
+    ".type pe_coro_start,@function\n"
+    "pe_coro_start:\n"
+    "    movq %r12, %rdi\n"
+    "    call pe_coro_main\n"
+    "    ud2\n"
+    ".size pe_coro_start,.-pe_coro_start\n"
+);
+
+/* Build the frame pe_coro_switch pops when the coroutine first runs:
+ * six callee saved registers (r12 carries the coroutine) and the return
+ * address, leaving the stack 16 bytes aligned at pe_coro_start. */
+static void *
+peCoroInitFrame(peCoro *co, char *top) {
+    uint64_t *sp = (uint64_t *)(top - 16);
+
+    *--sp = (uint64_t)pe_coro_start;
+    *--sp = 0;                  /* rbp */
+    *--sp = 0;                  /* rbx */
+    *--sp = (uint64_t)co;       /* r12 */
+    *--sp = 0;                  /* r13 */
+    *--sp = 0;                  /* r14 */
+    *--sp = 0;                  /* r15 */
+    return sp;
+}
+#elif defined(__aarch64__)
+#define PE_CORO_SUPPORTED 1
+__asm__(
+    ".text\n"
+    ".globl pe_coro_switch\n"
+    ".hidden pe_coro_switch\n"
+    ".type pe_coro_switch,%function\n"
+    "pe_coro_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    ldr x9, [x1]\n"
+    "    mov sp, x9\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size pe_coro_switch,.-pe_coro_switch\n"
+    ".globl pe_coro_start\n"
+    ".hidden pe_coro_start\n"
+    ".type pe_coro_start,%function\n"
+    "pe_coro_start:\n"
+    "    mov x0, x19\n"
+    "    bl pe_coro_main\n"
+    "    brk #0\n"
+    ".size pe_coro_start,.-pe_coro_start\n"
+);
+
+/* Build the frame pe_coro_switch restores when the coroutine first runs:
+ * x19 carries the coroutine and x30 returns into pe_coro_start. */
+static void *
+peCoroInitFrame(peCoro *co, char *top) {
+    uint64_t *sp = (uint64_t *)(top - 160);
+
+    memset(sp, 0, 160);
+    sp[0] = (uint64_t)co;              /* x19 */
+    sp[11] = (uint64_t)pe_coro_start;  /* x30 */
+    return sp;
+}
+#endif
+
+#ifdef PE_CORO_SUPPORTED
+/* Take the guard pages for a slab out of the process wide budget */
+static int
+peCoroTakeGuards(void) {
+    long left = __atomic_load_n(&pe_coro_guards, __ATOMIC_RELAXED);
+
+    if (left == -1) {
+        FILE *fp = fopen("/proc/sys/vm/max_map_count", "r");
+        long maxmaps = 65530;
+
+        if (fp) {
+            if (fscanf(fp, "%ld", &maxmaps) != 1) maxmaps = 65530;
+            fclose(fp);
+        }
+        /* half of the mappings, two per guarded stack */
+        __atomic_compare_exchange_n(&pe_coro_guards, &left, maxmaps/4, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        left = __atomic_load_n(&pe_coro_guards, __ATOMIC_RELAXED);
+    }
+    while (left >= PE_CORO_SLAB_STACKS) {
+        if (__atomic_compare_exchange_n(&pe_coro_guards, &left,
+                                        left-PE_CORO_SLAB_STACKS, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
+/* Map a new slab of stacks and put them in the thread pool */
+static int
+peCoroRefill(void) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t stride = PE_CORO_STACK_SIZE + page;
+    int guarded = peCoroTakeGuards();
+    char *slab;
+    int j;
+
+    slab = mmap(NULL, stride*PE_CORO_SLAB_STACKS, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (slab == MAP_FAILED) return PE_ERR;
+    for (j = 0; j < PE_CORO_SLAB_STACKS; j++) {
+        char *guard = slab + stride*j;
+        char *top = guard + stride;
+        peCoro *co;
+
+        if (guarded) mprotect(guard, page, PROT_NONE);
+        co = (peCoro *)((uintptr_t)(top - sizeof(peCoro)) & ~(uintptr_t)15);
+        co->stack = guard + page;
+        co->next = pe_coro_free;
+        pe_coro_free = co;
+    }
+    return PE_OK;
+}
+
+static void
+peCoroResume(peCoro *co) {
+    co->parent = pe_coro_current;
+    pe_coro_current = co;
+    pe_coro_switch(&co->caller, &co->sp);
+    pe_coro_current = co->parent;
+    if (co->done) {
+        co->next = pe_coro_free;
+        pe_coro_free = co;
+    }
+}
+
+static void
+peCoroSuspend(peCoro *co) {
+    pe_coro_switch(&co->sp, &co->caller);
+}
+
+void
+pe_coro_main(peCoro *co) {
+    co->proc(co->eventLoop, co->arg);
+    co->done = 1;
+    peCoroSuspend(co);
+    abort(); /* a finished coroutine is never resumed */
+}
+
+int
+peGo(peEventLoop *eventLoop, peCoroProc *proc, void *arg) {
+    peCoro *co;
+
+    if (pe_coro_free == NULL && peCoroRefill() == PE_ERR) return PE_ERR;
+    co = pe_coro_free;
+    pe_coro_free = co->next;
+
+    co->eventLoop = eventLoop;
+    co->proc = proc;
+    co->arg = arg;
+    co->done = 0;
+    co->mask = PE_NONE;
+    co->sp = peCoroInitFrame(co, (char *)((uintptr_t)co & ~(uintptr_t)15));
+    peCoroResume(co);
+    return PE_OK;
+}
+
+static void
+peCoroFileReady(struct peEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    peCoro *co = clientData;
+
+    co->mask = mask;
+    peDeleteFileEvent(eventLoop, fd, PE_READABLE|PE_WRITABLE);
+    peCoroResume(co);
+}
+
+static int
+peCoroTimeReady(struct peEventLoop *eventLoop, long long id, void *clientData) {
+    PE_NOTUSED(eventLoop);
+    PE_NOTUSED(id);
+    peCoroResume(clientData);
+    return PE_NOMORE;
+}
+
+static void
+peCoroDeferReady(struct peEventLoop *eventLoop, void *clientData) {
+    PE_NOTUSED(eventLoop);
+    peCoroResume(clientData);
+}
+
+static int
+peCoroAwait(int fd, int mask) {
+    peCoro *co = pe_coro_current;
+
+    if (co == NULL) return PE_ERR;
+    if (peGetFileEvents(co->eventLoop, fd) != PE_NONE) return PE_ERR;
+    if (peCreateFileEvent(co->eventLoop, fd, mask, peCoroFileReady, co) == PE_ERR)
+        return PE_ERR;
+    peCoroSuspend(co);
+    return co->mask;
+}
+
+/* Suspend the running coroutine until fd is readable. Returns the fired
+ * mask, or PE_ERR outside a coroutine or if fd can't be watched. */
+int
+peAwaitReadable(int fd) {
+    return peCoroAwait(fd, PE_READABLE);
+}
+
+int
+peAwaitWritable(int fd) {
+    return peCoroAwait(fd, PE_WRITABLE);
+}
+
+int
+peSleep(long long milliseconds) {
+    peCoro *co = pe_coro_current;
+
+    if (co == NULL) return PE_ERR;
+    if (peCreateTimeEvent(co->eventLoop, milliseconds, peCoroTimeReady,
+                          co, NULL) == PE_ERR)
+        return PE_ERR;
+    peCoroSuspend(co);
+    return PE_OK;
+}
+
+/* Let the loop run and resume at the end of the current iteration */
+int
+peYield(void) {
+    peCoro *co = pe_coro_current;
+
+    if (co == NULL) return PE_ERR;
+    if (peDefer(co->eventLoop, peCoroDeferReady, co) == PE_ERR) return PE_ERR;
+    peCoroSuspend(co);
+    return PE_OK;
+}
+
+int
+peInCoroutine(void) {
+    return pe_coro_current != NULL;
+}
+#else
+/* No hand written context switch for this architecture */
+int
+peGo(peEventLoop *eventLoop, peCoroProc *proc, void *arg) {
+    PE_NOTUSED(eventLoop);
+    PE_NOTUSED(proc);
+    PE_NOTUSED(arg);
+    return PE_ERR;
+}
+
+int peAwaitReadable(int fd) { PE_NOTUSED(fd); return PE_ERR; }
+int peAwaitWritable(int fd) { PE_NOTUSED(fd); return PE_ERR; }
+int peSleep(long long milliseconds) { PE_NOTUSED(milliseconds); return PE_ERR; }
+int peYield(void) { return PE_ERR; }
+int peInCoroutine(void) { return 0; }
+#endif
@@ -0,0 +1,28 @@
+#ifndef __PE_CORO_H__
+#define __PE_CORO_H__
+
+#include "pe.h"
+
+/* Usable stack of every coroutine, a guard page is added below it */
+#ifndef PE_CORO_STACK_SIZE
+#define PE_CORO_STACK_SIZE (64*1024)
+#endif
+
+/* Stacks mapped at once when the pool of the thread is empty */
+#define PE_CORO_SLAB_STACKS 64
+
+typedef void peCoroProc(struct peEventLoop *eventLoop, void *arg);
+
+/* Spawn proc as a coroutine of eventLoop. It starts running immediately
+ * and returns to the caller at its first await. */
+int    peGo(peEventLoop *eventLoop, peCoroProc *proc, void *arg);
+
+/* Awaitables, only valid inside a coroutine. The fd must not have other
+ * handlers registered on the loop while a coroutine waits on it. */
+int    peAwaitReadable(int fd);
+int    peAwaitWritable(int fd);
+int    peSleep(long long milliseconds);
+int    peYield(void);
+int    peInCoroutine(void);
+
+#endif
@@ -1,4 +1,5 @@
 #include <sys/epoll.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include "pmalloc.h"
@@ -14,14 +15,15 @@ peApiCreate(peEventLoop *eventLoop) {
     peApiState *state = pmalloc(sizeof(peApiState));
 
     if (!state) return -1;
-    state->events = pmalloc(sizeof(struct epoll_event)*eventLoop->setsize);
+    state->events = pmalloc_large(sizeof(struct epoll_event)*eventLoop->setsize,
+                                  PE_TABLE_FLAGS);
     if (!state->events) {
         pfree(state);
         return -1;
     }
     state->epfd = epoll_create(1024); /* 1024 is just an hint for the kernel */
     if (state->epfd == -1) {
-        pfree(state->events);
+        pfree_large(state->events);
         pfree(state);
         return -1;
     }
@@ -34,7 +36,7 @@ peApiFree(peEventLoop *eventLoop) {
     peApiState *state = eventLoop->apidata;
 
     close(state->epfd);
-    pfree(state->events);
+    pfree_large(state->events);
     pfree(state);
 }
 
@@ -51,12 +53,29 @@ peApiAddEvent(peEventLoop *eventLoop, int fd, int mask) {
     mask |= eventLoop->events[fd].mask; /* Merge old events */
     if (mask & PE_READABLE) ee.events |= EPOLLIN;
     if (mask & PE_WRITABLE) ee.events |= EPOLLOUT;
+    if (eventLoop->shared) {
+        /* The fd is armed again by peApiRearm once its callback returns */
+        if (eventLoop->events[fd].busy) return 0;
+        ee.events |= EPOLLONESHOT;
+    }
     ee.data.u64 = 0; /* avoid valgrind warning */
     ee.data.fd = fd;
     if (epoll_ctl(state->epfd,op,fd,&ee) == -1) return -1;
     return 0;
 }
 
+/* Watch the loop wake fd, outside of the registered events */
+static int 
+peApiAddWake(peEventLoop *eventLoop) {
+    peApiState *state = eventLoop->apidata;
+    struct epoll_event ee;
+
+    ee.events = EPOLLIN;
+    ee.data.u64 = 0; /* avoid valgrind warning */
+    ee.data.fd = eventLoop->wakefd;
+    return epoll_ctl(state->epfd,EPOLL_CTL_ADD,eventLoop->wakefd,&ee);
+}
+
 static void 
 peApiDelEvent(peEventLoop *eventLoop, int fd, int delmask) {
     peApiState *state = eventLoop->apidata;
@@ -69,6 +88,10 @@ peApiDelEvent(peEventLoop *eventLoop, int fd, int delmask) {
     ee.data.u64 = 0; /* avoid valgrind warning */
     ee.data.fd = fd;
     if (mask != PE_NONE) {
+        if (eventLoop->shared) {
+            if (eventLoop->events[fd].busy) return;
+            ee.events |= EPOLLONESHOT;
+        }
         epoll_ctl(state->epfd,EPOLL_CTL_MOD,fd,&ee);
     } else {
         /* Note, Kernel < 2.6.9 requires a non null event pointer even for
@@ -87,18 +110,88 @@ peApiPoll(peEventLoop *eventLoop, struct timeval *tvp) {
     if (retval > 0) {
         int j;
 
-        numevents = retval;
-        for (j = 0; j < numevents; j++) {
+        for (j = 0; j < retval; j++) {
             int mask = 0;
             struct epoll_event *e = state->events+j;
 
+            if (e->data.fd == eventLoop->wakefd) {
+                eventLoop->woken = 1;
+                continue;
+            }
             if (e->events & EPOLLIN)  mask |= PE_READABLE;
             if (e->events & EPOLLOUT) mask |= PE_WRITABLE;
             if (e->events & EPOLLERR) mask |= PE_WRITABLE;
             if (e->events & EPOLLHUP) mask |= PE_WRITABLE;
-            eventLoop->fired[j].fd = e->data.fd;
-            eventLoop->fired[j].mask = mask;
+            eventLoop->fired[numevents].fd = e->data.fd;
+            eventLoop->fired[numevents].mask = mask;
+            numevents++;
+        }
+    }
+    return numevents;
+}
+
+/* Shared mode: arm fd again after its callback, with the mask it has now.
+ * The callback may have deleted and added it back, hence the ADD. */
+static void 
+peApiRearm(peEventLoop *eventLoop, int fd) {
+    peApiState *state = eventLoop->apidata;
+    int mask = eventLoop->events[fd].mask;
+    struct epoll_event ee;
+
+    ee.events = EPOLLONESHOT;
+    if (mask & PE_READABLE) ee.events |= EPOLLIN;
+    if (mask & PE_WRITABLE) ee.events |= EPOLLOUT;
+    ee.data.u64 = 0; /* avoid valgrind warning */
+    ee.data.fd = fd;
+    if (epoll_ctl(state->epfd,EPOLL_CTL_MOD,fd,&ee) == -1 && errno == ENOENT)
+        epoll_ctl(state->epfd,EPOLL_CTL_ADD,fd,&ee);
+}
+
+/* Switch every registered fd to or from one-shot notifications */
+static int 
+peApiSetShared(peEventLoop *eventLoop, int shared) {
+    peApiState *state = eventLoop->apidata;
+    int fd;
+
+    for (fd = 0; fd <= eventLoop->maxfd; fd++) {
+        int mask = eventLoop->events[fd].mask;
+        struct epoll_event ee;
+
+        if (mask == PE_NONE) continue;
+        ee.events = shared ? EPOLLONESHOT : 0;
+        if (mask & PE_READABLE) ee.events |= EPOLLIN;
+        if (mask & PE_WRITABLE) ee.events |= EPOLLOUT;
+        ee.data.u64 = 0; /* avoid valgrind warning */
+        ee.data.fd = fd;
+        if (epoll_ctl(state->epfd,EPOLL_CTL_MOD,fd,&ee) == -1) return -1;
+    }
+    return 0;
+}
+
+/* Shared mode poll: results go to the fired array of the calling thread */
+static int 
+peApiPollShared(peEventLoop *eventLoop, peFiredEvent *fired, int size,
+                int timeout, int *woken) {
+    peApiState *state = eventLoop->apidata;
+    struct epoll_event events[size];
+    int retval, j, numevents = 0;
+
+    retval = epoll_wait(state->epfd,events,size,timeout);
+    for (j = 0; j < retval; j++) {
+        int mask = 0;
+        struct epoll_event *e = events+j;
+
+        if (e->data.fd == eventLoop->wakefd) {
+            *woken = 1;
+            continue;
         }
+        if (e->events & EPOLLIN)  mask |= PE_READABLE;
+        if (e->events & EPOLLOUT) mask |= PE_WRITABLE;
+        if (e->events & EPOLLERR) mask |= PE_WRITABLE;
+        if (e->events & EPOLLHUP) mask |= PE_WRITABLE;
+        fired[numevents].fd = e->data.fd;
+        fired[numevents].mask = mask;
+        numevents++;
     }
     return numevents;
 }
@@ -0,0 +1,313 @@
+#include <stdint.h>
+
+#include "pe_frame.h"
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <immintrin.h>
+#define PE_FRAME_HAVE_X86 1
+#endif
+
+/* Framing decoders.
+ *
+ * peFramerDecode cuts the bytes of a read, typically the data returned by
+ * peReadBufferRead, into frames pointing into them, up to a batch at a
+ * time, and tells how many bytes they consumed: the rest goes back with
+ * peReadBufferKeep and is passed again, followed by new data, on the next
+ * call. The framer remembers how much of it was already scanned, so a long
+ * line arriving in many reads is not rescanned from the start every time.
+ *
+ * Delimiters are located with SSE2 or AVX2, chosen at runtime: every
+ * block of 16 or 32 bytes is compared at once and the bit mask of the
+ * matches is walked, so many small lines cost a few instructions each and
+ * long ones are skipped a block at a time. Length prefixed frames need no
+ * scanning at all. */
+
+typedef int peFrameScanProc(const char *p, size_t len, char c, size_t *pos,
+                            int max, size_t *examined);
+
+/* Store in pos the offsets of up to max occurrences of c, returning how
+ * many were found. examined is set to the bytes covered: len if less than
+ * max were found, past the last occurrence otherwise. */
+static int
+peFrameScanScalar(const char *p, size_t len, char c, size_t *pos,
+                  int max, size_t *examined) {
+    int k = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (p[i] != c) continue;
+        pos[k++] = i;
+        if (k == max) {
+            *examined = i+1;
+            return k;
+        }
+    }
+    *examined = len;
+    return k;
+}
+
+#ifdef PE_FRAME_HAVE_X86
+/* The tail shorter than a block goes through the scalar scanner */
+static int
+peFrameScanTail(const char *p, size_t i, size_t len, char c, size_t *pos,
+                int k, int max, size_t *examined) {
+    int j, n;
+
+    n = peFrameScanScalar(p+i, len-i, c, pos+k, max-k, examined);
+    for (j = k; j < k+n; j++) pos[j] += i;
+    *examined += i;
+    return k+n;
+}
+
+static int
+peFrameScanSse2(const char *p, size_t len, char c, size_t *pos,
+                int max, size_t *examined) {
+    __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    int k = 0;
+
+    for (; i+16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p+i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+
+        while (mask) {
+            pos[k++] = i+__builtin_ctz(mask);
+            if (k == max) {
+                *examined = pos[k-1]+1;
+                return k;
+            }
+            mask &= mask-1;
+        }
+    }
+    return peFrameScanTail(p, i, len, c, pos, k, max, examined);
+}
+
+__attribute__((target("avx2")))
+static int
+peFrameScanAvx2(const char *p, size_t len, char c, size_t *pos,
+                int max, size_t *examined) {
+    __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+    int k = 0;
+
+    for (; i+32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(p+i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+
+        while (mask) {
+            pos[k++] = i+__builtin_ctz(mask);
+            if (k == max) {
+                *examined = pos[k-1]+1;
+                return k;
+            }
+            mask &= mask-1;
+        }
+    }
+    return peFrameScanTail(p, i, len, c, pos, k, max, examined);
+}
+#endif
+
+static peFrameScanProc *peFrameScan = NULL;
+
+/* Force a scanner, for benchmarks: returns the level in effect, lower than
+ * asked when the CPU lacks it. A negative level picks the best one. */
+int
+peFrameSetSimd(int level) {
+    int best = PE_FRAME_SCALAR;
+
+#ifdef PE_FRAME_HAVE_X86
+    best = PE_FRAME_SSE2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) best = PE_FRAME_AVX2;
+#endif
+    if (level < 0 || level > best) level = best;
+    switch (level) {
+#ifdef PE_FRAME_HAVE_X86
+    case PE_FRAME_AVX2: peFrameScan = peFrameScanAvx2; break;
+    case PE_FRAME_SSE2: peFrameScan = peFrameScanSse2; break;
+#endif
+    default: peFrameScan = peFrameScanScalar; break;
+    }
+    return level;
+}
+
+void
+peFramerInit(peFramer *framer, int type, size_t maxlen) {
+    if (peFrameScan == NULL) peFrameSetSimd(-1);
+    framer->type = type;
+    framer->maxlen = maxlen ? maxlen : PE_FRAME_MAXLEN;
+    framer->scanned = 0;
+}
+
+/* To call when the next data does not start with the bytes left
+ * unconsumed by the last decode */
+void
+peFramerReset(peFramer *framer) {
+    framer->scanned = 0;
+}
+
+/* Lines: one scan collects the delimiters of a whole batch */
+static int
+peFrameLines(peFramer *framer, const char *data, size_t len,
+             peFrame *frames, int maxframes, size_t *consumed) {
+    size_t pos[PE_FRAME_BATCH], start = 0, from, examined;
+    int n = 0, err = 0;
+
+    from = framer->scanned < len ? framer->scanned : len;
+    while (n < maxframes && from < len) {
+        int j, k, want = maxframes-n;
+
+        if (want > PE_FRAME_BATCH) want = PE_FRAME_BATCH;
+        k = peFrameScan(data+from, len-from, '\n', pos, want, &examined);
+        for (j = 0; j < k; j++) {
+            size_t end = from+pos[j];
+
+            if (framer->type == PE_FRAME_CRLF) {
+                /* A lone \n is part of the line */
+                if (end == start || data[end-1] != '\r') continue;
+                end--;
+            }
+            if (end-start > framer->maxlen) {
+                err = 1;
+                break;
+            }
+            frames[n].data = data+start;
+            frames[n].len = end-start;
+            n++;
+            start = from+pos[j]+1;
+        }
+        from += examined;
+        if (err || k < want) break;
+    }
+    if (!err && from-start > framer->maxlen) err = 1;
+    framer->scanned = from-start;
+    *consumed = start;
+    return (err && n == 0) ? PE_ERR : n;
+}
+
+/* Length of a frame with a length header at p, -1 if invalid. The
+ * payload starts at p + *hdrlen, left to 0 if the frame is incomplete. */
+static long long
+peFramePrefix(peFramer *framer, const unsigned char *p, size_t len,
+              size_t *hdrlen) {
+    unsigned long long flen = 0;
+    size_t h;
+
+    if (framer->type == PE_FRAME_U32) {
+        if (len < 4) return 0;
+        flen = ((uint32_t)p[0]<<24)|((uint32_t)p[1]<<16)|((uint32_t)p[2]<<8)|p[3];
+        h = 4;
+    } else {
+        int shift = 0;
+
+        for (h = 0; ; h++, shift += 7) {
+            if (h == len) return 0;
+            if (h == 10) return -1;
+            flen |= (unsigned long long)(p[h] & 0x7f) << shift;
+            if ((p[h] & 0x80) == 0) break;
+        }
+        h++;
+    }
+    if (flen > framer->maxlen) return -1;
+    if (len-h < flen) return 0;
+    *hdrlen = h;
+    return flen;
+}
+
+/* Parse the integer of a RESP header line, -2 if invalid */
+static long long
+peFrameRespInt(const char *p, size_t len) {
+    long long v = 0;
+    size_t i = 0;
+    int neg = 0;
+
+    if (len && p[0] == '-') {
+        neg = 1;
+        i++;
+    }
+    if (i == len || len-i > 18) return -2;
+    for (; i < len; i++) {
+        if (p[i] < '0' || p[i] > '9') return -2;
+        v = v*10 + (p[i]-'0');
+    }
+    return neg ? -v : v;
+}
+
+/* Length of the complete RESP value at p, 0 if incomplete, -1 if invalid.
+ * Nested arrays only add to the count of values still to parse. */
+static long long
+peFrameResp(peFramer *framer, const char *p, size_t len) {
+    long long remaining = 1, v;
+    size_t o = 0, nl, examined;
+
+    while (remaining) {
+        if (o >= len) return 0;
+        if (peFrameScan(p+o, len-o, '\n', &nl, 1, &examined) == 0)
+            return (len-o > framer->maxlen) ? -1 : 0;
+        nl += o;
+        if (nl-o < 2 || p[nl-1] != '\r') return -1;
+        remaining--;
+        switch (p[o]) {
+        case '+': case '-': case ':': case '_': case ',': case '#':
+            o = nl+1;
+            break;
+        case '$':
+            if ((v = peFrameRespInt(p+o+1, nl-1-o-1)) == -2 ||
+                v < -1 || (v > 0 && (unsigned long long)v > framer->maxlen))
+                return -1;
+            o = nl+1;
+            if (v >= 0) {
+                if (len-o < (size_t)v+2) return 0;
+                if (p[o+v] != '\r' || p[o+v+1] != '\n') return -1;
+                o += v+2;
+            }
+            break;
+        case '*':
+            if ((v = peFrameRespInt(p+o+1, nl-1-o-1)) == -2 ||
+                v < -1 || (v > 0 && (unsigned long long)v > framer->maxlen))
+                return -1;
+            if (v > 0) remaining += v;
+            o = nl+1;
+            break;
+        default:
+            return -1;
+        }
+        if (o > framer->maxlen) return -1;
+    }
+    return o;
+}
+
+/* Decode up to maxframes frames from data. Returns how many, or PE_ERR on
+ * a protocol error before the first one; consumed is set to the bytes
+ * they cover. Call again while maxframes frames are returned. */
+int
+peFramerDecode(peFramer *framer, const char *data, size_t len,
+               peFrame *frames, int maxframes, size_t *consumed) {
+    size_t start = 0;
+    int n = 0;
+
+    if (framer->type == PE_FRAME_LF || framer->type == PE_FRAME_CRLF)
+        return peFrameLines(framer, data, len, frames, maxframes, consumed);
+
+    while (n < maxframes && start < len) {
+        long long flen;
+        size_t hdrlen = 0;
+
+        if (framer->type == PE_FRAME_RESP)
+            flen = peFrameResp(framer, data+start, len-start);
+        else
+            flen = peFramePrefix(framer, (const unsigned char *)data+start,
+                                 len-start, &hdrlen);
+        if (flen == -1) {
+            *consumed = start;
+            return n ? n : PE_ERR;
+        }
+        if (flen == 0 && hdrlen == 0) break; /* incomplete */
+        frames[n].data = data+start+hdrlen;
+        frames[n].len = flen;
+        n++;
+        start += hdrlen+flen;
+    }
+    *consumed = start;
+    return n;
+}
@@ -0,0 +1,43 @@
+#ifndef __PE_FRAME_H__
+#define __PE_FRAME_H__
+
+#include "pe.h"
+
+/* Framing protocols */
+#define PE_FRAME_LF      0  /* lines ending with \n */
+#define PE_FRAME_CRLF    1  /* lines ending with \r\n */
+#define PE_FRAME_U32     2  /* 4 bytes big endian length, then payload */
+#define PE_FRAME_VARINT  3  /* LEB128 length, then payload */
+#define PE_FRAME_RESP    4  /* one complete RESP value, arrays included */
+
+/* Scanner implementations, see peFrameSetSimd */
+#define PE_FRAME_SCALAR  0
+#define PE_FRAME_SSE2    1
+#define PE_FRAME_AVX2    2
+
+/* Delimiters collected per scan */
+#define PE_FRAME_BATCH   64
+
+/* Default max frame length */
+#define PE_FRAME_MAXLEN  (64*1024*1024)
+
+/* A frame, pointing into the decoded data: delimiters and length headers
+ * are stripped, RESP values are returned whole. */
+typedef struct peFrame {
+    const char *data;
+    size_t len;
+} peFrame;
+
+typedef struct peFramer {
+    int type;
+    size_t maxlen;
+    size_t scanned; /* bytes of the unconsumed data known to hold no delimiter */
+} peFramer;
+
+void   peFramerInit(peFramer *framer, int type, size_t maxlen);
+void   peFramerReset(peFramer *framer);
+int    peFramerDecode(peFramer *framer, const char *data, size_t len,
+                      peFrame *frames, int maxframes, size_t *consumed);
+int    peFrameSetSimd(int level);
+
+#endif
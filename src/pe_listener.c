@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "pe_listener.h"
+
+/* Accepting listener.
+ *
+ * Every readable event drains the accept queue with accept4() up to the
+ * batch size, handing out non blocking, close-on-exec fds, so a storm of
+ * connections costs one wakeup per batch instead of one per connection,
+ * while the batch bound keeps the other fds of the loop served.
+ *
+ * When the process runs out of fds accept fails with EMFILE and the
+ * pending connection keeps the listener readable: the loop would spin at
+ * 100% CPU. A reserve fd is kept open for this case, closed to accept the
+ * connection and hang it up at once, then reopened. Without a reserve,
+ * because reopening it failed too, the listener is paused and accepts
+ * again PE_LISTEN_RETRY milliseconds later. */
+
+static long long
+peListenerUstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+static int
+peListenerReserve(void) {
+    return open("/dev/null", O_RDONLY|O_CLOEXEC);
+}
+
+/* Create a bound socket for "unix:/path", "/path", "host:port",
+ * "[v6host]:port" or ":port" (any address). Returns -1 on error. */
+static int
+peListenerBind(const char *addr, const peListenerOptions *opts) {
+    int fd, yes = 1;
+
+    if (addr[0] == '/' || strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un sa;
+        const char *path = addr[0] == '/' ? addr : addr+5;
+
+        if (strlen(path) >= sizeof(sa.sun_path)) return -1;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strcpy(sa.sun_path, path);
+        fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (fd == -1) return -1;
+        unlink(path); /* stale socket of a previous run */
+        if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    } else {
+        struct addrinfo hints, *servinfo, *p;
+        char host[256];
+        const char *port = strrchr(addr, ':');
+        size_t hostlen;
+
+        if (port == NULL) return -1;
+        hostlen = port - addr;
+        if (addr[0] == '[' && hostlen >= 2 && addr[hostlen-1] == ']') {
+            addr++;
+            hostlen -= 2;
+        }
+        if (hostlen >= sizeof(host)) return -1;
+        memcpy(host, addr, hostlen);
+        host[hostlen] = '\0';
+        port++;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo((hostlen && strcmp(host, "*")) ? host : NULL, port,
+                        &hints, &servinfo) != 0)
+            return -1;
+        fd = -1;
+        for (p = servinfo; p != NULL; p = p->ai_next) {
+            fd = socket(p->ai_family, p->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC,
+                        p->ai_protocol);
+            if (fd == -1) continue;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if (opts && opts->reuseport &&
+                setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1)
+                goto next;
+            if (bind(fd, p->ai_addr, p->ai_addrlen) == -1) goto next;
+            break;
+ next:
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(servinfo);
+        if (fd == -1) return -1;
+        /* Best effort, missing kernel support only costs performance */
+        if (opts && opts->deferaccept)
+            setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                       &opts->deferaccept, sizeof(opts->deferaccept));
+        if (opts && opts->fastopen)
+            setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+                       &opts->fastopen, sizeof(opts->fastopen));
+        return fd;
+    }
+}
+
+static int
+peListenerRetry(struct peEventLoop *eventLoop, long long id, void *clientData) {
+    peListener *listener = clientData;
+    PE_NOTUSED(eventLoop);
+    PE_NOTUSED(id);
+
+    listener->retry = -1;
+    if (listener->reservefd == -1)
+        listener->reservefd = peListenerReserve();
+    /* Unless the application paused or resumed it in the meantime */
+    if (listener->starved) {
+        listener->starved = 0;
+        peListenerResume(listener);
+    }
+    return PE_NOMORE;
+}
+
+/* Out of fds: the pending connection would keep the listener readable */
+static void
+peListenerStarve(peListener *listener) {
+    listener->stats.starved++;
+    peListenerPause(listener);
+    listener->starved = 1;
+    if (listener->retry == -1)
+        listener->retry = peCreateTimeEvent(listener->eventLoop, PE_LISTEN_RETRY,
+                                            peListenerRetry, listener, NULL);
+}
+
+static void
+peListenerFree(peListener *listener) {
+    pfree(listener->addr);
+    pfree(listener);
+}
+
+static void
+peListenerAccept(struct peEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    peListener *listener = clientData;
+    int accepted = 0;
+    PE_NOTUSED(mask);
+
+    listener->busy = 1;
+    listener->stats.wakeups++;
+    while (accepted < listener->batch && !listener->closing &&
+           !listener->paused) {
+        struct sockaddr_storage sa;
+        socklen_t salen = sizeof(sa);
+        int cfd;
+
+        cfd = accept4(fd, (struct sockaddr *)&sa, &salen,
+                      SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (cfd == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EMFILE || errno == ENFILE) {
+                if (listener->reservefd != -1) {
+                    close(listener->reservefd);
+                    cfd = accept(fd, NULL, NULL);
+                    if (cfd != -1) {
+                        close(cfd);
+                        listener->stats.dropped++;
+                    }
+                    listener->reservefd = peListenerReserve();
+                    if (cfd != -1) {
+                        accepted++;
+                        continue;
+                    }
+                }
+                peListenerStarve(listener);
+                break;
+            }
+            listener->stats.errors++;
+            /* The peer went away before we accepted it: try the next one */
+            if (errno == ECONNABORTED || errno == EPROTO) continue;
+            break;
+        }
+        accepted++;
+        if (listener->stats.accepted++ == 0)
+            listener->stats.firstaccept = peListenerUstime();
+        listener->proc(eventLoop, cfd, (struct sockaddr *)&sa, salen,
+                       listener->clientData);
+    }
+    listener->stats.lastbatch = accepted;
+    if (accepted > listener->stats.maxbatch)
+        listener->stats.maxbatch = accepted;
+    listener->busy = 0;
+    if (listener->closing) peListenerFree(listener);
+}
+
+/* Listen on addr and call proc for every accepted connection, on
+ * eventLoop. Returns NULL on error. Listeners still open when their loop
+ * is deleted are deleted with it. */
+peListener *
+peCreateListener(peEventLoop *eventLoop, const char *addr, int backlog,
+                 const peListenerOptions *opts,
+                 peAcceptProc *proc, void *clientData) {
+    peListener *listener;
+    int fd;
+
+    if ((fd = peListenerBind(addr, opts)) == -1) return NULL;
+    if (listen(fd, backlog) == -1) {
+        close(fd);
+        return NULL;
+    }
+    if ((listener = peCreateListenerFromFd(eventLoop, fd, addr, opts,
+                                           proc, clientData)) == NULL)
+        close(fd);
+    return listener;
+}
+
+/* Accept on fd, a socket already listening, for instance inherited from
+ * the previous process on upgrade. addr is only informative. The fd is
+ * owned by the listener on success. */
+peListener *
+peCreateListenerFromFd(peEventLoop *eventLoop, int fd, const char *addr,
+                       const peListenerOptions *opts,
+                       peAcceptProc *proc, void *clientData) {
+    peListener *listener;
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+        fcntl(fd, F_SETFL, flags|O_NONBLOCK) == -1 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+        return NULL;
+
+    listener = pcalloc(sizeof(*listener));
+    listener->eventLoop = eventLoop;
+    listener->fd = fd;
+    listener->reservefd = peListenerReserve();
+    listener->retry = -1;
+    listener->batch = (opts && opts->batch > 0) ? opts->batch : PE_LISTEN_BATCH;
+    listener->addr = pstrdup(addr);
+    listener->proc = proc;
+    listener->clientData = clientData;
+    listener->stats.created = peListenerUstime();
+    if (peCreateFileEvent(eventLoop, fd, PE_READABLE,
+                          peListenerAccept, listener) == PE_ERR) {
+        if (listener->reservefd != -1) close(listener->reservefd);
+        peListenerFree(listener);
+        return NULL;
+    }
+    listener->next = eventLoop->listeners;
+    eventLoop->listeners = listener;
+    return listener;
+}
+
+/* Stop accepting and close the listening socket. Safe to call from the
+ * accept callback of the same listener. */
+void
+peDeleteListener(peListener *listener) {
+    peListener **lp = &listener->eventLoop->listeners;
+
+    while (*lp && *lp != listener) lp = &(*lp)->next;
+    if (*lp) *lp = listener->next;
+
+    if (!listener->paused)
+        peDeleteFileEvent(listener->eventLoop, listener->fd, PE_READABLE);
+    if (listener->retry != -1)
+        peDeleteTimeEvent(listener->eventLoop, listener->retry);
+    close(listener->fd);
+    if (listener->reservefd != -1) close(listener->reservefd);
+    if (listener->busy)
+        listener->closing = 1;
+    else
+        peListenerFree(listener);
+}
+
+/* Stop accepting without closing the socket: new connections wait in the
+ * kernel accept queue, up to the backlog. */
+int
+peListenerPause(peListener *listener) {
+    listener->starved = 0;
+    if (listener->paused) return PE_OK;
+    peDeleteFileEvent(listener->eventLoop, listener->fd, PE_READABLE);
+    listener->paused = 1;
+    return PE_OK;
+}
+
+int
+peListenerResume(peListener *listener) {
+    listener->starved = 0;
+    if (!listener->paused) return PE_OK;
+    if (peCreateFileEvent(listener->eventLoop, listener->fd, PE_READABLE,
+                          peListenerAccept, listener) == PE_ERR)
+        return PE_ERR;
+    listener->paused = 0;
+    return PE_OK;
+}
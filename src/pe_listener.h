@@ -0,0 +1,65 @@
+#ifndef __PE_LISTENER_H__
+#define __PE_LISTENER_H__
+
+#include <sys/socket.h>
+
+#include "pe.h"
+
+/* Default number of connections accepted per readable event */
+#define PE_LISTEN_BATCH 64
+
+/* Milliseconds a listener out of fds waits before accepting again */
+#define PE_LISTEN_RETRY 100
+
+typedef void peAcceptProc(struct peEventLoop *eventLoop, int fd,
+                          struct sockaddr *sa, socklen_t salen, void *clientData);
+
+/* Socket tuning applied at creation, a NULL pointer means all defaults */
+typedef struct peListenerOptions {
+    int batch;        /* max accept4() calls per wakeup, 0 = PE_LISTEN_BATCH */
+    int reuseport;    /* SO_REUSEPORT, to have a listener per loop */
+    int deferaccept;  /* TCP_DEFER_ACCEPT seconds, 0 = off */
+    int fastopen;     /* TCP_FASTOPEN queue length, 0 = off */
+} peListenerOptions;
+
+typedef struct peListenerStats {
+    unsigned long long wakeups;  /* readable events served */
+    unsigned long long accepted; /* connections handed to the callback */
+    unsigned long long dropped;  /* connections closed for lack of fds */
+    unsigned long long errors;   /* other accept failures */
+    unsigned long long starved;  /* pauses for lack of fds */
+    int lastbatch;               /* accepted by the last wakeup */
+    int maxbatch;                /* most accepted by a single wakeup */
+    long long created;           /* unix time in microseconds */
+    long long firstaccept;       /* time of the first accept, 0 if none */
+} peListenerStats;
+
+typedef struct peListener {
+    peEventLoop *eventLoop;
+    int fd;
+    int reservefd; /* kept open to shed connections when out of fds */
+    int batch;
+    char *addr;
+    peAcceptProc *proc;
+    void *clientData;
+    int busy;      /* inside the accept handler */
+    int closing;   /* deleted by the callback, freed on handler exit */
+    int paused;    /* not accepting, the kernel keeps queueing */
+    int shed;      /* paused by overload protection, see pe_overload.c */
+    int starved;   /* paused for lack of fds until the retry timer fires */
+    long long retry; /* id of the retry timer, -1 if none */
+    peListenerStats stats;
+    struct peListener *next;
+} peListener;
+
+peListener *peCreateListener(peEventLoop *eventLoop, const char *addr, int backlog,
+                             const peListenerOptions *opts,
+                             peAcceptProc *proc, void *clientData);
+peListener *peCreateListenerFromFd(peEventLoop *eventLoop, int fd, const char *addr,
+                                   const peListenerOptions *opts,
+                                   peAcceptProc *proc, void *clientData);
+void   peDeleteListener(peListener *listener);
+int    peListenerPause(peListener *listener);
+int    peListenerResume(peListener *listener);
+
+#endif
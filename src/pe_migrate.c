@@ -0,0 +1,273 @@
+#include "pe_migrate.h"
+
+/* Live fd migration between loops.
+ *
+ * The fd is deregistered from the source loop on the source thread, its
+ * registration (mask, procs, clientData, priority, flags, accounting) and
+ * the timers bound to it with peSetTimeEventFd are packed in a message,
+ * and the message is posted to the destination loop with peRunInLoop. The
+ * destination registers everything again on its own thread. Pollers are
+ * level triggered, so readiness that shows up in between is not lost.
+ *
+ * Time events keep their id, which is unique across loops, and their
+ * absolute deadline. Their nodes are copied, as every loop allocates them
+ * from its own pool. */
+
+typedef struct peMigration {
+    int fd;
+    int mask;
+    int priority;
+    int flags;
+    peFileProc *rfileProc;
+    peFileProc *wfileProc;
+    void *clientData;
+    long long usec;
+    unsigned long long calls;
+    unsigned long long bytes;
+    peTimeEvent *timers;
+    peMigrateDoneProc *done;
+    peEventLoop *src;  /* where to go back without done, NULL on the way back */
+} peMigration;
+
+static void
+peMigrateAdopt(struct peEventLoop *eventLoop, void *clientData) {
+    peMigration *m = clientData;
+    int status = PE_OK;
+    peTimeEvent *te;
+
+    if ((m->mask & PE_READABLE) &&
+        peCreateFileEvent(eventLoop, m->fd, PE_READABLE,
+                          m->rfileProc, m->clientData) == PE_ERR)
+        status = PE_ERR;
+    if (status == PE_OK && (m->mask & PE_WRITABLE) &&
+        peCreateFileEvent(eventLoop, m->fd, PE_WRITABLE,
+                          m->wfileProc, m->clientData) == PE_ERR)
+        status = PE_ERR;
+
+    if (status == PE_OK) {
+        peFileEvent *fe = &eventLoop->events[m->fd];
+
+        fe->priority = m->priority;
+        fe->flags = m->flags;
+        fe->usec = m->usec;
+        fe->calls = m->calls;
+        fe->bytes = m->bytes;
+    } else {
+        peDeleteFileEvent(eventLoop, m->fd, m->mask);
+        /* Nobody owns the fd: register it again on the source loop,
+         * timers included, rather than leaking it */
+        if (m->done == NULL && m->src) {
+            peEventLoop *src = m->src;
+
+            m->src = NULL;
+            if (peRunInLoop(src, peMigrateAdopt, m) == PE_OK) return;
+        }
+    }
+
+    while ((te = m->timers) != NULL) {
+        peTimeEvent *node = NULL;
+
+        m->timers = te->next;
+        /* A timer that can't be registered is finalized like a refused one */
+        if (status == PE_OK &&
+            (node = pmalloc_pool_get(eventLoop->timerpool)) != NULL) {
+            *node = *te;
+            node->next = eventLoop->timeEventHead;
+            eventLoop->timeEventHead = node;
+            eventLoop->numtimers++;
+        } else if (te->finalizerProc) {
+            te->finalizerProc(eventLoop, te->clientData);
+        }
+        pfree(te);
+    }
+
+    if (m->done) m->done(eventLoop, m->fd, m->clientData, status);
+    pfree(m);
+}
+
+/* Move the registration of fd from src to dst. Must be called on the
+ * thread of src, from a callback or between iterations; done runs on the
+ * thread of dst. Returns PE_ERR if fd is not registered on src. */
+int
+peMigrateFd(peEventLoop *src, int fd, peEventLoop *dst, peMigrateDoneProc *done) {
+    peMigration *m;
+    peFileEvent *fe;
+    peTimeEvent **tp;
+
+    if (src == dst || fd < 0 || fd >= src->setsize) return PE_ERR;
+    fe = &src->events[fd];
+    if (fe->mask == PE_NONE) return PE_ERR;
+
+    if ((m = pmalloc(sizeof(*m))) == NULL) return PE_ERR;
+    m->fd = fd;
+    m->mask = fe->mask;
+    m->priority = fe->priority;
+    m->flags = fe->flags;
+    /* Reading suspended by load shedding resumes on the new loop */
+    if (m->flags & PE_FE_SHED) {
+        m->mask |= PE_READABLE;
+        m->flags &= ~PE_FE_SHED;
+    }
+    m->rfileProc = fe->rfileProc;
+    m->wfileProc = fe->wfileProc;
+    m->clientData = fe->clientData;
+    m->usec = fe->usec;
+    m->calls = fe->calls;
+    m->bytes = fe->bytes;
+    m->done = done;
+    m->src = src;
+    m->timers = NULL;
+
+    tp = &src->timeEventHead;
+    while (*tp) {
+        peTimeEvent *te = *tp;
+
+        if (te->fd == fd) {
+            peTimeEvent *copy = pmalloc(sizeof(*copy));
+
+            *copy = *te;
+            *tp = te->next;
+            src->numtimers--;
+            pmalloc_pool_put(src->timerpool, te);
+            copy->next = m->timers;
+            m->timers = copy;
+        } else {
+            tp = &te->next;
+        }
+    }
+
+    peDeleteFileEvent(src, fd, m->mask);
+    if (peRunInLoop(dst, peMigrateAdopt, m) == PE_ERR) {
+        /* Undo: put everything back where it was */
+        m->done = NULL;
+        m->src = NULL;
+        peMigrateAdopt(src, m);
+        return PE_ERR;
+    }
+    return PE_OK;
+}
+
+/* Automatic rebalancer.
+ *
+ * Every loop measures the share of wall time it spends in file callbacks
+ * (busy permille) once per period and publishes it. A loop above the
+ * threshold, and busier than the idlest loop by at least the margin,
+ * moves one PE_FE_MIGRATABLE fd to the idlest loop: the hottest one whose
+ * own load does not exceed half the gap, so that a single heavy client is
+ * not bounced back and forth. Per fd times are halved every period, so
+ * they weigh recent activity. */
+
+static int
+peRebalanceTick(struct peEventLoop *eventLoop, long long id, void *clientData) {
+    peRebalanceSlot *slot = clientData;
+    peRebalancer *rb = slot->rebalancer;
+    long long busy = eventLoop->busyusec, wall, now;
+    long load, minload = -1, gap, fdload;
+    peRebalanceSlot *target = NULL;
+    int j, hottest = -1;
+    long long hottestusec = 0;
+    struct timeval tv;
+    PE_NOTUSED(id);
+
+    gettimeofday(&tv, NULL);
+    now = ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+    wall = now - slot->lastwall;
+    if (wall <= 0) wall = 1;
+    load = (long)((busy - slot->lastbusy)*1000/wall);
+    slot->lastbusy = busy;
+    slot->lastwall = now;
+    __atomic_store_n(&slot->load, load, __ATOMIC_RELAXED);
+
+    for (j = 0; j < rb->numloops; j++) {
+        peRebalanceSlot *other = &rb->slots[j];
+        long l;
+
+        if (other == slot) continue;
+        l = __atomic_load_n(&other->load, __ATOMIC_RELAXED);
+        if (minload == -1 || l < minload) {
+            minload = l;
+            target = other;
+        }
+    }
+
+    gap = load - minload;
+    for (j = 0; j <= eventLoop->maxfd; j++) {
+        peFileEvent *fe = &eventLoop->events[j];
+
+        if (fe->mask == PE_NONE) continue;
+        if (target && load >= rb->threshold && gap >= rb->margin &&
+            (fe->flags & PE_FE_MIGRATABLE) && fe->usec > hottestusec) {
+            fdload = (long)(fe->usec*1000/wall);
+            if (fdload <= gap/2) {
+                hottest = j;
+                hottestusec = fe->usec;
+            }
+        }
+        fe->usec /= 2;
+    }
+    if (hottest != -1)
+        peMigrateFd(eventLoop, hottest, target->eventLoop, rb->done);
+    return rb->period;
+}
+
+static void
+peRebalanceAttach(struct peEventLoop *eventLoop, void *clientData) {
+    peRebalanceSlot *slot = clientData;
+    struct timeval tv;
+
+    peSetAccounting(eventLoop, 1);
+    gettimeofday(&tv, NULL);
+    slot->lastwall = ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+    slot->lastbusy = eventLoop->busyusec;
+    slot->timer = peCreateTimeEvent(eventLoop, slot->rebalancer->period,
+                                    peRebalanceTick, slot, NULL);
+}
+
+static void
+peRebalanceDetach(struct peEventLoop *eventLoop, void *clientData) {
+    peRebalanceSlot *slot = clientData;
+    peRebalancer *rb = slot->rebalancer;
+
+    peDeleteTimeEvent(eventLoop, slot->timer);
+    if (__atomic_sub_fetch(&rb->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pfree(rb->slots);
+        pfree(rb);
+    }
+}
+
+/* Balance the file callbacks load of the given loops, that must be
+ * running. done is passed to peMigrateFd for every move. */
+peRebalancer *
+peCreateRebalancer(peEventLoop **loops, int numloops, peMigrateDoneProc *done) {
+    peRebalancer *rb;
+    int j;
+
+    if (numloops < 2) return NULL;
+    rb = pmalloc(sizeof(*rb));
+    rb->slots = pcalloc(sizeof(peRebalanceSlot)*numloops);
+    rb->numloops = numloops;
+    rb->period = PE_REBALANCE_PERIOD;
+    rb->threshold = PE_REBALANCE_THRESHOLD;
+    rb->margin = PE_REBALANCE_MARGIN;
+    rb->done = done;
+    rb->refs = numloops;
+    for (j = 0; j < numloops; j++) {
+        rb->slots[j].rebalancer = rb;
+        rb->slots[j].eventLoop = loops[j];
+        rb->slots[j].timer = -1;
+    }
+    for (j = 0; j < numloops; j++)
+        peRunInLoop(loops[j], peRebalanceAttach, &rb->slots[j]);
+    return rb;
+}
+
+/* Detach from every loop, the memory is released by the last one: once
+ * the last detach is posted rebalancer may already be gone. */
+void
+peDeleteRebalancer(peRebalancer *rebalancer) {
+    peRebalanceSlot *slots = rebalancer->slots;
+    int numloops = rebalancer->numloops, j;
+
+    for (j = 0; j < numloops; j++)
+        peRunInLoop(slots[j].eventLoop, peRebalanceDetach, &slots[j]);
+}
@@ -0,0 +1,40 @@
+#ifndef __PE_MIGRATE_H__
+#define __PE_MIGRATE_H__
+
+#include "pe.h"
+
+/* Rebalancer defaults */
+#define PE_REBALANCE_PERIOD     1000 /* milliseconds between decisions */
+#define PE_REBALANCE_THRESHOLD  800  /* busy permille above which a loop sheds */
+#define PE_REBALANCE_MARGIN     200  /* min busy permille gap to the target */
+
+/* Called on the destination loop thread once the fd is registered there,
+ * or could not be (status PE_ERR, the fd is then owned by the callback).
+ * Without a callback such an fd is registered again on the source loop. */
+typedef void peMigrateDoneProc(struct peEventLoop *eventLoop, int fd,
+                               void *clientData, int status);
+
+typedef struct peRebalanceSlot {
+    struct peRebalancer *rebalancer;
+    peEventLoop *eventLoop;
+    long long timer;
+    long long lastbusy;  /* busyusec of the loop at the last decision */
+    long long lastwall;  /* when the last decision was taken */
+    long load;           /* busy permille over the last period */
+} peRebalanceSlot;
+
+typedef struct peRebalancer {
+    peRebalanceSlot *slots;
+    int numloops;
+    long long period;
+    long threshold;
+    long margin;
+    peMigrateDoneProc *done;
+    int refs;            /* slots still attached to their loop */
+} peRebalancer;
+
+int    peMigrateFd(peEventLoop *src, int fd, peEventLoop *dst, peMigrateDoneProc *done);
+peRebalancer *peCreateRebalancer(peEventLoop **loops, int numloops, peMigrateDoneProc *done);
+void   peDeleteRebalancer(peRebalancer *rebalancer);
+
+#endif
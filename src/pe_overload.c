@@ -0,0 +1,138 @@
+#include "pe_overload.h"
+#include "pe_listener.h"
+
+/* Overload protection.
+ *
+ * A loop that falls behind keeps accepting and reading, so its queues
+ * grow and everybody waits longer. Here the loop measures its own lag: a
+ * probe timer every PE_OVERLOAD_PERIOD ms looks at how late it fired, and
+ * a prepare hook averages how long iterations work. When either crosses
+ * its threshold the loop sheds load: listeners stop accepting, so new
+ * connections wait in the kernel backlog, reading from PE_PRIO_LOW fds is
+ * suspended, so their clients are pushed back by TCP flow control, and
+ * the application is told, to stop optional work.
+ *
+ * Waiting with everything suspended until the loop is calm again would
+ * leave it idle: once both measures are below half their threshold,
+ * every probe resumes reading from a slice of the shed fds, doubling like
+ * TCP slow start, and a relapse above the threshold suspends them again
+ * and starts over from one fd. Listeners and the application are only
+ * told overload ended once every fd is back and the measures stayed below
+ * half their threshold for the hold time, so the loop does not flap
+ * around the threshold. */
+
+static void
+peOverloadEnter(peOverload *ov) {
+    peEventLoop *eventLoop = ov->eventLoop;
+    peListener *listener;
+
+    ov->overloaded = 1;
+    ov->calm = 0;
+    ov->episodes++;
+    for (listener = eventLoop->listeners; listener; listener = listener->next) {
+        if (listener->paused) continue;
+        peListenerPause(listener);
+        listener->shed = 1;
+    }
+    ov->shedfds = peShedLowPriority(eventLoop, 1);
+    ov->step = 1;
+    if (ov->proc) ov->proc(eventLoop, 1, ov->clientData);
+}
+
+static void
+peOverloadLeave(peOverload *ov) {
+    peEventLoop *eventLoop = ov->eventLoop;
+    peListener *listener;
+
+    ov->overloaded = 0;
+    for (listener = eventLoop->listeners; listener; listener = listener->next) {
+        if (!listener->shed) continue;
+        listener->shed = 0;
+        peListenerResume(listener);
+    }
+    peShedLowPriority(eventLoop, 0);
+    ov->shedfds = 0;
+    if (ov->proc) ov->proc(eventLoop, 0, ov->clientData);
+}
+
+static void
+peOverloadSample(struct peEventLoop *eventLoop, void *clientData) {
+    peOverload *ov = clientData;
+
+    ov->iter = (ov->iter*7 + eventLoop->iterusec)/8;
+}
+
+static int
+peOverloadProbe(struct peEventLoop *eventLoop, long long id, void *clientData) {
+    peOverload *ov = clientData;
+    long long late = eventLoop->timerlate;
+    PE_NOTUSED(id);
+
+    if (late < 0) late = 0;
+    ov->lag = late;
+    if (!ov->overloaded) {
+        if (ov->lag >= ov->maxlag || ov->iter >= ov->maxiter)
+            peOverloadEnter(ov);
+    } else if (ov->lag >= ov->maxlag || ov->iter >= ov->maxiter) {
+        /* Relapse: take back what was resumed */
+        ov->calm = 0;
+        ov->shedfds += peShedLowPriority(eventLoop, 1);
+        ov->step = 1;
+    } else if (ov->lag < ov->maxlag/2 && ov->iter < ov->maxiter/2) {
+        ov->calm += PE_OVERLOAD_PERIOD + late;
+        if (ov->shedfds) {
+            ov->shedfds -= peResumeLowPriority(eventLoop, ov->step);
+            if (!eventLoop->shedding) ov->shedfds = 0;
+            ov->step *= 2;
+        }
+        if (ov->calm >= ov->hold && ov->shedfds == 0) peOverloadLeave(ov);
+    } else {
+        ov->calm = 0;
+    }
+    return PE_OVERLOAD_PERIOD;
+}
+
+/* Watch the lag of eventLoop and shed load when it is overloaded. proc,
+ * if not NULL, is called when overload starts and ends. */
+peOverload *
+peCreateOverload(peEventLoop *eventLoop, peOverloadProc *proc, void *clientData) {
+    peOverload *ov;
+
+    if ((ov = pcalloc(sizeof(*ov))) == NULL) return NULL;
+    ov->eventLoop = eventLoop;
+    ov->maxlag = PE_OVERLOAD_LAG;
+    ov->maxiter = PE_OVERLOAD_ITER;
+    ov->hold = PE_OVERLOAD_HOLD;
+    ov->proc = proc;
+    ov->clientData = clientData;
+    ov->hook = peCreateHook(eventLoop, PE_HOOK_PREPARE, peOverloadSample, ov);
+    ov->probe = peCreateTimeEvent(eventLoop, PE_OVERLOAD_PERIOD,
+                                  peOverloadProbe, ov, NULL);
+    if (ov->hook == PE_ERR || ov->probe == PE_ERR) {
+        if (ov->hook != PE_ERR) peDeleteHook(eventLoop, ov->hook);
+        if (ov->probe != PE_ERR) peDeleteTimeEvent(eventLoop, ov->probe);
+        pfree(ov);
+        return NULL;
+    }
+    peSetIterationTiming(eventLoop, 1);
+    return ov;
+}
+
+/* Resume normal operation and stop watching */
+void
+peDeleteOverload(peOverload *overload) {
+    if (overload->overloaded) peOverloadLeave(overload);
+    peDeleteHook(overload->eventLoop, overload->hook);
+    peDeleteTimeEvent(overload->eventLoop, overload->probe);
+    peSetIterationTiming(overload->eventLoop, 0);
+    pfree(overload);
+}
+
+/* Zero keeps the current value */
+void
+peSetOverloadThresholds(peOverload *overload, long long maxlag,
+                        long long maxiter, long long hold) {
+    if (maxlag > 0) overload->maxlag = maxlag;
+    if (maxiter > 0) overload->maxiter = maxiter;
+    if (hold > 0) overload->hold = hold;
+}
@@ -0,0 +1,46 @@
+#ifndef __PE_OVERLOAD_H__
+#define __PE_OVERLOAD_H__
+
+#include "pe.h"
+
+/* Milliseconds between two lag probes */
+#define PE_OVERLOAD_PERIOD  10
+
+/* Default thresholds to enter overload: timer lag in ms, average
+ * iteration work time in usec */
+#define PE_OVERLOAD_LAG     50
+#define PE_OVERLOAD_ITER    20000
+
+/* Default ms both measures must stay below half their threshold to leave.
+ * Reading from shed fds resumes during that time, a slice doubling at
+ * every calm probe. */
+#define PE_OVERLOAD_HOLD    500
+
+typedef void peOverloadProc(struct peEventLoop *eventLoop, int overloaded,
+                            void *clientData);
+
+typedef struct peOverload {
+    peEventLoop *eventLoop;
+    long long maxlag;       /* thresholds, see peSetOverloadThresholds */
+    long long maxiter;
+    long long hold;
+    long long lag;          /* lateness of the last probe, ms */
+    long long iter;         /* moving average of iteration work time, usec */
+    int overloaded;
+    long long calm;         /* ms spent below half the thresholds */
+    unsigned long long episodes; /* times overload was entered */
+    int shedfds;            /* fds still suspended by the current episode */
+    int step;               /* fds the next calm probe resumes */
+    long long probe;        /* timer id */
+    long long hook;         /* prepare hook id */
+    peOverloadProc *proc;
+    void *clientData;
+} peOverload;
+
+peOverload *peCreateOverload(peEventLoop *eventLoop, peOverloadProc *proc,
+                             void *clientData);
+void   peDeleteOverload(peOverload *overload);
+void   peSetOverloadThresholds(peOverload *overload, long long maxlag,
+                               long long maxiter, long long hold);
+
+#endif
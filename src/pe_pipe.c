@@ -0,0 +1,229 @@
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "pe_pipe.h"
+
+/* Pipes between loops.
+ *
+ * A stage running on one loop hands messages (pointers, owned by the
+ * application) to a stage running on another through a bounded single
+ * producer, single consumer ring: no lock and no allocation per message.
+ * Each side publishes its index once per batch, and keeps a cached copy
+ * of the other side's index so it only touches the shared cache line when
+ * the cached view says the ring is full (producer) or empty (consumer).
+ *
+ * The consumer is only woken through its eventfd when it is parked: its
+ * prepare hook raises the parked flag right before the poll, its check
+ * hook lowers it right after. A consumer busy with callbacks finds the
+ * new messages in its next prepare hook, without system calls. The flag
+ * and the indexes follow the store-then-load pattern on both sides, so a
+ * message published while the consumer goes to sleep is never missed.
+ *
+ * When the ring is full the producer raises the full flag, and gets a
+ * writable-style callback through its own eventfd once the consumer made
+ * room. */
+
+static void
+pePipeWake(int fd) {
+    uint64_t one = 1;
+
+    while (write(fd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+static void
+pePipeDrain(pePipe *pipe) {
+    unsigned long head = pipe->head, tail = pipe->tailcache, budget = pipe->size;
+
+    if (head == tail)
+        tail = __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE);
+    /* Up to a ring per call, so the other fds of the loop get their turn */
+    while (head != tail && budget) {
+        unsigned long idx = head & (pipe->size-1);
+        unsigned long n = tail-head;
+
+        if (n > PE_PIPE_BATCH) n = PE_PIPE_BATCH;
+        if (n > pipe->size-idx) n = pipe->size-idx;
+        if (n > budget) n = budget;
+        pipe->proc(pipe->consumer, pipe, pipe->slots+idx, n, pipe->clientData);
+        head += n;
+        budget -= n;
+        pipe->read += n;
+        __atomic_store_n(&pipe->head, head, __ATOMIC_RELEASE);
+        if (head == tail)
+            tail = __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE);
+    }
+    pipe->tailcache = tail;
+
+    /* Order the head store before reading the producer's flag */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pipe->full, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&pipe->full, 0, __ATOMIC_RELAXED);
+        pePipeWake(pipe->spacefd);
+    }
+}
+
+static void
+pePipeDeferredDrain(struct peEventLoop *eventLoop, void *clientData) {
+    pePipe *pipe = clientData;
+    PE_NOTUSED(eventLoop);
+
+    pipe->drainqueued = 0;
+    if (pipe->deleted) {
+        pfree(pipe->alloc);
+        return;
+    }
+    pePipeDrain(pipe);
+}
+
+static void
+pePipePrepare(struct peEventLoop *eventLoop, void *clientData) {
+    pePipe *pipe = clientData;
+
+    __atomic_store_n(&pipe->parked, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pipe->tail, __ATOMIC_SEQ_CST) == pipe->head) return;
+    /* Messages are waiting: drain them without sleeping */
+    __atomic_store_n(&pipe->parked, 0, __ATOMIC_RELAXED);
+    if (pipe->drainqueued) return;
+    if (peDefer(eventLoop, pePipeDeferredDrain, pipe) == PE_ERR)
+        pePipeWake(pipe->wakefd);
+    else
+        pipe->drainqueued = 1;
+}
+
+static void
+pePipeCheck(struct peEventLoop *eventLoop, void *clientData) {
+    pePipe *pipe = clientData;
+    PE_NOTUSED(eventLoop);
+
+    __atomic_store_n(&pipe->parked, 0, __ATOMIC_RELAXED);
+}
+
+static void
+pePipeReadable(struct peEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    uint64_t count;
+    PE_NOTUSED(eventLoop);
+    PE_NOTUSED(mask);
+
+    while (read(fd, &count, sizeof(count)) == -1 && errno == EINTR);
+    pePipeDrain(clientData);
+}
+
+static void
+pePipeSpace(struct peEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    pePipe *pipe = clientData;
+    uint64_t count;
+    PE_NOTUSED(mask);
+
+    while (read(fd, &count, sizeof(count)) == -1 && errno == EINTR);
+    if (pipe->writableProc)
+        pipe->writableProc(eventLoop, pipe, pipe->clientData);
+}
+
+/* Create a pipe of size messages (rounded up to a power of two, 0 for
+ * PE_PIPE_SIZE) from producer to consumer. proc gets the messages on the
+ * consumer loop; writableProc, if not NULL, runs on the producer loop when
+ * room is made after pePipeWrite came up short. Must be called before the
+ * loops run, or on a thread running both. */
+pePipe *
+peCreatePipe(peEventLoop *producer, peEventLoop *consumer, unsigned long size,
+             pePipeProc *proc, pePipeWritableProc *writableProc, void *clientData) {
+    unsigned long capacity = 2;
+    pePipe *pipe;
+    void *alloc;
+
+    if (size == 0) size = PE_PIPE_SIZE;
+    while (capacity < size) capacity *= 2;
+    if ((alloc = pcalloc(sizeof(*pipe)+PE_PIPE_CACHELINE)) == NULL) return NULL;
+    pipe = (pePipe *)(((uintptr_t)alloc+PE_PIPE_CACHELINE-1) &
+                      ~(uintptr_t)(PE_PIPE_CACHELINE-1));
+    pipe->alloc = alloc;
+    pipe->size = capacity;
+    pipe->producer = producer;
+    pipe->consumer = consumer;
+    pipe->proc = proc;
+    pipe->writableProc = writableProc;
+    pipe->clientData = clientData;
+    pipe->wakefd = pipe->spacefd = -1;
+    pipe->prepare = pipe->check = -1;
+    if ((pipe->slots = pmalloc(sizeof(void *)*capacity)) == NULL) goto err;
+    if ((pipe->wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1 ||
+        (pipe->spacefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1)
+        goto err;
+    if (peCreateFileEvent(consumer, pipe->wakefd, PE_READABLE,
+                          pePipeReadable, pipe) == PE_ERR)
+        goto err;
+    if (peCreateFileEvent(producer, pipe->spacefd, PE_READABLE,
+                          pePipeSpace, pipe) == PE_ERR)
+        goto err;
+    if ((pipe->prepare = peCreateHook(consumer, PE_HOOK_PREPARE,
+                                      pePipePrepare, pipe)) == PE_ERR ||
+        (pipe->check = peCreateHook(consumer, PE_HOOK_CHECK,
+                                    pePipeCheck, pipe)) == PE_ERR)
+        goto err;
+    return pipe;
+
+ err:
+    peDeletePipe(pipe);
+    return NULL;
+}
+
+/* Messages still in the ring are dropped. Same threading rules as
+ * peCreatePipe, and not from the procs of the pipe. When a drain is
+ * deferred to the end of the iteration, the memory of the pipe is only
+ * freed by that drain. */
+void
+peDeletePipe(pePipe *pipe) {
+    if (pipe->prepare != -1) peDeleteHook(pipe->consumer, pipe->prepare);
+    if (pipe->check != -1) peDeleteHook(pipe->consumer, pipe->check);
+    if (pipe->wakefd != -1) {
+        peDeleteFileEvent(pipe->consumer, pipe->wakefd, PE_READABLE);
+        close(pipe->wakefd);
+    }
+    if (pipe->spacefd != -1) {
+        peDeleteFileEvent(pipe->producer, pipe->spacefd, PE_READABLE);
+        close(pipe->spacefd);
+    }
+    pfree(pipe->slots);
+    if (pipe->drainqueued) {
+        pipe->deleted = 1;
+        return;
+    }
+    pfree(pipe->alloc);
+}
+
+/* Queue up to count messages, from the producer thread, and publish them
+ * at once. Returns how many were queued: when less than count the ring is
+ * full, and writableProc will be called once there is room. */
+int
+pePipeWrite(pePipe *pipe, void **msgs, int count) {
+    unsigned long tail = pipe->tail, mask = pipe->size-1;
+    int n = 0;
+
+    while (n < count) {
+        unsigned long room = pipe->size-(tail-pipe->headcache);
+
+        if (room == 0) {
+            pipe->headcache = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE);
+            if (tail-pipe->headcache < pipe->size) continue;
+            /* Ask for a writable callback, unless room was made meanwhile */
+            __atomic_store_n(&pipe->full, 1, __ATOMIC_SEQ_CST);
+            pipe->headcache = __atomic_load_n(&pipe->head, __ATOMIC_SEQ_CST);
+            if (tail-pipe->headcache == pipe->size) break;
+            __atomic_store_n(&pipe->full, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        while (room-- && n < count)
+            pipe->slots[tail++ & mask] = msgs[n++];
+    }
+    if (n == 0) return 0;
+
+    __atomic_store_n(&pipe->tail, tail, __ATOMIC_SEQ_CST);
+    pipe->written += n;
+    if (__atomic_load_n(&pipe->parked, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&pipe->parked, 0, __ATOMIC_SEQ_CST)) {
+        pipe->wakeups++;
+        pePipeWake(pipe->wakefd);
+    }
+    return n;
+}
@@ -0,0 +1,61 @@
+#ifndef __PE_PIPE_H__
+#define __PE_PIPE_H__
+
+#include "pe.h"
+
+#define PE_PIPE_CACHELINE 64
+
+/* Default ring capacity, in messages */
+#define PE_PIPE_SIZE      4096
+
+/* Max messages handed to the consumer proc at once */
+#define PE_PIPE_BATCH     256
+
+struct pePipe;
+
+/* Consumer side: count messages, on the consumer loop */
+typedef void pePipeProc(struct peEventLoop *eventLoop, struct pePipe *pipe,
+                        void **msgs, int count, void *clientData);
+/* Producer side: the ring has room again after a write came up short */
+typedef void pePipeWritableProc(struct peEventLoop *eventLoop, struct pePipe *pipe,
+                                void *clientData);
+
+/* Single producer, single consumer ring between two loops. The indexes
+ * each side writes live on their own cache line, next to the cached copy
+ * of the other side's index. */
+typedef struct pePipe {
+    /* Producer */
+    unsigned long tail __attribute__((aligned(PE_PIPE_CACHELINE)));
+    unsigned long headcache;
+    unsigned long long written;
+    /* Consumer */
+    unsigned long head __attribute__((aligned(PE_PIPE_CACHELINE)));
+    unsigned long tailcache;
+    unsigned long long read;
+    /* Consumer is about to sleep in the poll, producer waits for room */
+    int parked __attribute__((aligned(PE_PIPE_CACHELINE)));
+    int full __attribute__((aligned(PE_PIPE_CACHELINE)));
+    /* Set at creation */
+    void **slots __attribute__((aligned(PE_PIPE_CACHELINE)));
+    unsigned long size;
+    peEventLoop *producer;
+    peEventLoop *consumer;
+    int wakefd;   /* eventfd waking the consumer */
+    int spacefd;  /* eventfd telling the producer there is room */
+    long long prepare, check; /* consumer hooks */
+    pePipeProc *proc;
+    pePipeWritableProc *writableProc;
+    void *clientData;
+    unsigned long long wakeups; /* eventfd writes to the consumer */
+    int drainqueued; /* deferred drain pending on the consumer loop */
+    int deleted;     /* freed by the deferred drain once it runs */
+    void *alloc;  /* unaligned allocation */
+} pePipe;
+
+pePipe *peCreatePipe(peEventLoop *producer, peEventLoop *consumer,
+                     unsigned long size, pePipeProc *proc,
+                     pePipeWritableProc *writableProc, void *clientData);
+void   peDeletePipe(pePipe *pipe);
+int    pePipeWrite(pePipe *pipe, void **msgs, int count);
+
+#endif
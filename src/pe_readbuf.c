@@ -0,0 +1,195 @@
+#include <errno.h>
+
+#include "pe_readbuf.h"
+
+/* Shared read buffer.
+ *
+ * A connection that owns a 16-64KB read buffer pays for it even when it
+ * is idle, which is most of the time for most connections. Here reads go
+ * to one large buffer per loop, and the callback parses the bytes in
+ * place: only what is left unconsumed, usually the head of a partial
+ * request, is copied to a small private buffer with peReadBufferKeep.
+ *
+ * Private buffers stay allocated while the connection is active, to avoid
+ * reallocating on every partial read, and a sweep timer releases the
+ * empty ones and shrinks the others once they were not read from during
+ * a whole quiet period.
+ *
+ * Large messages in progress are read directly after their private bytes
+ * instead of being copied back and forth through the shared buffer.
+ *
+ * The shared buffer is reused by the next read on the loop: the data
+ * returned by peReadBufferRead is valid until then. Not for loops run by
+ * several threads with peMainShared. */
+
+static void
+peReadBufferLink(peReadBuffer *rb) {
+    peEventLoop *eventLoop = rb->eventLoop;
+
+    rb->prev = NULL;
+    rb->next = eventLoop->readbuffers;
+    if (rb->next) rb->next->prev = rb;
+    eventLoop->readbuffers = rb;
+}
+
+static void
+peReadBufferUnlink(peReadBuffer *rb) {
+    if (rb->prev)
+        rb->prev->next = rb->next;
+    else
+        rb->eventLoop->readbuffers = rb->next;
+    if (rb->next) rb->next->prev = rb->prev;
+    rb->prev = rb->next = NULL;
+}
+
+static void
+peReadBufferRelease(peReadBuffer *rb) {
+    if (rb->buf == NULL) return;
+    peReadBufferUnlink(rb);
+    pfree(rb->buf);
+    rb->buf = NULL;
+    rb->len = rb->size = 0;
+}
+
+static int
+peReadBufferSweep(struct peEventLoop *eventLoop, long long id, void *clientData) {
+    peReadBuffer *rb = eventLoop->readbuffers, *next;
+    PE_NOTUSED(id);
+    PE_NOTUSED(clientData);
+
+    while (rb) {
+        next = rb->next;
+        /* Not read from since the previous sweep */
+        if (rb->epoch < eventLoop->readbufepoch) {
+            if (rb->len == 0) {
+                peReadBufferRelease(rb);
+            } else if (rb->size > rb->len && rb->size > PE_READBUF_MIN) {
+                size_t size = rb->len > PE_READBUF_MIN ? rb->len : PE_READBUF_MIN;
+                char *buf = prealloc(rb->buf, size);
+
+                if (buf) {
+                    rb->buf = buf;
+                    rb->size = size;
+                }
+            }
+        }
+        rb = next;
+    }
+    eventLoop->readbufepoch++;
+    if (eventLoop->readbuffers == NULL) {
+        eventLoop->readbufsweep = -1;
+        return PE_NOMORE;
+    }
+    return eventLoop->readbufidle ? eventLoop->readbufidle : PE_READBUF_IDLE;
+}
+
+static void
+peReadBufferSchedule(peEventLoop *eventLoop) {
+    if (eventLoop->readbufsweep != -1 || eventLoop->readbuffers == NULL) return;
+    eventLoop->readbufsweep = peCreateTimeEvent(eventLoop,
+        eventLoop->readbufidle ? eventLoop->readbufidle : PE_READBUF_IDLE,
+        peReadBufferSweep, NULL, NULL);
+    if (eventLoop->readbufsweep == PE_ERR) eventLoop->readbufsweep = -1;
+}
+
+/* Make room for size bytes in the private buffer, keeping its content */
+static int
+peReadBufferReserve(peReadBuffer *rb, size_t size) {
+    peEventLoop *eventLoop = rb->eventLoop;
+    char *buf;
+
+    if (size <= rb->size) return PE_OK;
+    if (size < PE_READBUF_MIN) size = PE_READBUF_MIN;
+    if (size < rb->size*2) size = rb->size*2;
+    if ((buf = prealloc(rb->buf, size)) == NULL) return PE_ERR;
+    if (rb->buf == NULL) peReadBufferLink(rb);
+    rb->buf = buf;
+    rb->size = size;
+
+    peReadBufferSchedule(eventLoop);
+    return PE_OK;
+}
+
+void
+peReadBufferInit(peEventLoop *eventLoop, peReadBuffer *rb) {
+    memset(rb, 0, sizeof(*rb));
+    rb->eventLoop = eventLoop;
+    rb->epoch = eventLoop->readbufepoch;
+}
+
+/* Release the private storage, when the connection is closed */
+void
+peReadBufferFree(peReadBuffer *rb) {
+    peReadBufferRelease(rb);
+}
+
+/* Read from fd. On success *data points to the unconsumed bytes followed
+ * by the new ones and their total is returned; the caller parses them and
+ * passes what is left to peReadBufferKeep before the next read on the
+ * loop. Returns 0 on EOF and -1 on error, errno set, with the unconsumed
+ * bytes untouched. */
+ssize_t
+peReadBufferRead(peReadBuffer *rb, int fd, char **data) {
+    peEventLoop *eventLoop = rb->eventLoop;
+    ssize_t nread;
+
+    rb->epoch = eventLoop->readbufepoch;
+    if (eventLoop->readbuf == NULL) {
+        if ((eventLoop->readbuf = pmalloc(PE_READBUF_SIZE)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        eventLoop->readbufsize = PE_READBUF_SIZE;
+    }
+
+    if (rb->len > eventLoop->readbufsize/2) {
+        /* A large message in progress: append to it in place */
+        if (peReadBufferReserve(rb, rb->len + eventLoop->readbufsize/2) == PE_ERR) {
+            errno = ENOMEM;
+            return -1;
+        }
+        nread = read(fd, rb->buf + rb->len, rb->size - rb->len);
+        if (nread <= 0) return nread;
+        *data = rb->buf;
+    } else {
+        /* Read after room for the unconsumed bytes, then put them in front */
+        nread = read(fd, eventLoop->readbuf + rb->len,
+                     eventLoop->readbufsize - rb->len);
+        if (nread <= 0) return nread;
+        if (rb->len) memcpy(eventLoop->readbuf, rb->buf, rb->len);
+        *data = eventLoop->readbuf;
+    }
+    if (fd < eventLoop->setsize) eventLoop->events[fd].bytes += nread;
+    nread += rb->len;
+    rb->len = 0;
+    return nread;
+}
+
+/* Keep the len bytes at data, the part of the last read not consumed yet,
+ * for the next read. data may point anywhere in the last read. */
+int
+peReadBufferKeep(peReadBuffer *rb, const char *data, size_t len) {
+    if (len == 0) {
+        rb->len = 0;
+        return PE_OK;
+    }
+    if (rb->buf && data >= rb->buf && data < rb->buf + rb->size) {
+        memmove(rb->buf, data, len);
+    } else {
+        if (peReadBufferReserve(rb, len) == PE_ERR) return PE_ERR;
+        memcpy(rb->buf, data, len);
+    }
+    rb->len = len;
+    return PE_OK;
+}
+
+/* Quiet period after which unused private buffers are released */
+void
+peSetReadBufferIdle(peEventLoop *eventLoop, long long milliseconds) {
+    eventLoop->readbufidle = milliseconds > 0 ? milliseconds : 0;
+    if (eventLoop->readbufsweep != -1) {
+        peDeleteTimeEvent(eventLoop, eventLoop->readbufsweep);
+        eventLoop->readbufsweep = -1;
+        peReadBufferSchedule(eventLoop);
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef __PE_READBUF_H__
+#define __PE_READBUF_H__
+
+#include "pe.h"
+
+/* Size of the read buffer shared by the connections of a loop */
+#define PE_READBUF_SIZE  (256*1024)
+
+/* Default quiet period before a connection buffer is released, in ms */
+#define PE_READBUF_IDLE  5000
+
+/* Smallest private allocation, to avoid reallocating on every partial read */
+#define PE_READBUF_MIN   512
+
+/* Per connection read state: only the bytes the application did not
+ * consume yet, most of the time none. */
+typedef struct peReadBuffer {
+    peEventLoop *eventLoop;
+    char *buf;              /* private storage, NULL if none allocated */
+    size_t len;             /* unconsumed bytes at the start of buf */
+    size_t size;            /* allocated size of buf */
+    unsigned long epoch;    /* sweep epoch of the last read */
+    struct peReadBuffer *prev, *next; /* in eventLoop->readbuffers while buf != NULL */
+} peReadBuffer;
+
+void    peReadBufferInit(peEventLoop *eventLoop, peReadBuffer *rb);
+void    peReadBufferFree(peReadBuffer *rb);
+ssize_t peReadBufferRead(peReadBuffer *rb, int fd, char **data);
+int     peReadBufferKeep(peReadBuffer *rb, const char *data, size_t len);
+void    peSetReadBufferIdle(peEventLoop *eventLoop, long long milliseconds);
+
+#endif
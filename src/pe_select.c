@@ -37,6 +37,16 @@ peApiAddEvent(peEventLoop *eventLoop, int fd, int mask) {
     return 0;
 }
 
+/* Watch the loop wake fd, outside of the registered events */
+static int 
+peApiAddWake(peEventLoop *eventLoop) {
+    peApiState *state = eventLoop->apidata;
+
+    if (eventLoop->wakefd >= FD_SETSIZE) return -1;
+    FD_SET(eventLoop->wakefd,&state->rfds);
+    return 0;
+}
+
 static void 
 peApiDelEvent(peEventLoop *eventLoop, int fd, int mask) {
     peApiState *state = eventLoop->apidata;
@@ -48,19 +58,23 @@ peApiDelEvent(peEventLoop *eventLoop, int fd, int mask) {
 static int 
 peApiPoll(peEventLoop *eventLoop, struct timeval *tvp) {
     peApiState *state = eventLoop->apidata;
-    int retval, j, numevents = 0;
+    int retval, j, numevents = 0, nfds;
 
     memcpy(&state->_rfds,&state->rfds,sizeof(fd_set));
     memcpy(&state->_wfds,&state->wfds,sizeof(fd_set));
 
-    retval = select(eventLoop->maxfd+1,
+    nfds = eventLoop->maxfd > eventLoop->wakefd ?
+           eventLoop->maxfd : eventLoop->wakefd;
+    retval = select(nfds+1,
                     &state->_rfds,&state->_wfds,NULL,tvp);
     if (retval > 0) {
+        if (FD_ISSET(eventLoop->wakefd,&state->_rfds))
+            eventLoop->woken = 1;
         for (j = 0; j <= eventLoop->maxfd; j++) {
             int mask = 0;
             peFileEvent *fe = &eventLoop->events[j];
 
-            if (fe->mask == PE_NONE) continue;
+            if (fe->mask == PE_NONE || j == eventLoop->wakefd) continue;
             if (fe->mask & PE_READABLE && FD_ISSET(j,&state->_rfds))
                 mask |= PE_READABLE;
             if (fe->mask & PE_WRITABLE && FD_ISSET(j,&state->_wfds))
@@ -73,6 +87,30 @@ peApiPoll(peEventLoop *eventLoop, struct timeval *tvp) {
     return numevents;
 }
 
+/* select() has no one-shot notifications: no shared mode */
+static void 
+peApiRearm(peEventLoop *eventLoop, int fd) {
+    PE_NOTUSED(eventLoop);
+    PE_NOTUSED(fd);
+}
+
+static int 
+peApiSetShared(peEventLoop *eventLoop, int shared) {
+    PE_NOTUSED(eventLoop);
+    return shared ? -1 : 0;
+}
+
+static int 
+peApiPollShared(peEventLoop *eventLoop, peFiredEvent *fired, int size,
+                int timeout, int *woken) {
+    PE_NOTUSED(eventLoop);
+    PE_NOTUSED(fired);
+    PE_NOTUSED(size);
+    PE_NOTUSED(timeout);
+    PE_NOTUSED(woken);
+    return -1;
+}
+
 static char *
 peApiName(void) {
     return "select";
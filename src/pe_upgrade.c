@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "pe_upgrade.h"
+#include "pe_listener.h"
+
+/* Zero downtime restart.
+ *
+ * The running (old) process waits for its successor on a unix socket.
+ * The new process connects and says HELLO; the old one sends every
+ * listener of its loop with SCM_RIGHTS, lets the application send idle
+ * connections along with a small serialized state, and says END. The new
+ * process registers what it got on its own loop and answers READY: only
+ * then the old process closes its copy of the listeners, so for a while
+ * both processes accept from the same sockets and no connection waiting
+ * in the accept queue is lost. The old process is then told to drain its
+ * in-flight work and exit.
+ *
+ * SOCK_SEQPACKET keeps every message and its fd together. The old
+ * process never blocks on the handoff socket: messages are queued with
+ * their own copy of the fd and sent as the socket becomes writable, and
+ * a handoff not done within PE_UPGRADE_TIMEOUT seconds fails. */
+
+typedef struct peUpgradeMsg {
+    uint32_t type;
+    uint32_t len;
+} peUpgradeMsg;
+
+static int
+peUpgradeSend(int sock, int type, int fd, const void *data, size_t len) {
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    peUpgradeMsg hdr;
+    struct msghdr msg;
+    struct iovec iov[2];
+    ssize_t nwritten;
+
+    if (len > PE_UPGRADE_MAXSTATE) return PE_ERR;
+    hdr.type = type;
+    hdr.len = len;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len ? 2 : 1;
+    if (fd != -1) {
+        struct cmsghdr *cmsg;
+
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    while ((nwritten = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+    return nwritten == -1 ? PE_ERR : PE_OK;
+}
+
+static void
+peUpgradeFreeOut(peUpgradeOut *out) {
+    if (out->fd != -1) close(out->fd);
+    pfree(out);
+}
+
+/* Receive a message: data must hold PE_UPGRADE_MAXSTATE+1 bytes and is
+ * null terminated, *fd is -1 when no fd came with the message. On PE_ERR
+ * errno is EAGAIN when nothing is there yet, ECONNRESET when the peer
+ * closed the socket and EPROTO for a short or malformed message. */
+static int
+peUpgradeRecv(int sock, int *type, int *fd, char *data, size_t *len) {
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    peUpgradeMsg hdr;
+    struct msghdr msg;
+    struct iovec iov[2];
+    struct cmsghdr *cmsg;
+    ssize_t nread;
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = data;
+    iov[1].iov_len = PE_UPGRADE_MAXSTATE;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    *fd = -1;
+    while ((nread = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+    for (cmsg = CMSG_FIRSTHDR(&msg); nread > 0 && cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (nread == -1) return PE_ERR;
+    if (nread < (ssize_t)sizeof(hdr) || hdr.len != nread - sizeof(hdr) ||
+        (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC))) {
+        if (*fd != -1) close(*fd);
+        errno = nread == 0 ? ECONNRESET : EPROTO;
+        return PE_ERR;
+    }
+    *type = hdr.type;
+    *len = hdr.len;
+    data[hdr.len] = '\0';
+    return PE_OK;
+}
+
+static void
+peUpgradeEndHandoff(peUpgrade *upgrade) {
+    peUpgradeOut *out;
+
+    peDeleteFileEvent(upgrade->eventLoop, upgrade->connfd,
+                      PE_READABLE|PE_WRITABLE);
+    close(upgrade->connfd);
+    upgrade->connfd = -1;
+    upgrade->hello = 0;
+    while ((out = upgrade->outhead) != NULL) {
+        upgrade->outhead = out->next;
+        peUpgradeFreeOut(out);
+    }
+    upgrade->outtail = NULL;
+    if (upgrade->timer != -1) {
+        peDeleteTimeEvent(upgrade->eventLoop, upgrade->timer);
+        upgrade->timer = -1;
+    }
+}
+
+static void
+peUpgradeFail(peUpgrade *upgrade) {
+    peUpgradeEndHandoff(upgrade);
+    upgrade->proc(upgrade->eventLoop, upgrade, PE_UPGRADE_FAILED,
+                  upgrade->clientData);
+}
+
+/* Queue a message, fd is duplicated so the caller may close its copy */
+static int
+peUpgradeQueue(peUpgrade *upgrade, int type, int fd, const void *data, size_t len) {
+    peUpgradeOut *out;
+
+    if (len > PE_UPGRADE_MAXSTATE) return PE_ERR;
+    if ((out = pmalloc(sizeof(*out)+len)) == NULL) return PE_ERR;
+    out->fd = -1;
+    if (fd != -1 && (out->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+        pfree(out);
+        return PE_ERR;
+    }
+    out->type = type;
+    out->len = len;
+    out->next = NULL;
+    if (len) memcpy(out->data, data, len);
+    if (upgrade->outtail)
+        upgrade->outtail->next = out;
+    else
+        upgrade->outhead = out;
+    upgrade->outtail = out;
+    return PE_OK;
+}
+
+static void
+peUpgradeWrite(struct peEventLoop *eventLoop, int fd, void *clientData, int mask);
+
+/* Send what the socket takes without blocking, then wait for it to be
+ * writable again if anything is left */
+static int
+peUpgradeFlush(peUpgrade *upgrade) {
+    peUpgradeOut *out;
+
+    while ((out = upgrade->outhead) != NULL) {
+        if (peUpgradeSend(upgrade->connfd, out->type, out->fd,
+                          out->data, out->len) == PE_ERR) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return PE_ERR;
+            return peCreateFileEvent(upgrade->eventLoop, upgrade->connfd,
+                                     PE_WRITABLE, peUpgradeWrite, upgrade);
+        }
+        upgrade->outhead = out->next;
+        if (upgrade->outhead == NULL) upgrade->outtail = NULL;
+        peUpgradeFreeOut(out);
+    }
+    peDeleteFileEvent(upgrade->eventLoop, upgrade->connfd, PE_WRITABLE);
+    return PE_OK;
+}
+
+static void
+peUpgradeWrite(struct peEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    peUpgrade *upgrade = clientData;
+    PE_NOTUSED(eventLoop);
+    PE_NOTUSED(fd);
+    PE_NOTUSED(mask);
+
+    if (peUpgradeFlush(upgrade) == PE_ERR) peUpgradeFail(upgrade);
+}
+
+static int
+peUpgradeTimeout(struct peEventLoop *eventLoop, long long id, void *clientData) {
+    peUpgrade *upgrade = clientData;
+    PE_NOTUSED(eventLoop);
+    PE_NOTUSED(id);
+
+    upgrade->timer = -1;
+    if (upgrade->connfd != -1) peUpgradeFail(upgrade);
+    return PE_NOMORE;
+}
+
+static void
+peUpgradeHandoff(peUpgrade *upgrade) {
+    peListener *listener;
+
+    upgrade->listeners = upgrade->conns = 0;
+    for (listener = upgrade->eventLoop->listeners; listener;
+         listener = listener->next) {
+        if (peUpgradeQueue(upgrade, PE_UPGRADE_LISTENER, listener->fd,
+                           listener->addr, strlen(listener->addr)) == PE_ERR)
+            goto err;
+        upgrade->listeners++;
+    }
+    upgrade->proc(upgrade->eventLoop, upgrade, PE_UPGRADE_REQUEST,
+                  upgrade->clientData);
+    if (upgrade->connfd == -1 ||
+        peUpgradeQueue(upgrade, PE_UPGRADE_END, -1, NULL, 0) == PE_ERR ||
+        peUpgradeFlush(upgrade) == PE_ERR)
+        goto err;
+    return;
+
+ err:
+    if (upgrade->connfd != -1)
+        peUpgradeFail(upgrade);
+    else
+        upgrade->proc(upgrade->eventLoop, upgrade, PE_UPGRADE_FAILED,
+                      upgrade->clientData);
+}
+
+static void
+peUpgradeRead(struct peEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    peUpgrade *upgrade = clientData;
+    char data[PE_UPGRADE_MAXSTATE+1];
+    int type, msgfd;
+    size_t len;
+    PE_NOTUSED(mask);
+
+    if (peUpgradeRecv(fd, &type, &msgfd, data, &len) == PE_ERR) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+        peUpgradeFail(upgrade);
+        return;
+    }
+    if (msgfd != -1) close(msgfd);
+
+    /* A second HELLO is ignored, the handoff is under way */
+    if (type == PE_UPGRADE_HELLO && !upgrade->hello) {
+        upgrade->hello = 1;
+        peUpgradeHandoff(upgrade);
+    } else if (type == PE_UPGRADE_READY) {
+        /* The new process accepts on the same sockets: stop accepting */
+        while (eventLoop->listeners)
+            peDeleteListener(eventLoop->listeners);
+        peUpgradeEndHandoff(upgrade);
+        upgrade->proc(eventLoop, upgrade, PE_UPGRADE_DONE,
+                      upgrade->clientData);
+    }
+}
+
+static void
+peUpgradeAccept(struct peEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    peUpgrade *upgrade = clientData;
+    int cfd;
+    PE_NOTUSED(mask);
+
+    if ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) == -1)
+        return;
+    /* One handoff at a time */
+    if (upgrade->connfd != -1) {
+        close(cfd);
+        return;
+    }
+    if (peCreateFileEvent(eventLoop, cfd, PE_READABLE,
+                          peUpgradeRead, upgrade) == PE_ERR) {
+        close(cfd);
+        return;
+    }
+    upgrade->connfd = cfd;
+    upgrade->timer = peCreateTimeEvent(eventLoop, PE_UPGRADE_TIMEOUT*1000,
+                                       peUpgradeTimeout, upgrade, NULL);
+}
+
+/* Old process side: wait for a successor on the unix socket path. proc is
+ * called with PE_UPGRADE_REQUEST once the listeners were sent, then with
+ * PE_UPGRADE_DONE or PE_UPGRADE_FAILED. */
+peUpgrade *
+peUpgradeListen(peEventLoop *eventLoop, const char *path,
+                peUpgradeProc *proc, void *clientData) {
+    struct sockaddr_un sa;
+    peUpgrade *upgrade;
+    int fd;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) return NULL;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd == -1) return NULL;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+        listen(fd, 1) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    upgrade = pcalloc(sizeof(*upgrade));
+    upgrade->eventLoop = eventLoop;
+    upgrade->fd = fd;
+    upgrade->connfd = -1;
+    upgrade->timer = -1;
+    upgrade->path = pstrdup(path);
+    upgrade->proc = proc;
+    upgrade->clientData = clientData;
+    if (peCreateFileEvent(eventLoop, fd, PE_READABLE,
+                          peUpgradeAccept, upgrade) == PE_ERR) {
+        peUpgradeClose(upgrade);
+        return NULL;
+    }
+    return upgrade;
+}
+
+/* Hand an idle connection to the new process, from PE_UPGRADE_REQUEST.
+ * On success the caller deletes its events and closes its copy of fd. */
+int
+peUpgradeSendConn(peUpgrade *upgrade, int fd, const void *state, size_t len) {
+    if (upgrade->connfd == -1) return PE_ERR;
+    if (peUpgradeQueue(upgrade, PE_UPGRADE_CONN, fd, state, len) == PE_ERR)
+        return PE_ERR;
+    upgrade->conns++;
+    return PE_OK;
+}
+
+void
+peUpgradeClose(peUpgrade *upgrade) {
+    if (upgrade->connfd != -1) peUpgradeEndHandoff(upgrade);
+    peDeleteFileEvent(upgrade->eventLoop, upgrade->fd, PE_READABLE);
+    close(upgrade->fd);
+    unlink(upgrade->path);
+    pfree(upgrade->path);
+    pfree(upgrade);
+}
+
+/* New process side, at startup: take over the fds of the process waiting
+ * on path. proc is called for every fd received, with type
+ * PE_UPGRADE_LISTENER (data is the listener address, see
+ * peCreateListenerFromFd) or PE_UPGRADE_CONN (data is the state sent with
+ * it), and must register it on eventLoop before returning. Returns the
+ * number of fds received, 0 if nobody waits on path, PE_ERR on error. */
+int
+peUpgradeInherit(peEventLoop *eventLoop, const char *path,
+                 peInheritProc *proc, void *clientData) {
+    struct timeval tv = {PE_UPGRADE_TIMEOUT, 0};
+    char data[PE_UPGRADE_MAXSTATE+1];
+    struct sockaddr_un sa;
+    int sock, type, fd, count = 0;
+    size_t len;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) return PE_ERR;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    if ((sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0)) == -1)
+        return PE_ERR;
+    if (connect(sock, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+        int err = errno;
+
+        close(sock);
+        return (err == ENOENT || err == ECONNREFUSED) ? 0 : PE_ERR;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (peUpgradeSend(sock, PE_UPGRADE_HELLO, -1, NULL, 0) == PE_ERR)
+        goto err;
+
+    while (1) {
+        if (peUpgradeRecv(sock, &type, &fd, data, &len) == PE_ERR) goto err;
+        if (type == PE_UPGRADE_END) break;
+        if (fd == -1) continue;
+        if (type != PE_UPGRADE_LISTENER && type != PE_UPGRADE_CONN) {
+            close(fd);
+            continue;
+        }
+        proc(eventLoop, type, fd, data, len, clientData);
+        count++;
+    }
+    if (peUpgradeSend(sock, PE_UPGRADE_READY, -1, NULL, 0) == PE_ERR)
+        goto err;
+    close(sock);
+    return count;
+
+ err:
+    close(sock);
+    return PE_ERR;
+}
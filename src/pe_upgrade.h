@@ -0,0 +1,62 @@
+#ifndef __PE_UPGRADE_H__
+#define __PE_UPGRADE_H__
+
+#include "pe.h"
+
+/* Messages of the handoff protocol, also the types passed to peInheritProc */
+#define PE_UPGRADE_HELLO     1  /* new -> old: send me your fds */
+#define PE_UPGRADE_LISTENER  2  /* old -> new: listening socket + address */
+#define PE_UPGRADE_CONN      3  /* old -> new: connection + serialized state */
+#define PE_UPGRADE_END       4  /* old -> new: nothing more to send */
+#define PE_UPGRADE_READY     5  /* new -> old: registered, stop accepting */
+
+/* Events passed to peUpgradeProc, in the old process */
+#define PE_UPGRADE_REQUEST   1  /* hand connections with peUpgradeSendConn */
+#define PE_UPGRADE_DONE      2  /* listeners closed: drain and exit */
+#define PE_UPGRADE_FAILED    3  /* new process went away: keep serving */
+
+/* Max serialized state sent along with a connection */
+#define PE_UPGRADE_MAXSTATE  4096
+
+/* Seconds the new process waits for the old one at each step, and the old
+ * process for the whole handoff */
+#define PE_UPGRADE_TIMEOUT   5
+
+struct peUpgrade;
+
+typedef void peUpgradeProc(struct peEventLoop *eventLoop, struct peUpgrade *upgrade,
+                           int event, void *clientData);
+typedef void peInheritProc(struct peEventLoop *eventLoop, int type, int fd,
+                           const char *data, size_t len, void *clientData);
+
+/* Message waiting for the handoff socket to be writable */
+typedef struct peUpgradeOut {
+    int type;
+    int fd;        /* own copy of the fd to pass, -1 if none */
+    size_t len;
+    struct peUpgradeOut *next;
+    char data[];
+} peUpgradeOut;
+
+typedef struct peUpgrade {
+    peEventLoop *eventLoop;
+    int fd;        /* unix socket waiting for the new process */
+    int connfd;    /* handoff in progress, -1 if none */
+    int hello;     /* HELLO came on connfd, the handoff started */
+    long long timer; /* fails the handoff after PE_UPGRADE_TIMEOUT, -1 if none */
+    peUpgradeOut *outhead, *outtail;
+    char *path;
+    peUpgradeProc *proc;
+    void *clientData;
+    int listeners; /* listeners sent by the last handoff */
+    int conns;     /* connections sent by the last handoff */
+} peUpgrade;
+
+peUpgrade *peUpgradeListen(peEventLoop *eventLoop, const char *path,
+                           peUpgradeProc *proc, void *clientData);
+int    peUpgradeSendConn(peUpgrade *upgrade, int fd, const void *state, size_t len);
+void   peUpgradeClose(peUpgrade *upgrade);
+int    peUpgradeInherit(peEventLoop *eventLoop, const char *path,
+                        peInheritProc *proc, void *clientData);
+
+#endif
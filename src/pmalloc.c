@@ -1,18 +1,95 @@
+#define PMALLOC_INTERNAL
+#include <stdint.h>
+#include <time.h>
 #include "pmalloc.h"
 
+/* Explicitly override malloc/free etc when using ptalloc */
+#if defined(USE_PTALLOC)
+#define malloc(size) ptalloc_malloc(size)
+#define calloc(count , size) ptalloc_calloc(count , size)
+#define realloc(ptr , size) ptalloc_realloc(ptr , size)
+#define free(ptr) ptalloc_free(ptr)
+#endif
 
-#define PREFIX_SIZE (sizeof(size_t))
 
-#define update_pmalloc_stat_add(__n) do { \
-    pthread_mutex_lock(&used_memory_mutex); \
-    used_memory += (__n); \
-    pthread_mutex_unlock(&used_memory_mutex); \
+/* Without help from the allocator every block starts with its size, and
+ * in profiling builds with the tag of its call site */
+#if defined(PMALLOC_PROFILE)
+#define PREFIX_SIZE (2*sizeof(size_t))
+/* Entry points and profiling code are kept in their own section, so that
+ * backtraces can be trimmed of every allocator frame */
+#define PMALLOC_ENTRY __attribute__((section("pmalloc_entry")))
+static uintptr_t pmalloc_profile_alloc(size_t size) PMALLOC_ENTRY;
+static void pmalloc_profile_free(uintptr_t tag , size_t size);
+#define pmalloc_header_set(p , size) do { \
+    ((size_t*)(p))[0] = (size); \
+    ((uintptr_t*)(p))[1] = pmalloc_profile_alloc(size); \
     } while(0)
+#define pmalloc_header_clear(p) \
+    pmalloc_profile_free(((uintptr_t*)(p))[1] , ((size_t*)(p))[0])
+#elif defined(HAVE_MALLOC_SIZE)
+#define PREFIX_SIZE (0)
+#define PMALLOC_ENTRY
+#else
+#define PREFIX_SIZE (sizeof(size_t))
+#define PMALLOC_ENTRY
+#define pmalloc_header_set(p , size) (*((size_t*)(p)) = (size))
+#define pmalloc_header_clear(p)
+#endif
 
-#define update_pmalloc_stat_sub(__n) do { \
-    pthread_mutex_lock(&used_memory_mutex); \
-    used_memory -= (__n); \
-    pthread_mutex_unlock(&used_memory_mutex); \
+/* Used memory is accounted in shards, one cache line each, so threads
+ * allocating at the same time don't fight over a lock or a counter.
+ * A thread is given a shard at its first allocation, round robin: it
+ * only shares it beyond PMALLOC_SHARDS threads, so updates are relaxed
+ * atomic adds on a line that is almost always local. A shard may wrap
+ * below zero when a thread frees what another allocated, the sum
+ * pmalloc_used_memory() returns is still exact. */
+#define PMALLOC_SHARDS    64
+#define PMALLOC_CACHELINE 64
+
+typedef struct pmalloc_shard {
+    size_t used;
+} __attribute__((aligned(PMALLOC_CACHELINE))) pmalloc_shard;
+
+static pmalloc_shard used_memory[PMALLOC_SHARDS];
+static unsigned int pmalloc_next_shard = 0;
+static __thread pmalloc_shard *pmalloc_thread_shard = NULL;
+static int pmalloc_thread_safe = 0;
+
+static pmalloc_shard *
+pmalloc_shard_get(void){
+    if(pmalloc_thread_shard == NULL){
+        unsigned int id = __atomic_fetch_add(&pmalloc_next_shard , 1 , __ATOMIC_RELAXED);
+        pmalloc_thread_shard = &used_memory[id % PMALLOC_SHARDS];
+    }
+    return pmalloc_thread_shard;
+}
+
+#define update_pmalloc_stat_add(__n) \
+    __atomic_add_fetch(&pmalloc_shard_get()->used , (__n) , __ATOMIC_RELAXED)
+
+#define update_pmalloc_stat_sub(__n) \
+    __atomic_sub_fetch(&pmalloc_shard_get()->used , (__n) , __ATOMIC_RELAXED)
+
+/* Watermarks. Every thread counts the bytes it allocates and frees, and
+ * only past PMALLOC_WATERMARK_TICK of them sums the shards and compares
+ * the total with the marks: the allocation path pays a thread local add
+ * and a compare. The level is changed with compare and swap, so a single
+ * thread reports each crossing to the handler, from inside the allocator.
+ * A level is only left below its mark minus 1/PMALLOC_WATERMARK_SLACK,
+ * so usage hovering around a mark doesn't flood the handler. */
+#define PMALLOC_WATERMARK_SLACK 16
+
+static size_t pmalloc_soft_mark = 0 , pmalloc_hard_mark = 0;
+static int pmalloc_level = PMALLOC_LEVEL_OK;
+static pmalloc_watermark_proc *pmalloc_watermark_handler = NULL;
+static __thread size_t pmalloc_tick = 0;
+
+static void pmalloc_watermark_check(void);
+
+#define pmalloc_watermark_tick(__n) do { \
+    if ((pmalloc_tick += (__n)) >= PMALLOC_WATERMARK_TICK) \
+    pmalloc_watermark_check(); \
     } while(0)
 
 #define update_pmalloc_stat_alloc(__n) do { \
@@ -21,8 +98,9 @@
     if (pmalloc_thread_safe) { \
     update_pmalloc_stat_add(_n); \
     } else { \
-    used_memory += _n; \
+    used_memory[0].used += _n; \
     } \
+    pmalloc_watermark_tick(_n); \
     } while(0)
 
 #define update_pmalloc_stat_free(__n) do { \
@@ -31,14 +109,11 @@
     if (pmalloc_thread_safe) { \
     update_pmalloc_stat_sub(_n); \
     } else { \
-    used_memory -= _n; \
+    used_memory[0].used -= _n; \
     } \
+    pmalloc_watermark_tick(_n); \
     } while(0)
 
-static size_t used_memory = 0;
-static int pmalloc_thread_safe = 0;
-pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 static void
 pmalloc_default_oom(size_t size){
     fprintf(stderr , "pmalloc : Out of memory trying to allocate %zu bytes\n", size);
@@ -48,67 +123,105 @@ pmalloc_default_oom(size_t size){
 
 static void (*pmalloc_oom_handler)(size_t) = pmalloc_default_oom;
 
-void *
+PMALLOC_ENTRY void *
 pmalloc(size_t size){
     void *ptr = malloc(size + PREFIX_SIZE);
     
     if(!ptr) pmalloc_oom_handler(size);
-    *((size_t*)ptr) = size;
+#ifdef HAVE_MALLOC_SIZE
+    update_pmalloc_stat_alloc(pmalloc_size(ptr));
+    return ptr;
+#else
+    pmalloc_header_set(ptr , size);
     update_pmalloc_stat_alloc(size+PREFIX_SIZE);
     return (char *)ptr + PREFIX_SIZE;
+#endif
 }
 
-void *
+PMALLOC_ENTRY void *
 pcalloc(size_t size){
     void *ptr = calloc(1 , size + PREFIX_SIZE);
 
     if(!ptr) pmalloc_oom_handler(size);
-    *((size_t*)ptr) = size;
+#ifdef HAVE_MALLOC_SIZE
+    update_pmalloc_stat_alloc(pmalloc_size(ptr));
+    return ptr;
+#else
+    pmalloc_header_set(ptr , size);
     update_pmalloc_stat_alloc(size+PREFIX_SIZE);
     return (char *)ptr + PREFIX_SIZE;
+#endif
 }
 
-void *
+PMALLOC_ENTRY void *
 prealloc(void *ptr , size_t size){
+#ifndef HAVE_MALLOC_SIZE
+    void *realptr;
+#endif
     size_t oldsize;
-    void
-        *realptr,
-        *newptr;
+    void *newptr;
     
     if(ptr == NULL) return pmalloc(size);
+#ifdef HAVE_MALLOC_SIZE
+    oldsize = pmalloc_size(ptr);
+    /* realloc(ptr , 0) may free ptr and return NULL , which is no OOM :
+     * keep a minimal block , like the header build does */
+    newptr = realloc(ptr , size ? size : 1);
+    if(!newptr) pmalloc_oom_handler(size);
+
+    update_pmalloc_stat_free(oldsize);
+    update_pmalloc_stat_alloc(pmalloc_size(newptr));
+    return newptr;
+#else
     realptr = (char *)ptr - PREFIX_SIZE;
     oldsize = *((size_t*)realptr);
+    pmalloc_header_clear(realptr);
     newptr  = realloc(realptr , size+PREFIX_SIZE);
     if(!newptr) pmalloc_oom_handler(size);
     
-    *((size_t*) newptr) = size;
+    pmalloc_header_set(newptr , size);
     update_pmalloc_stat_free(oldsize);
     update_pmalloc_stat_alloc(size);
     return (char *)newptr + PREFIX_SIZE;
+#endif
 }
 
+/* Bytes a block takes: what the allocator really reserved when it can
+ * tell, the requested size rounded up plus the header otherwise */
 size_t
 pmalloc_size(void *ptr){
+#ifdef HAVE_MALLOC_SIZE
+    return pmalloc_usable_size(ptr);
+#else
     void *realptr = (char *)ptr-PREFIX_SIZE;
     size_t size = *((size_t*)realptr);
 
     if(size&(sizeof(long)-1)) size+=sizeof(long)-(size&(sizeof(long)-1));
     return size+PREFIX_SIZE;
+#endif
 }
 
 void
 pfree(void *ptr){
+#ifndef HAVE_MALLOC_SIZE
     void * realptr;
     size_t oldsize;
+#endif
     
     if(ptr == NULL) return;
+#ifdef HAVE_MALLOC_SIZE
+    update_pmalloc_stat_free(pmalloc_size(ptr));
+    free(ptr);
+#else
     realptr = (char *)ptr - PREFIX_SIZE;
     oldsize = *((size_t*) realptr);
     update_pmalloc_stat_free(oldsize+PREFIX_SIZE);
+    pmalloc_header_clear(realptr);
     free(realptr);
+#endif
 }
 
-char *
+PMALLOC_ENTRY char *
 pstrdup(const char *s){
     size_t l = strlen(s) + 1;
     char *p = pmalloc(l);
@@ -118,13 +231,15 @@ pstrdup(const char *s){
 
 size_t
 pmalloc_used_memory(void){
-    size_t um;
+    size_t um = 0;
+    int i;
+
     if(pmalloc_thread_safe){
-        pthread_mutex_lock(&used_memory_mutex);
-        um = used_memory;
-        pthread_mutex_unlock(&used_memory_mutex);
+        for(i = 0 ; i < PMALLOC_SHARDS ; i++)
+            um += __atomic_load_n(&used_memory[i].used , __ATOMIC_RELAXED);
     }else {
-        um = used_memory;
+        for(i = 0 ; i < PMALLOC_SHARDS ; i++)
+            um += used_memory[i].used;
     }
     return um;
 }
@@ -139,13 +254,824 @@ pmalloc_set_oom_handler(void (*oom_handler)(size_t)){
     pmalloc_oom_handler = oom_handler;
 }
 
-#if defined(HAVE_PROC_STAT)
+static size_t
+pmalloc_watermark(int level){
+    return __atomic_load_n(level == PMALLOC_LEVEL_HARD ? &pmalloc_hard_mark :
+                           &pmalloc_soft_mark , __ATOMIC_RELAXED);
+}
+
+static void
+pmalloc_watermark_check(void){
+    size_t used , mark;
+    int old , level , l;
+    void (*handler)(int , size_t);
+
+    pmalloc_tick = 0;
+    if(pmalloc_watermark(PMALLOC_LEVEL_SOFT) == 0 &&
+       pmalloc_watermark(PMALLOC_LEVEL_HARD) == 0 &&
+       __atomic_load_n(&pmalloc_level , __ATOMIC_RELAXED) == PMALLOC_LEVEL_OK)
+        return;
+
+    used = pmalloc_used_memory();
+    old = __atomic_load_n(&pmalloc_level , __ATOMIC_RELAXED);
+    for(level = PMALLOC_LEVEL_HARD ; level > PMALLOC_LEVEL_OK ; level--){
+        mark = pmalloc_watermark(level);
+        if(mark && used >= mark) break;
+    }
+    /* Going down, stay at the highest level whose slack still holds */
+    for(l = old ; l > level ; l--){
+        mark = pmalloc_watermark(l);
+        if(mark && used >= mark - mark/PMALLOC_WATERMARK_SLACK){
+            level = l;
+            break;
+        }
+    }
+    if(level == old) return;
+    if(!__atomic_compare_exchange_n(&pmalloc_level , &old , level , 0 ,
+                                    __ATOMIC_RELAXED , __ATOMIC_RELAXED))
+        return;
+    handler = __atomic_load_n(&pmalloc_watermark_handler , __ATOMIC_ACQUIRE);
+    if(handler) handler(level , used);
+}
+
+/* Soft and hard limits of pmalloc_used_memory(), 0 to disable one. The
+ * handler is told of every change of PMALLOC_LEVEL_*, within
+ * PMALLOC_WATERMARK_TICK bytes allocated or freed by a thread after the
+ * crossing. It runs on the allocating thread in the middle of pmalloc,
+ * so it must be short and should not allocate: the event loops
+ * (peSetMemoryProc) only write to an eventfd. */
+void
+pmalloc_set_watermarks(size_t soft , size_t hard){
+    __atomic_store_n(&pmalloc_soft_mark , soft , __ATOMIC_RELAXED);
+    __atomic_store_n(&pmalloc_hard_mark , hard , __ATOMIC_RELAXED);
+    pmalloc_watermark_check();
+}
+
+/* Returns the handler replaced , which the new one should call in turn
+ * so that several users can watch the watermarks */
+pmalloc_watermark_proc *
+pmalloc_set_watermark_handler(pmalloc_watermark_proc *handler){
+    return __atomic_exchange_n(&pmalloc_watermark_handler , handler , __ATOMIC_ACQ_REL);
+}
+
+int
+pmalloc_memory_level(void){
+    return __atomic_load_n(&pmalloc_level , __ATOMIC_RELAXED);
+}
+
+/* Object pools.
+ *
+ * Objects of one size are carved from slabs of PMALLOC_POOL_SLAB bytes and
+ * recycled through a free list threaded through the objects themselves:
+ * no header per object, neighbours share cache lines, and once the pool
+ * has grown to its working set getting and putting are a few instructions
+ * without calling the allocator. Slabs are only given back when the pool
+ * is destroyed, and they count in pmalloc_used_memory() as a whole.
+ *
+ * A pool is not thread safe: use one per thread, or per event loop. */
+pmalloc_pool *
+pmalloc_pool_create(size_t objsize){
+    pmalloc_pool *pool = pmalloc(sizeof(*pool));
+
+    if(pool == NULL) return NULL;
+    if(objsize < sizeof(void *)) objsize = sizeof(void *);
+    if(objsize&(sizeof(void *)-1)) objsize += sizeof(void *)-(objsize&(sizeof(void *)-1));
+    pool->objsize = objsize;
+    pool->perslab = (PMALLOC_POOL_SLAB - sizeof(void *)) / objsize;
+    if(pool->perslab < 8) pool->perslab = 8;
+    pool->free = NULL;
+    pool->slabs = NULL;
+    pool->nslabs = 0;
+    pool->used = 0;
+    return pool;
+}
+
+/* Objects still out are freed with their slabs */
+void
+pmalloc_pool_destroy(pmalloc_pool *pool){
+    void *slab;
+
+    if(pool == NULL) return;
+    while((slab = pool->slabs) != NULL){
+        pool->slabs = *(void **)slab;
+        pfree(slab);
+    }
+    pfree(pool);
+}
+
+static int
+pmalloc_pool_grow(pmalloc_pool *pool){
+    char *slab = pmalloc(sizeof(void *) + pool->objsize * pool->perslab), *obj;
+    size_t i;
+
+    if(slab == NULL) return -1;
+    *(void **)slab = pool->slabs;
+    pool->slabs = slab;
+    pool->nslabs++;
+    /* Linked in address order, so the first gets walk the slab forward */
+    obj = slab + sizeof(void *) + pool->objsize * pool->perslab;
+    for(i = 0 ; i < pool->perslab ; i++){
+        obj -= pool->objsize;
+        *(void **)obj = pool->free;
+        pool->free = obj;
+    }
+    return 0;
+}
+
+/* Uninitialized object of the pool's size, NULL when out of memory and
+ * the oom handler returned */
+void *
+pmalloc_pool_get(pmalloc_pool *pool){
+    void *obj;
+
+    if(pool->free == NULL && pmalloc_pool_grow(pool) == -1) return NULL;
+    obj = pool->free;
+    pool->free = *(void **)obj;
+    pool->used++;
+    return obj;
+}
+
+void
+pmalloc_pool_put(pmalloc_pool *pool , void *obj){
+    if(obj == NULL) return;
+    *(void **)obj = pool->free;
+    pool->free = obj;
+    pool->used--;
+}
+
+/* Arenas.
+ *
+ * Memory for short lived data, taken by bumping an offset in a chunk and
+ * given back all at once by pmalloc_arena_reset, or down to a mark saved
+ * earlier for nested scopes. A chunk too small for a request is followed
+ * by a new one, larger than the request if needed. On reset the arena
+ * keeps a single chunk large enough for the high-water mark, so a steady
+ * workload ends up with one chunk and no allocator calls at all.
+ *
+ * Chunks are counted in pmalloc_used_memory(), and their total across
+ * arenas is returned by pmalloc_arena_memory(). */
+static size_t arena_memory = 0;
+
+void
+pmalloc_arena_init(pmalloc_arena *arena , size_t chunksize){
+    arena->chunks = NULL;
+    arena->chunksize = chunksize ? chunksize : PMALLOC_ARENA_CHUNK;
+    arena->footprint = 0;
+    arena->used = 0;
+    arena->highwater = 0;
+}
+
+static void
+pmalloc_arena_drop(pmalloc_arena *arena , pmalloc_arena_chunk *chunk){
+    arena->footprint -= chunk->size;
+    __atomic_sub_fetch(&arena_memory , chunk->size , __ATOMIC_RELAXED);
+    pfree(chunk);
+}
+
+static pmalloc_arena_chunk *
+pmalloc_arena_grow(pmalloc_arena *arena , size_t size){
+    pmalloc_arena_chunk *chunk;
+
+    if(size < arena->chunksize) size = arena->chunksize;
+    chunk = pmalloc(sizeof(*chunk) + size);
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->footprint += size;
+    __atomic_add_fetch(&arena_memory , size , __ATOMIC_RELAXED);
+    return chunk;
+}
+
+void
+pmalloc_arena_free(pmalloc_arena *arena){
+    pmalloc_arena_chunk *chunk;
+
+    while((chunk = arena->chunks) != NULL){
+        arena->chunks = chunk->next;
+        pmalloc_arena_drop(arena , chunk);
+    }
+    arena->used = 0;
+}
+
+/* Memory aligned on PMALLOC_ARENA_ALIGN, valid until the arena is reset or
+ * restored to a mark saved before */
+void *
+pmalloc_arena_alloc(pmalloc_arena *arena , size_t size){
+    pmalloc_arena_chunk *chunk = arena->chunks;
+    void *ptr;
+
+    size = (size + PMALLOC_ARENA_ALIGN - 1) & ~(size_t)(PMALLOC_ARENA_ALIGN - 1);
+    if(chunk == NULL || chunk->size - chunk->used < size)
+        chunk = pmalloc_arena_grow(arena , size);
+    ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    if(arena->used > arena->highwater) arena->highwater = arena->used;
+    return ptr;
+}
+
+/* Give back everything. The arena is left with a single chunk sized for
+ * the high-water mark, so the next cycle fits in it. */
+void
+pmalloc_arena_reset(pmalloc_arena *arena){
+    pmalloc_arena_chunk *chunk = arena->chunks;
+
+    if(chunk == NULL) return;
+    if(chunk->next || chunk->size < arena->highwater){
+        pmalloc_arena_free(arena);
+        chunk = pmalloc_arena_grow(arena , arena->highwater);
+    }
+    chunk->used = 0;
+    arena->used = 0;
+}
+
+pmalloc_arena_mark
+pmalloc_arena_save(pmalloc_arena *arena){
+    pmalloc_arena_mark mark;
+
+    mark.chunk = arena->chunks;
+    mark.offset = mark.chunk ? mark.chunk->used : 0;
+    mark.used = arena->used;
+    return mark;
+}
+
+/* Give back what was allocated since mark was saved. Marks saved after it
+ * are invalidated. */
+void
+pmalloc_arena_restore(pmalloc_arena *arena , pmalloc_arena_mark mark){
+    pmalloc_arena_chunk *chunk;
+
+    while((chunk = arena->chunks) != mark.chunk){
+        /* Keep a chunk that grew the scope if it is the last one */
+        if(mark.chunk == NULL && chunk->next == NULL){
+            chunk->used = 0;
+            arena->used = 0;
+            return;
+        }
+        arena->chunks = chunk->next;
+        pmalloc_arena_drop(arena , chunk);
+    }
+    if(chunk) chunk->used = mark.offset;
+    arena->used = mark.used;
+}
+
+size_t
+pmalloc_arena_memory(void){
+    return __atomic_load_n(&arena_memory , __ATOMIC_RELAXED);
+}
+
+/* Large blocks.
+ *
+ * Tables indexed by fd or slot, sized once and walked at random, cost a
+ * TLB miss per access once they span many 4KB pages. pmalloc_large maps
+ * them on their own: with PMALLOC_LARGE_HUGE from reserved huge pages if
+ * the system has some (MAP_HUGETLB), else from a mapping aligned on a
+ * huge page and advised for transparent huge pages (MADV_HUGEPAGE). With
+ * PMALLOC_LARGE_LOCAL the mapping prefers the NUMA node of the calling
+ * thread (mbind), before its pages are touched. Each step that fails
+ * (no huge pages, THP disabled, one node, mbind not permitted) leaves a
+ * plain mapping, and small blocks don't get a mapping at all.
+ *
+ * Blocks start zeroed, after a header of PMALLOC_LARGE_HDR bytes keeping
+ * them cache line aligned: mappings start on a page, and pcalloc blocks
+ * are over-allocated to place the header on a cache line. They count in
+ * pmalloc_used_memory(). */
+#define PMALLOC_LARGE_HDR 64
+
+typedef struct pmalloc_large_hdr {
+    size_t size;     /* bytes of the mapping or of the pcalloc block */
+    int backing;     /* PMALLOC_BACKING_* */
+    int node;        /* NUMA node preferred, -1 if none */
+    void *block;     /* pcalloc block holding the header */
+} pmalloc_large_hdr;
+
+#if defined(HAVE_MMAP)
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* MAP_HUGETLB alone maps the default huge page size, which may be 1GB:
+ * ask for PMALLOC_HUGE_PAGE, or don't use reserved huge pages at all */
+#if defined(MAP_HUGE_2MB)
+#define PMALLOC_MAP_HUGE (MAP_HUGETLB|MAP_HUGE_2MB)
+#elif defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+#define PMALLOC_MAP_HUGE (MAP_HUGETLB|(21 << MAP_HUGE_SHIFT))
+#endif
+
+#if defined(HAVE_NUMA)
+#include <sys/syscall.h>
+#define PMALLOC_MPOL_PREFERRED 1
+#define PMALLOC_MAX_NODES 1024
+
+/* Prefer the node of the calling thread for addr, returns the node or -1 */
+static int
+pmalloc_bind_local(void *addr , size_t len){
+    unsigned long mask[PMALLOC_MAX_NODES / (8 * sizeof(unsigned long))];
+    unsigned int cpu , node;
+
+    if(syscall(SYS_getcpu , &cpu , &node , NULL) == -1) return -1;
+    if(node >= PMALLOC_MAX_NODES) return -1;
+    memset(mask , 0 , sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    if(syscall(SYS_mbind , addr , len , PMALLOC_MPOL_PREFERRED , mask ,
+               PMALLOC_MAX_NODES , 0) == -1)
+        return -1;
+    return node;
+}
+#else
+static int
+pmalloc_bind_local(void *addr , size_t len){
+    (void)addr;
+    (void)len;
+    return -1;
+}
+#endif
+
+/* size bytes aligned on align, a power of two */
+static void *
+pmalloc_map_aligned(size_t size , size_t align){
+    char *p = mmap(NULL , size + align , PROT_READ|PROT_WRITE ,
+                   MAP_PRIVATE|MAP_ANONYMOUS , -1 , 0);
+    char *start;
+
+    if(p == MAP_FAILED) return NULL;
+    start = (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+    if(start > p) munmap(p , start - p);
+    if(start + size < p + size + align) munmap(start + size , (p + size + align) - (start + size));
+    return start;
+}
+
+static pmalloc_large_hdr *
+pmalloc_large_map(size_t *total , int flags , int *backing){
+    size_t page = sysconf(_SC_PAGESIZE);
+    void *p = NULL;
+
+    *backing = PMALLOC_BACKING_PAGES;
+    if((flags & PMALLOC_LARGE_HUGE) && *total >= PMALLOC_HUGE_PAGE){
+        *total = (*total + PMALLOC_HUGE_PAGE - 1) & ~(size_t)(PMALLOC_HUGE_PAGE - 1);
+#if defined(PMALLOC_MAP_HUGE)
+        p = mmap(NULL , *total , PROT_READ|PROT_WRITE ,
+                 MAP_PRIVATE|MAP_ANONYMOUS|PMALLOC_MAP_HUGE , -1 , 0);
+        if(p != MAP_FAILED){
+            *backing = PMALLOC_BACKING_HUGETLB;
+            return p;
+        }
+#endif
+        if((p = pmalloc_map_aligned(*total , PMALLOC_HUGE_PAGE)) == NULL) return NULL;
+#if defined(MADV_HUGEPAGE)
+        if(madvise(p , *total , MADV_HUGEPAGE) == 0) *backing = PMALLOC_BACKING_THP;
+#endif
+        return p;
+    }
+    *total = (*total + page - 1) & ~(page - 1);
+    p = mmap(NULL , *total , PROT_READ|PROT_WRITE , MAP_PRIVATE|MAP_ANONYMOUS , -1 , 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+#endif
+
+void *
+pmalloc_large(size_t size , int flags){
+    size_t total = size + PMALLOC_LARGE_HDR;
+    pmalloc_large_hdr *hdr;
+    int backing , node = -1;
+
+#if defined(HAVE_MMAP)
+    if(total >= PMALLOC_LARGE_MIN){
+        if((hdr = pmalloc_large_map(&total , flags , &backing)) == NULL){
+            pmalloc_oom_handler(size);
+            return NULL;
+        }
+        /* Placement applies to pages not touched yet, header included */
+        if(flags & PMALLOC_LARGE_LOCAL) node = pmalloc_bind_local(hdr , total);
+        update_pmalloc_stat_alloc(total);
+    } else
+#endif
+    {
+        void *block;
+
+        total += PMALLOC_LARGE_HDR - 1;
+        if((block = pcalloc(total)) == NULL) return NULL;
+        hdr = (pmalloc_large_hdr *)(((uintptr_t)block + PMALLOC_LARGE_HDR - 1) &
+                                    ~(uintptr_t)(PMALLOC_LARGE_HDR - 1));
+        hdr->block = block;
+        backing = PMALLOC_BACKING_HEAP;
+    }
+    hdr->size = total;
+    hdr->backing = backing;
+    hdr->node = node;
+    return (char *)hdr + PMALLOC_LARGE_HDR;
+}
+
+void
+pfree_large(void *ptr){
+    pmalloc_large_hdr *hdr;
+
+    if(ptr == NULL) return;
+    hdr = (pmalloc_large_hdr *)((char *)ptr - PMALLOC_LARGE_HDR);
+    if(hdr->backing == PMALLOC_BACKING_HEAP){
+        pfree(hdr->block);
+        return;
+    }
+#if defined(HAVE_MMAP)
+    update_pmalloc_stat_free(hdr->size);
+    munmap(hdr , hdr->size);
+#endif
+}
+
+int
+pmalloc_large_backing(void *ptr){
+    return ((pmalloc_large_hdr *)((char *)ptr - PMALLOC_LARGE_HDR))->backing;
+}
+
+int
+pmalloc_large_node(void *ptr){
+    return ((pmalloc_large_hdr *)((char *)ptr - PMALLOC_LARGE_HDR))->node;
+}
+
+/* Allocation profiling.
+ *
+ * Built with -DPMALLOC_PROFILE, the allocation macros of pmalloc.h pass
+ * the call site of every allocation, a static structure per __FILE__ and
+ * __LINE__. One allocation every PMALLOC_PROFILE_RATE bytes on average
+ * (per thread, at random intervals) is sampled: its site is credited with
+ * the bytes and allocations the sample stands for, and its backtrace is
+ * recorded. The rest only costs a countdown, so the overhead stays small
+ * enough to leave on in canaries.
+ *
+ * A sampled block keeps its site or backtrace in a second header word, so
+ * a free finds what to debit with no lookup. Sites register themselves on
+ * first sample in a list pushed with compare and swap. Backtraces go to a
+ * fixed open addressing table whose slots are claimed with compare and
+ * swap and never freed. All counters are relaxed atomic adds.
+ * Allocations done inside pmalloc itself (pools, arenas) go to the
+ * "unknown" site.
+ *
+ * pmalloc_dump_sites() lists the estimated live memory per site,
+ * pmalloc_dump_profile() writes the raw samples in the legacy heap
+ * profile format read by pprof, which scales them with the rate. */
+#ifdef PMALLOC_PROFILE
+#include <execinfo.h>
+
+typedef struct pmalloc_stack {
+    unsigned long long hash;  /* 0 while the slot is free */
+    int ready;                /* frames written */
+    int depth;
+    void *frames[PMALLOC_PROFILE_DEPTH];
+    pmalloc_site *site;
+    size_t live_bytes;
+    size_t live_count;
+    size_t alloc_bytes;
+    size_t alloc_count;
+} pmalloc_stack;
+
+__thread pmalloc_site *pmalloc_cursite = NULL;
+static __thread long long pmalloc_sample_left;
+static __thread unsigned long long pmalloc_sample_seed = 0;
+static pmalloc_site pmalloc_unknown_site = { "unknown" , 0 };
+static pmalloc_site *pmalloc_sites = NULL;
+static pmalloc_stack pmalloc_stacks[PMALLOC_PROFILE_STACKS];
+static size_t pmalloc_profile_rate = PMALLOC_PROFILE_RATE;
+static size_t pmalloc_stacks_dropped = 0;
+
+static void
+pmalloc_site_register(pmalloc_site *site){
+    pmalloc_site *head;
+
+    if(__atomic_exchange_n(&site->registered , 1 , __ATOMIC_ACQ_REL)) return;
+    head = __atomic_load_n(&pmalloc_sites , __ATOMIC_RELAXED);
+    do {
+        site->next = head;
+    } while(!__atomic_compare_exchange_n(&pmalloc_sites , &head , site , 1 ,
+                                         __ATOMIC_RELEASE , __ATOMIC_RELAXED));
+}
+
+/* Bytes before the next sample: uniform in [1, 2*rate], xorshift seeded
+ * per thread */
+static long long
+pmalloc_sample_interval(void){
+    unsigned long long x = pmalloc_sample_seed;
+
+    if(x == 0) x = (uintptr_t)&pmalloc_sample_seed ^ (unsigned long long)time(NULL) << 20 ^ 1;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    pmalloc_sample_seed = x;
+    return x % (2 * pmalloc_profile_rate) + 1;
+}
+
+/* Allocator frames a backtrace may start with: entry points calling each
+ * other (pstrdup calls pmalloc) and the profiling code */
+#define PMALLOC_PROFILE_SKIP 8
+
+extern char __start_pmalloc_entry[] , __stop_pmalloc_entry[];
+
+/* Slot of the backtrace of the current allocation, NULL if the table is full */
+static PMALLOC_ENTRY pmalloc_stack *
+pmalloc_stack_get(pmalloc_site *site){
+    void *all[PMALLOC_PROFILE_DEPTH + PMALLOC_PROFILE_SKIP] , **frames;
+    unsigned long long hash = 1469598103934665603ULL;
+    int depth , i , skip = 0 , probe;
+
+    /* Start at the caller of the outermost allocator frame: how many
+     * there are depends on the entry point and on inlining. Return
+     * addresses may point right past the end of their function. */
+    depth = backtrace(all , PMALLOC_PROFILE_DEPTH + PMALLOC_PROFILE_SKIP);
+    for(i = 0 ; i < depth && i < PMALLOC_PROFILE_SKIP ; i++){
+        if((char *)all[i] > __start_pmalloc_entry && (char *)all[i] <= __stop_pmalloc_entry)
+            skip = i + 1;
+    }
+    frames = all + skip;
+    depth -= skip;
+    if(depth > PMALLOC_PROFILE_DEPTH) depth = PMALLOC_PROFILE_DEPTH;
+    if(depth <= 0) return NULL;
+    for(i = 0 ; i < depth ; i++) hash = (hash ^ (uintptr_t)frames[i]) * 1099511628211ULL;
+    if(hash == 0) hash = 1;
+
+    for(probe = 0 ; probe < 64 ; probe++){
+        pmalloc_stack *st = &pmalloc_stacks[(hash + probe) & (PMALLOC_PROFILE_STACKS - 1)];
+        unsigned long long h = __atomic_load_n(&st->hash , __ATOMIC_ACQUIRE);
+
+        if(h == 0){
+            if(!__atomic_compare_exchange_n(&st->hash , &h , hash , 0 ,
+                                            __ATOMIC_ACQ_REL , __ATOMIC_ACQUIRE)){
+                if(h != hash) continue;
+            } else {
+                memcpy(st->frames , frames , sizeof(void *) * depth);
+                st->depth = depth;
+                st->site = site;
+                __atomic_store_n(&st->ready , 1 , __ATOMIC_RELEASE);
+                return st;
+            }
+        }
+        if(h != hash) continue;
+        /* Claimed by another thread an instant ago */
+        while(!__atomic_load_n(&st->ready , __ATOMIC_ACQUIRE));
+        if(st->depth == depth && st->site == site &&
+           memcmp(st->frames , frames , sizeof(void *) * depth) == 0)
+            return st;
+    }
+    __atomic_add_fetch(&pmalloc_stacks_dropped , 1 , __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* Bytes and allocations a sample of size bytes stands for */
+static void
+pmalloc_sample_weight(size_t size , size_t *bytes , size_t *count){
+    size_t rate = pmalloc_profile_rate;
+
+    if(size >= rate){
+        *bytes = size;
+        *count = 1;
+    } else {
+        *bytes = rate;
+        *count = size ? rate / size : rate;
+    }
+}
+
+/* Decide whether this allocation of the current call site is sampled.
+ * Returns the tag stored in the header: 0 if not, the site, or the
+ * backtrace slot with the low bit set. */
+static PMALLOC_ENTRY uintptr_t
+pmalloc_profile_alloc(size_t size){
+    pmalloc_site *site = pmalloc_cursite;
+    pmalloc_stack *st;
+    size_t bytes , count;
+
+    pmalloc_cursite = NULL;
+    if(pmalloc_profile_rate == 0) return 0;
+    if(pmalloc_sample_seed == 0) pmalloc_sample_left = pmalloc_sample_interval();
+    if((pmalloc_sample_left -= size) > 0) return 0;
+    pmalloc_sample_left = pmalloc_sample_interval();
+
+    if(site == NULL) site = &pmalloc_unknown_site;
+    if(!__atomic_load_n(&site->registered , __ATOMIC_RELAXED)) pmalloc_site_register(site);
+    pmalloc_sample_weight(size , &bytes , &count);
+    __atomic_add_fetch(&site->live_bytes , bytes , __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->live_count , count , __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->alloc_bytes , bytes , __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->alloc_count , count , __ATOMIC_RELAXED);
+
+    if((st = pmalloc_stack_get(site)) == NULL) return (uintptr_t)site;
+    __atomic_add_fetch(&st->live_bytes , size , __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->live_count , 1 , __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->alloc_bytes , size , __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->alloc_count , 1 , __ATOMIC_RELAXED);
+    return (uintptr_t)st | 1;
+}
+
+static void
+pmalloc_profile_free(uintptr_t tag , size_t size){
+    pmalloc_site *site = (pmalloc_site *)tag;
+    size_t bytes , count;
+
+    if(tag == 0) return;
+    if(tag & 1){
+        pmalloc_stack *st = (pmalloc_stack *)(tag & ~(uintptr_t)1);
+
+        __atomic_sub_fetch(&st->live_bytes , size , __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&st->live_count , 1 , __ATOMIC_RELAXED);
+        site = st->site;
+    }
+    pmalloc_sample_weight(size , &bytes , &count);
+    __atomic_sub_fetch(&site->live_bytes , bytes , __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&site->live_count , count , __ATOMIC_RELAXED);
+}
+
+/* 0 stops profiling, 1 samples every allocation. Set it before
+ * allocating: live estimates of blocks allocated with another rate are
+ * off when they are freed. */
+void
+pmalloc_set_profile_rate(size_t bytes){
+    pmalloc_profile_rate = bytes;
+}
+
+/* Heap profile of the sampled allocations, for pprof:
+ *   pprof --text ./app path */
+int
+pmalloc_dump_profile(const char *path){
+    size_t inuse_count = 0 , inuse_bytes = 0 , alloc_count = 0 , alloc_bytes = 0;
+    char buf[4096];
+    FILE *fp , *maps;
+    size_t n;
+    int i , j;
+
+    if((fp = fopen(path , "w")) == NULL) return -1;
+    for(i = 0 ; i < PMALLOC_PROFILE_STACKS ; i++){
+        pmalloc_stack *st = &pmalloc_stacks[i];
+
+        if(!__atomic_load_n(&st->ready , __ATOMIC_ACQUIRE)) continue;
+        inuse_count += st->live_count;
+        inuse_bytes += st->live_bytes;
+        alloc_count += st->alloc_count;
+        alloc_bytes += st->alloc_bytes;
+    }
+    fprintf(fp , "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n" ,
+            inuse_count , inuse_bytes , alloc_count , alloc_bytes , pmalloc_profile_rate);
+    for(i = 0 ; i < PMALLOC_PROFILE_STACKS ; i++){
+        pmalloc_stack *st = &pmalloc_stacks[i];
+
+        if(!__atomic_load_n(&st->ready , __ATOMIC_ACQUIRE)) continue;
+        fprintf(fp , "%zu: %zu [%zu: %zu] @" , st->live_count , st->live_bytes ,
+                st->alloc_count , st->alloc_bytes);
+        for(j = 0 ; j < st->depth ; j++) fprintf(fp , " %p" , st->frames[j]);
+        fprintf(fp , "\n");
+    }
+    fprintf(fp , "\nMAPPED_LIBRARIES:\n");
+    if((maps = fopen("/proc/self/maps" , "r")) != NULL){
+        while((n = fread(buf , 1 , sizeof(buf) , maps)) > 0) fwrite(buf , 1 , n , fp);
+        fclose(maps);
+    }
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+static int
+pmalloc_site_cmp(const void *a , const void *b){
+    size_t x = (*(pmalloc_site * const *)a)->live_bytes;
+    size_t y = (*(pmalloc_site * const *)b)->live_bytes;
+
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/* Estimated live and total allocations of every sampled call site, most
+ * live bytes first */
+int
+pmalloc_dump_sites(const char *path){
+    pmalloc_site *site , **sites;
+    size_t count = 0 , i;
+    FILE *fp;
+
+    if((fp = fopen(path , "w")) == NULL) return -1;
+    for(site = __atomic_load_n(&pmalloc_sites , __ATOMIC_ACQUIRE) ; site ; site = site->next) count++;
+    /* Plain malloc: allocating through pmalloc would change what we print */
+    if((sites = malloc(sizeof(*sites) * (count + 1))) == NULL){
+        fclose(fp);
+        return -1;
+    }
+    count = 0;
+    for(site = __atomic_load_n(&pmalloc_sites , __ATOMIC_ACQUIRE) ; site ; site = site->next)
+        sites[count++] = site;
+    qsort(sites , count , sizeof(*sites) , pmalloc_site_cmp);
+    fprintf(fp , "%-40s %14s %12s %14s %12s\n" , "site" , "live_bytes" ,
+            "live_count" , "alloc_bytes" , "alloc_count");
+    for(i = 0 ; i < count ; i++){
+        char name[256];
+
+        snprintf(name , sizeof(name) , "%s:%d" , sites[i]->file , sites[i]->line);
+        fprintf(fp , "%-40s %14zu %12zu %14zu %12zu\n" , name , sites[i]->live_bytes ,
+                sites[i]->live_count , sites[i]->alloc_bytes , sites[i]->alloc_count);
+    }
+    fprintf(fp , "# sampling every %zu bytes , %zu backtraces dropped (table full)\n" ,
+            pmalloc_profile_rate , pmalloc_stacks_dropped);
+    free(sites);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+#else
+void
+pmalloc_set_profile_rate(size_t bytes){
+    (void)bytes;
+}
+
+/* Profiling is compiled out: build with -DPMALLOC_PROFILE */
+int
+pmalloc_dump_profile(const char *path){
+    (void)path;
+    return -1;
+}
+
+int
+pmalloc_dump_sites(const char *path){
+    (void)path;
+    return -1;
+}
+#endif
+
+/* Memory of the process as seen by the kernel.
+ *
+ * RSS comes from /proc/self/statm and private dirty memory from
+ * /proc/self/smaps_rollup (Linux 4.14), both kept open and read again
+ * with pread: one system call and a short parse, where the full smaps
+ * lists every mapping and takes milliseconds on a large heap. Older
+ * kernels fall back to /proc/<pid>/stat and smaps.
+ *
+ * Callers that can't afford even that on their path (loop callbacks
+ * exporting metrics) start the sampler: a thread refreshing both values
+ * every interval, after which the getters return the last sample with
+ * no system call. */
+static size_t pmalloc_rss_sample = 0 , pmalloc_pd_sample = 0;
+static int pmalloc_sampling = 0;
+static pthread_t pmalloc_sampler;
+static pthread_mutex_t pmalloc_sampler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pmalloc_sampler_cond = PTHREAD_COND_INITIALIZER;
+static long long pmalloc_sampler_ms = 0;
+static pthread_once_t pmalloc_fork_once = PTHREAD_ONCE_INIT;
+
+#if defined(HAVE_PROC_STAT) || defined(HAVE_PROC_SMAPS)
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-size_t 
-pmalloc_get_rss(void){  /*得到占用系统内存总量*/
+#include <errno.h>
+
+static int pmalloc_statm_fd = -2;
+static int pmalloc_rollup_fd = -2;
+#endif
+
+/* A forked child keeps /proc/self of the parent open and the samples of
+ * its sampler, without the thread: drop the fds so that the first read
+ * reopens them, and stop sampling. The lock may have been held by the
+ * sampler at fork. Only one thread runs yet. */
+static void
+pmalloc_atfork_child(void){
+#if defined(HAVE_PROC_STAT) || defined(HAVE_PROC_SMAPS)
+    if(pmalloc_statm_fd >= 0) close(pmalloc_statm_fd);
+    if(pmalloc_rollup_fd >= 0) close(pmalloc_rollup_fd);
+    pmalloc_statm_fd = pmalloc_rollup_fd = -2;
+#endif
+    pmalloc_sampling = 0;
+    pthread_mutex_init(&pmalloc_sampler_lock , NULL);
+    pthread_cond_init(&pmalloc_sampler_cond , NULL);
+}
+
+static void
+pmalloc_fork_init(void){
+    pthread_atfork(NULL , NULL , pmalloc_atfork_child);
+}
+
+#if defined(HAVE_PROC_STAT) || defined(HAVE_PROC_SMAPS)
+
+/* Open path once, -1 if it doesn't exist. The fd is shared by threads,
+ * the first one to open it wins. */
+static int
+pmalloc_proc_fd(int *fdp , const char *path){
+    int fd = __atomic_load_n(fdp , __ATOMIC_ACQUIRE) , expected = -2;
+
+    if(fd != -2) return fd;
+    pthread_once(&pmalloc_fork_once , pmalloc_fork_init);
+    fd = open(path , O_RDONLY|O_CLOEXEC);
+    if(!__atomic_compare_exchange_n(fdp , &expected , fd , 0 ,
+                                    __ATOMIC_ACQ_REL , __ATOMIC_ACQUIRE)){
+        if(fd != -1) close(fd);
+        fd = expected;
+    }
+    return fd;
+}
+
+/* Whole content of a small proc file, NUL terminated */
+static ssize_t
+pmalloc_proc_read(int fd , char *buf , size_t size){
+    ssize_t n;
+
+    while((n = pread(fd , buf , size - 1 , 0)) == -1 && errno == EINTR);
+    if(n < 0) return -1;
+    buf[n] = '\0';
+    return n;
+}
+#endif
+
+#if defined(HAVE_PROC_STAT)
+
+static size_t
+pmalloc_read_stat_rss(void){  /*得到占用系统内存总量*/
     int             /*获取runtime的信息，获取byte为单位的page大小*/
         page = sysconf(_SC_PAGESIZE),
         fd,
@@ -179,45 +1105,156 @@ pmalloc_get_rss(void){  /*得到占用系统内存总量*/
     rss *= page;
     return rss;
 }
+
+/* statm is "size resident shared text lib data dt", in pages */
+static size_t
+pmalloc_read_rss(void){
+    static long page = 0;
+    int fd = pmalloc_proc_fd(&pmalloc_statm_fd , "/proc/self/statm");
+    char buf[128] , *p;
+
+    if(fd == -1) return pmalloc_read_stat_rss();
+    if(page == 0) page = sysconf(_SC_PAGESIZE);
+    if(pmalloc_proc_read(fd , buf , sizeof(buf)) <= 0) return 0;
+    if((p = strchr(buf , ' ')) == NULL) return 0;
+    return strtoull(p + 1 , NULL , 10) * page;
+}
 #else
-size_t
-pmalloc_get_rss(void){
+static size_t
+pmalloc_read_rss(void){
     return pmalloc_used_memory();
 }
 #endif
 
-float    /* 碎片率Fragmentation = RSS / allocated-bytes */
-pmalloc_get_fragmentation_ratio(void){
-    return (float)pmalloc_get_rss()/pmalloc_used_memory();
+#if defined(HAVE_PROC_SMAPS)
+
+static size_t
+pmalloc_smaps_field(const char *line , size_t len){
+    char *p = strchr(line , 'k');
+
+    if(!p) return 0;
+    return strtol(line + len , NULL , 10) * 1024;
 }
 
-#if defined(HAVE_PROC_SMAPS)
-size_t
-pmalloc_get_private_dirty(void){
+static size_t
+pmalloc_read_private_dirty(void){
     char line[1024];
     size_t pd = 0;
-    FILE *fp = fopen("/proc/self/smaps" , "r");
+    int fd = pmalloc_proc_fd(&pmalloc_rollup_fd , "/proc/self/smaps_rollup");
+    FILE *fp;
+
+    if(fd != -1){
+        char buf[4096] , *p;
+
+        if(pmalloc_proc_read(fd , buf , sizeof(buf)) <= 0) return 0;
+        if((p = strstr(buf , "\nPrivate_Dirty:")) == NULL) return 0;
+        return pmalloc_smaps_field(p + 1 , 14);
+    }
 
-    if(!fp) return 0;
+    if((fp = fopen("/proc/self/smaps" , "r")) == NULL) return 0;
     while(fgets(line , sizeof(line) , fp) != NULL){
-        if(strncmp(line , "Private_Dirty:" , 14) == 0){
-            char *p = strchr(line , 'k');
-            if(p){
-                *p = '\0';
-                pd += strtol(line + 14 , NULL , 10) * 1024;
-            }
-        }
+        if(strncmp(line , "Private_Dirty:" , 14) == 0)
+            pd += pmalloc_smaps_field(line , 14);
     }
     fclose(fp);
     return pd;
 }
 #else
-size_t
-pmalloc_get_private_dirty(void){
+static size_t
+pmalloc_read_private_dirty(void){
     return 0;
 }
 #endif
 
+static void
+pmalloc_sample(void){
+    __atomic_store_n(&pmalloc_rss_sample , pmalloc_read_rss() , __ATOMIC_RELAXED);
+    __atomic_store_n(&pmalloc_pd_sample , pmalloc_read_private_dirty() , __ATOMIC_RELAXED);
+}
+
+static void *
+pmalloc_sampler_main(void *arg){
+    struct timespec deadline;
+    (void)arg;
+
+    pthread_mutex_lock(&pmalloc_sampler_lock);
+    while(pmalloc_sampling){
+        pthread_mutex_unlock(&pmalloc_sampler_lock);
+        pmalloc_sample();
+        pthread_mutex_lock(&pmalloc_sampler_lock);
+
+        clock_gettime(CLOCK_REALTIME , &deadline);
+        deadline.tv_sec += pmalloc_sampler_ms / 1000;
+        deadline.tv_nsec += (pmalloc_sampler_ms % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while(pmalloc_sampling &&
+              pthread_cond_timedwait(&pmalloc_sampler_cond , &pmalloc_sampler_lock ,
+                                     &deadline) != ETIMEDOUT);
+    }
+    pthread_mutex_unlock(&pmalloc_sampler_lock);
+    return NULL;
+}
+
+/* Refresh RSS and private dirty memory every interval_ms (0 for
+ * PMALLOC_SAMPLER_INTERVAL) from a background thread, the getters then
+ * return the last sample. Returns -1 if the thread can't be started. */
+int
+pmalloc_start_sampler(long long interval_ms){
+    if(interval_ms <= 0) interval_ms = PMALLOC_SAMPLER_INTERVAL;
+    pthread_once(&pmalloc_fork_once , pmalloc_fork_init);
+    pthread_mutex_lock(&pmalloc_sampler_lock);
+    pmalloc_sampler_ms = interval_ms;
+    if(pmalloc_sampling){
+        pthread_mutex_unlock(&pmalloc_sampler_lock);
+        return 0;
+    }
+    /* Readers never see the samples empty */
+    pmalloc_sample();
+    if(pthread_create(&pmalloc_sampler , NULL , pmalloc_sampler_main , NULL) != 0){
+        pthread_mutex_unlock(&pmalloc_sampler_lock);
+        return -1;
+    }
+    __atomic_store_n(&pmalloc_sampling , 1 , __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pmalloc_sampler_lock);
+    return 0;
+}
+
+/* The getters read the kernel again after this */
+void
+pmalloc_stop_sampler(void){
+    pthread_mutex_lock(&pmalloc_sampler_lock);
+    if(!pmalloc_sampling){
+        pthread_mutex_unlock(&pmalloc_sampler_lock);
+        return;
+    }
+    __atomic_store_n(&pmalloc_sampling , 0 , __ATOMIC_RELEASE);
+    pthread_cond_signal(&pmalloc_sampler_cond);
+    pthread_mutex_unlock(&pmalloc_sampler_lock);
+    pthread_join(pmalloc_sampler , NULL);
+}
+
+size_t
+pmalloc_get_rss(void){
+    if(__atomic_load_n(&pmalloc_sampling , __ATOMIC_ACQUIRE))
+        return __atomic_load_n(&pmalloc_rss_sample , __ATOMIC_RELAXED);
+    return pmalloc_read_rss();
+}
+
+float    /* 碎片率Fragmentation = RSS / allocated-bytes */
+pmalloc_get_fragmentation_ratio(void){
+    return (float)pmalloc_get_rss()/pmalloc_used_memory();
+}
+
+size_t
+pmalloc_get_private_dirty(void){
+    if(__atomic_load_n(&pmalloc_sampling , __ATOMIC_ACQUIRE))
+        return __atomic_load_n(&pmalloc_pd_sample , __ATOMIC_RELAXED);
+    return pmalloc_read_private_dirty();
+}
+
 
 
 
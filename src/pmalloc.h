@@ -10,10 +10,113 @@
 #define __xstr(s) __str(s)
 #define __str(s)  #s
 
+#if defined(USE_PTALLOC)
+#include "ptalloc.h"
+#define ZMALLOC_LIB "ptalloc"
+#endif
+
 #ifndef ZMALLOC_LIB
 #define ZMALLOC_LIB "libc"
 #endif
 
+#if defined(PMALLOC_PROFILE)
+#define PMALLOC_MODE ZMALLOC_LIB " (profiling)"
+#elif defined(HAVE_MALLOC_SIZE)
+#define PMALLOC_MODE ZMALLOC_LIB " (no header)"
+#else
+#define PMALLOC_MODE ZMALLOC_LIB " (size header)"
+#endif
+
+/* Bytes of memory per pool slab, at least 8 objects are carved from each */
+#define PMALLOC_POOL_SLAB 16384
+
+/* Pool of fixed size objects, see pmalloc_pool_create */
+typedef struct pmalloc_pool {
+    size_t objsize;  /* rounded up to a multiple of a pointer */
+    size_t perslab;  /* objects carved from each slab */
+    void *free;      /* free objects, linked through their first word */
+    void *slabs;     /* slabs, linked through their first word */
+    size_t nslabs;
+    size_t used;     /* objects handed out */
+} pmalloc_pool;
+
+/* Default size of arena chunks, see pmalloc_arena_init */
+#define PMALLOC_ARENA_CHUNK 65536
+
+/* Alignment of arena allocations */
+#define PMALLOC_ARENA_ALIGN 16
+
+typedef struct pmalloc_arena_chunk {
+    struct pmalloc_arena_chunk *next; /* older chunk */
+    size_t size;     /* bytes of data */
+    size_t used;
+    char data[] __attribute__((aligned(PMALLOC_ARENA_ALIGN)));
+} pmalloc_arena_chunk;
+
+/* Bump pointer allocator, freed all at once */
+typedef struct pmalloc_arena {
+    pmalloc_arena_chunk *chunks; /* the current chunk first */
+    size_t chunksize;  /* minimum size of a new chunk */
+    size_t footprint;  /* bytes of chunks held */
+    size_t used;       /* bytes handed out since the last reset */
+    size_t highwater;  /* most bytes handed out between two resets */
+} pmalloc_arena;
+
+/* Position to go back to, see pmalloc_arena_save */
+typedef struct pmalloc_arena_mark {
+    pmalloc_arena_chunk *chunk;
+    size_t offset;
+    size_t used;
+} pmalloc_arena_mark;
+
+/* Flags of pmalloc_large */
+#define PMALLOC_LARGE_HUGE  1  /* huge pages, when the system has them */
+#define PMALLOC_LARGE_LOCAL 2  /* on the NUMA node of the calling thread */
+
+/* Smaller pmalloc_large blocks come from pcalloc, larger ones are mapped,
+ * and from a huge page on rounded up to huge pages */
+#define PMALLOC_LARGE_MIN   (256*1024)
+#define PMALLOC_HUGE_PAGE   (2*1024*1024)
+
+/* Memory behind a pmalloc_large block */
+#define PMALLOC_BACKING_HEAP    0  /* pcalloc */
+#define PMALLOC_BACKING_PAGES   1  /* mapping of normal pages */
+#define PMALLOC_BACKING_THP     2  /* mapping advised for transparent huge pages */
+#define PMALLOC_BACKING_HUGETLB 3  /* mapping of reserved huge pages */
+
+/* Levels of memory use, see pmalloc_set_watermarks */
+#define PMALLOC_LEVEL_OK   0
+#define PMALLOC_LEVEL_SOFT 1  /* above the soft watermark */
+#define PMALLOC_LEVEL_HARD 2  /* above the hard watermark */
+
+/* Told of the changes of level, see pmalloc_set_watermarks */
+typedef void pmalloc_watermark_proc(int level , size_t used);
+
+/* Bytes a thread allocates or frees between two watermark checks */
+#define PMALLOC_WATERMARK_TICK (64*1024)
+
+/* Default ms between two samples of the process memory, see
+ * pmalloc_start_sampler */
+#define PMALLOC_SAMPLER_INTERVAL 100
+
+/* Profiling, in builds with -DPMALLOC_PROFILE: mean bytes allocated
+ * between two backtraces, frames kept and distinct backtraces tracked */
+#define PMALLOC_PROFILE_RATE   (512*1024)
+#define PMALLOC_PROFILE_DEPTH  32
+#define PMALLOC_PROFILE_STACKS 4096
+
+/* Allocations of a call site, see pmalloc_dump_sites */
+typedef struct pmalloc_site {
+    const char *file;
+    int line;
+    int registered;
+    size_t live_bytes;
+    size_t live_count;
+    size_t alloc_bytes;
+    size_t alloc_count;
+    struct pmalloc_site *next;
+} pmalloc_site;
+
 void   *pmalloc(size_t size);
 void   *pcalloc(size_t size);
 void   *prealloc(void *ptr, size_t size);
@@ -26,6 +129,44 @@ void    pmalloc_set_oom_handler(void (*oom_handler)(size_t));
 float   pmalloc_get_fragmentation_ratio(void);
 size_t  pmalloc_get_rss(void);
 size_t  pmalloc_get_private_dirty(void);
+int     pmalloc_start_sampler(long long interval_ms);
+void    pmalloc_stop_sampler(void);
+pmalloc_pool *pmalloc_pool_create(size_t objsize);
+void    pmalloc_pool_destroy(pmalloc_pool *pool);
+void   *pmalloc_pool_get(pmalloc_pool *pool);
+void    pmalloc_pool_put(pmalloc_pool *pool , void *obj);
+void    pmalloc_arena_init(pmalloc_arena *arena , size_t chunksize);
+void    pmalloc_arena_free(pmalloc_arena *arena);
+void   *pmalloc_arena_alloc(pmalloc_arena *arena , size_t size);
+void    pmalloc_arena_reset(pmalloc_arena *arena);
+pmalloc_arena_mark pmalloc_arena_save(pmalloc_arena *arena);
+void    pmalloc_arena_restore(pmalloc_arena *arena , pmalloc_arena_mark mark);
+size_t  pmalloc_arena_memory(void);
+void   *pmalloc_large(size_t size , int flags);
+void    pfree_large(void *ptr);
+int     pmalloc_large_backing(void *ptr);
+int     pmalloc_large_node(void *ptr);
+void    pmalloc_set_watermarks(size_t soft , size_t hard);
+pmalloc_watermark_proc *pmalloc_set_watermark_handler(pmalloc_watermark_proc *handler);
+int     pmalloc_memory_level(void);
+void    pmalloc_set_profile_rate(size_t bytes);
+int     pmalloc_dump_profile(const char *path);
+int     pmalloc_dump_sites(const char *path);
+
+/* In profiling builds every call tags the allocation with its call site,
+ * a static structure per __FILE__:__LINE__, through pmalloc_cursite. */
+#if defined(PMALLOC_PROFILE) && !defined(PMALLOC_INTERNAL)
+extern __thread pmalloc_site *pmalloc_cursite;
+
+#define PMALLOC_SITE ({ \
+    static pmalloc_site __pmalloc_site = { __FILE__ , __LINE__ }; \
+    &__pmalloc_site; })
+
+#define pmalloc(size)       (pmalloc_cursite = PMALLOC_SITE , pmalloc(size))
+#define pcalloc(size)       (pmalloc_cursite = PMALLOC_SITE , pcalloc(size))
+#define prealloc(ptr, size) (pmalloc_cursite = PMALLOC_SITE , prealloc(ptr , size))
+#define pstrdup(s)          (pmalloc_cursite = PMALLOC_SITE , pstrdup(s))
+#endif
 
 #endif
 
@@ -0,0 +1,547 @@
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ptalloc.h"
+
+/* Thread caching, size class allocator.
+ *
+ * Sizes up to PTALLOC_MAX_SMALL are rounded up to one of PTALLOC_CLASSES
+ * size classes, multiples of 16 spaced at most 25% apart, and carved from
+ * spans of PTALLOC_SPAN bytes taken from an address range reserved once.
+ * Objects carry no header: the span of an object, found by shifting its
+ * offset in the range, tells its class and the thread cache that carved
+ * it (its owner). Larger sizes go to libc behind a 16 byte header.
+ *
+ * Every thread allocates from and frees to its own cache, a free list per
+ * class, without locks. The caches exchange objects in three ways:
+ *
+ * - A thread freeing an object of a span owned by another cache pushes it
+ *   on that cache's remote list of the class with compare and swap. The
+ *   owner takes the whole list at once, when its own list runs dry. This
+ *   is the path of loops handing requests or messages to each other: the
+ *   memory flows back to the thread allocating it. Past twice the batch
+ *   size the thread freeing moves the whole list to the central list, so
+ *   that an owner which stopped allocating strands no more than that.
+ *
+ * - A cache holding more than twice the batch size of a class moves one
+ *   batch to the central list of the class, one lock per batch, and a
+ *   cache running dry takes a batch back from there before carving a new
+ *   span. It becomes the owner of the spans it takes objects from, so
+ *   that it frees them to itself: the owner only routes the frees and
+ *   any cache may hold objects of any span.
+ *
+ * - A thread exiting moves all it holds to the central lists, and leaves
+ *   its cache to the next thread created, so that objects of its spans
+ *   still find an owner. Until then caches running dry take what other
+ *   threads keep freeing to it.
+ *
+ * The central list of a class is a list of its spans with free objects,
+ * each with its own free list, so that it knows when all the objects of
+ * a span are back. That span leaves the class for a list of empty spans
+ * any class carves from, and past PTALLOC_KEEP_SPANS empty spans its
+ * pages are given back with MADV_DONTNEED: memory drifts from class to
+ * class and is released once the live set shrinks, instead of staying
+ * with the class that first needed it. Objects held by thread caches and
+ * remote lists keep their span in use. */
+
+#define PTALLOC_CLASSES    32
+#define PTALLOC_BATCH_MAX  64
+#define PTALLOC_BATCH_MIN  4
+#define PTALLOC_BATCH_BYTES 16384
+#define PTALLOC_HEADER     16
+#define PTALLOC_CACHELINE  64
+#define PTALLOC_KEEP_SPANS 16    /* empty spans kept without releasing them */
+
+typedef struct ptalloc_list {
+    void *head;          /* objects linked through their first word */
+    unsigned int count;
+} ptalloc_list;
+
+typedef struct ptalloc_cache {
+    ptalloc_list local[PTALLOC_CLASSES];
+    size_t large;        /* allocations handed to libc */
+    size_t remotefrees;  /* objects pushed to other caches */
+    struct ptalloc_cache *next;     /* waiting for a thread */
+    struct ptalloc_cache *allnext;  /* all the caches */
+    /* Written by other threads, away from the lists above */
+    void *remote[PTALLOC_CLASSES] __attribute__((aligned(PTALLOC_CACHELINE)));
+    long remotecount[PTALLOC_CLASSES];  /* about the length of remote */
+} ptalloc_cache;
+
+typedef struct ptalloc_span {
+    ptalloc_cache *owner;
+    unsigned int cls;
+    unsigned int free;   /* objects on freelist */
+    void *freelist;      /* objects back in the central list */
+    int dirty;           /* empty and not released */
+    struct ptalloc_span *prev , *next;  /* central list of cls , or empty */
+} ptalloc_span;
+
+typedef struct ptalloc_central {
+    pthread_mutex_t lock;
+    ptalloc_span *spans; /* spans of the class with free objects */
+    size_t count;
+    size_t batches;      /* batches moved in */
+} __attribute__((aligned(PTALLOC_CACHELINE))) ptalloc_central;
+
+static const unsigned int ptalloc_class_size[PTALLOC_CLASSES] = {
+    16 , 32 , 48 , 64 , 80 , 96 , 112 , 128 ,
+    160 , 192 , 224 , 256 , 320 , 384 , 448 , 512 ,
+    640 , 768 , 896 , 1024 , 1280 , 1536 , 1792 , 2048 ,
+    2560 , 3072 , 3584 , 4096 , 5120 , 6144 , 7168 , 8192
+};
+
+/* Class of a size, indexed by size rounded up to 16 bytes */
+static unsigned char ptalloc_class_of[PTALLOC_MAX_SMALL / 16 + 1];
+static unsigned int ptalloc_batch[PTALLOC_CLASSES];
+static ptalloc_central ptalloc_centrals[PTALLOC_CLASSES];
+
+static uintptr_t ptalloc_base = 0;
+static size_t ptalloc_reserved = 0;   /* 0 until the range is reserved */
+static ptalloc_span *ptalloc_spans = NULL;
+static size_t ptalloc_maxspans = 0 , ptalloc_nspans = 0;
+static pthread_mutex_t ptalloc_empty_lock = PTHREAD_MUTEX_INITIALIZER;
+static ptalloc_span *ptalloc_empty = NULL;      /* empty spans , any class */
+static size_t ptalloc_nempty = 0 , ptalloc_released = 0;
+static int ptalloc_ndirty = 0;
+
+static pthread_once_t ptalloc_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ptalloc_key;
+static pthread_mutex_t ptalloc_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static ptalloc_cache *ptalloc_orphans = NULL , *ptalloc_caches = NULL;
+static int ptalloc_ncaches = 0;
+static __thread ptalloc_cache *ptalloc_tc = NULL;
+
+static void ptalloc_cache_exit(void *arg);
+
+static void
+ptalloc_init(void){
+    size_t maxspans = PTALLOC_RESERVE >> PTALLOC_SPAN_SHIFT;
+    unsigned int i , cls = 0;
+    void *region , *spans;
+
+    for(i = 0 ; i <= PTALLOC_MAX_SMALL / 16 ; i++){
+        while(ptalloc_class_size[cls] < i * 16) cls++;
+        ptalloc_class_of[i] = cls;
+    }
+    for(cls = 0 ; cls < PTALLOC_CLASSES ; cls++){
+        unsigned int n = PTALLOC_BATCH_BYTES / ptalloc_class_size[cls];
+
+        if(n > PTALLOC_BATCH_MAX) n = PTALLOC_BATCH_MAX;
+        if(n < PTALLOC_BATCH_MIN) n = PTALLOC_BATCH_MIN;
+        ptalloc_batch[cls] = n;
+        pthread_mutex_init(&ptalloc_centrals[cls].lock , NULL);
+    }
+    pthread_key_create(&ptalloc_key , ptalloc_cache_exit);
+
+    /* Address space only: pages take memory once spans are carved */
+    region = mmap(NULL , PTALLOC_RESERVE + PTALLOC_SPAN , PROT_READ|PROT_WRITE ,
+                  MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE , -1 , 0);
+    spans = mmap(NULL , maxspans * sizeof(ptalloc_span) , PROT_READ|PROT_WRITE ,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE , -1 , 0);
+    if(region == MAP_FAILED || spans == MAP_FAILED){
+        if(region != MAP_FAILED) munmap(region , PTALLOC_RESERVE + PTALLOC_SPAN);
+        if(spans != MAP_FAILED) munmap(spans , maxspans * sizeof(ptalloc_span));
+        return;
+    }
+    ptalloc_base = ((uintptr_t)region + PTALLOC_SPAN - 1) & ~(uintptr_t)(PTALLOC_SPAN - 1);
+    ptalloc_spans = spans;
+    ptalloc_maxspans = maxspans;
+    __atomic_store_n(&ptalloc_reserved , PTALLOC_RESERVE , __ATOMIC_RELEASE);
+}
+
+static ptalloc_cache *
+ptalloc_cache_get(void){
+    ptalloc_cache *tc;
+
+    if(ptalloc_tc) return ptalloc_tc;
+    pthread_once(&ptalloc_once , ptalloc_init);
+    pthread_mutex_lock(&ptalloc_caches_lock);
+    if((tc = ptalloc_orphans) != NULL){
+        ptalloc_orphans = tc->next;
+    } else {
+        if(posix_memalign((void **)&tc , PTALLOC_CACHELINE , sizeof(*tc)) != 0){
+            pthread_mutex_unlock(&ptalloc_caches_lock);
+            return NULL;
+        }
+        memset(tc , 0 , sizeof(*tc));
+        tc->allnext = ptalloc_caches;
+        ptalloc_caches = tc;
+        ptalloc_ncaches++;
+    }
+    pthread_mutex_unlock(&ptalloc_caches_lock);
+    tc->next = NULL;
+    ptalloc_tc = tc;
+    pthread_setspecific(ptalloc_key , tc);
+    return tc;
+}
+
+static inline ptalloc_span *
+ptalloc_span_of(void *ptr){
+    return &ptalloc_spans[((uintptr_t)ptr - ptalloc_base) >> PTALLOC_SPAN_SHIFT];
+}
+
+static inline char *
+ptalloc_span_mem(ptalloc_span *span){
+    return (char *)(ptalloc_base + ((size_t)(span - ptalloc_spans) << PTALLOC_SPAN_SHIFT));
+}
+
+static void
+ptalloc_span_link(ptalloc_span **list , ptalloc_span *span){
+    span->prev = NULL;
+    span->next = *list;
+    if(*list) (*list)->prev = span;
+    *list = span;
+}
+
+static void
+ptalloc_span_unlink(ptalloc_span **list , ptalloc_span *span){
+    if(span->prev) span->prev->next = span->next;
+    else *list = span->next;
+    if(span->next) span->next->prev = span->prev;
+    span->prev = span->next = NULL;
+}
+
+/* An empty span: keep its pages for the next carve , or give them back
+ * once enough are kept. Nothing points into it any more. */
+static void
+ptalloc_span_release(ptalloc_span *span){
+    if(__atomic_add_fetch(&ptalloc_ndirty , 1 , __ATOMIC_RELAXED) > PTALLOC_KEEP_SPANS){
+        __atomic_sub_fetch(&ptalloc_ndirty , 1 , __ATOMIC_RELAXED);
+        madvise(ptalloc_span_mem(span) , PTALLOC_SPAN , MADV_DONTNEED);
+        span->dirty = 0;
+    } else {
+        span->dirty = 1;
+    }
+    span->owner = NULL;
+    pthread_mutex_lock(&ptalloc_empty_lock);
+    if(!span->dirty) ptalloc_released++;
+    ptalloc_span_link(&ptalloc_empty , span);
+    ptalloc_nempty++;
+    pthread_mutex_unlock(&ptalloc_empty_lock);
+}
+
+/* Give n objects linked from head back to their spans */
+static void
+ptalloc_central_push(unsigned int cls , void *head , unsigned int n){
+    ptalloc_central *c = &ptalloc_centrals[cls];
+    unsigned int objs = PTALLOC_SPAN / ptalloc_class_size[cls];
+    ptalloc_span *span , *empty = NULL;
+    void *next;
+
+    pthread_mutex_lock(&c->lock);
+    c->count += n;
+    c->batches++;
+    while(n--){
+        next = *(void **)head;
+        span = ptalloc_span_of(head);
+        *(void **)head = span->freelist;
+        span->freelist = head;
+        if(span->free++ == 0) ptalloc_span_link(&c->spans , span);
+        if(span->free == objs){
+            ptalloc_span_unlink(&c->spans , span);
+            span->freelist = NULL;
+            span->free = 0;
+            c->count -= objs;
+            span->next = empty;
+            empty = span;
+        }
+        head = next;
+    }
+    pthread_mutex_unlock(&c->lock);
+    while((span = empty) != NULL){
+        empty = span->next;
+        ptalloc_span_release(span);
+    }
+}
+
+/* Move one batch of a class to the central list */
+static void
+ptalloc_flush(ptalloc_cache *tc , unsigned int cls){
+    ptalloc_list *l = &tc->local[cls];
+    void *head = l->head , *tail = head;
+    unsigned int n;
+
+    for(n = 1 ; n < ptalloc_batch[cls] ; n++) tail = *(void **)tail;
+    l->head = *(void **)tail;
+    l->count -= n;
+    ptalloc_central_push(cls , head , n);
+}
+
+/* Take the remote list of a class , and its length */
+static void *
+ptalloc_remote_take(ptalloc_cache *tc , unsigned int cls , unsigned int *count){
+    void *head = __atomic_exchange_n(&tc->remote[cls] , NULL , __ATOMIC_ACQUIRE) , *p;
+    unsigned int n = 0;
+
+    for(p = head ; p ; p = *(void **)p) n++;
+    __atomic_sub_fetch(&tc->remotecount[cls] , n , __ATOMIC_RELAXED);
+    *count = n;
+    return head;
+}
+
+/* Link a span of the class, an empty one or a new one, keep a batch and
+ * make the rest central */
+static int
+ptalloc_carve(ptalloc_cache *tc , unsigned int cls){
+    ptalloc_central *c = &ptalloc_centrals[cls];
+    size_t size = ptalloc_class_size[cls] , n = PTALLOC_SPAN / size , i , keep;
+    ptalloc_span *span = NULL;
+    char *mem;
+
+    if(__atomic_load_n(&ptalloc_empty , __ATOMIC_RELAXED) != NULL){
+        pthread_mutex_lock(&ptalloc_empty_lock);
+        if((span = ptalloc_empty) != NULL){
+            ptalloc_span_unlink(&ptalloc_empty , span);
+            ptalloc_nempty--;
+            if(!span->dirty) ptalloc_released--;
+        }
+        pthread_mutex_unlock(&ptalloc_empty_lock);
+        if(span && span->dirty) __atomic_sub_fetch(&ptalloc_ndirty , 1 , __ATOMIC_RELAXED);
+    }
+    if(span == NULL){
+        size_t idx = __atomic_fetch_add(&ptalloc_nspans , 1 , __ATOMIC_RELAXED);
+
+        if(idx >= ptalloc_maxspans) return -1;
+        span = &ptalloc_spans[idx];
+    }
+    span->owner = tc;
+    span->cls = cls;
+    span->dirty = 0;
+    mem = ptalloc_span_mem(span);
+    for(i = 0 ; i < n - 1 ; i++) *(void **)(mem + i * size) = mem + (i + 1) * size;
+    *(void **)(mem + (n - 1) * size) = NULL;
+
+    keep = ptalloc_batch[cls] < n ? ptalloc_batch[cls] : n;
+    tc->local[cls].head = mem;
+    tc->local[cls].count = keep;
+    if(keep < n){
+        *(void **)(mem + (keep - 1) * size) = NULL;
+        pthread_mutex_lock(&c->lock);
+        span->freelist = mem + keep * size;
+        span->free = n - keep;
+        ptalloc_span_link(&c->spans , span);
+        c->count += n - keep;
+        pthread_mutex_unlock(&c->lock);
+    }
+    return 0;
+}
+
+static int
+ptalloc_refill(ptalloc_cache *tc , unsigned int cls){
+    ptalloc_list *l = &tc->local[cls];
+    ptalloc_central *c = &ptalloc_centrals[cls];
+    ptalloc_cache *orphan;
+    ptalloc_span *span;
+    void *head , *p;
+    unsigned int n;
+
+    /* What other threads gave back, without a lock. Objects taken from
+     * the central list come back to the cache that carved them, not the
+     * one that allocated them: past the cache limit they go on to the
+     * central list, or they would pile up here while others carve. */
+    if(__atomic_load_n(&tc->remote[cls] , __ATOMIC_RELAXED) != NULL &&
+       (head = ptalloc_remote_take(tc , cls , &n)) != NULL){
+        l->head = head;
+        l->count = n;
+        while(l->count > 2 * ptalloc_batch[cls]) ptalloc_flush(tc , cls);
+        return 0;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    for(head = NULL , n = 0 ; n < ptalloc_batch[cls] && (span = c->spans) != NULL ; n++){
+        p = span->freelist;
+        span->freelist = *(void **)p;
+        __atomic_store_n(&span->owner , tc , __ATOMIC_RELAXED);
+        if(--span->free == 0) ptalloc_span_unlink(&c->spans , span);
+        *(void **)p = head;
+        head = p;
+    }
+    c->count -= n;
+    pthread_mutex_unlock(&c->lock);
+    if(head){
+        l->head = head;
+        l->count = n;
+        return 0;
+    }
+
+    /* What was freed to caches left by exited threads */
+    if(__atomic_load_n(&ptalloc_orphans , __ATOMIC_RELAXED) != NULL){
+        pthread_mutex_lock(&ptalloc_caches_lock);
+        for(orphan = ptalloc_orphans ; orphan && head == NULL ; orphan = orphan->next)
+            head = ptalloc_remote_take(orphan , cls , &n);
+        pthread_mutex_unlock(&ptalloc_caches_lock);
+    }
+    if(head){
+        l->head = head;
+        l->count = n;
+        while(l->count > 2 * ptalloc_batch[cls]) ptalloc_flush(tc , cls);
+        return 0;
+    }
+    return ptalloc_carve(tc , cls);
+}
+
+static void *
+ptalloc_large(ptalloc_cache *tc , size_t size , int zero){
+    size_t *hdr = zero ? calloc(1 , size + PTALLOC_HEADER) : malloc(size + PTALLOC_HEADER);
+
+    if(hdr == NULL) return NULL;
+    hdr[0] = size;
+    if(tc) tc->large++;
+    return (char *)hdr + PTALLOC_HEADER;
+}
+
+/* Thread exit: hand everything to the central lists, and the cache to
+ * the next thread */
+static void
+ptalloc_cache_exit(void *arg){
+    ptalloc_cache *tc = arg;
+    unsigned int cls;
+
+    for(cls = 0 ; cls < PTALLOC_CLASSES ; cls++){
+        void *head = tc->local[cls].head , *remote;
+        unsigned int n = tc->local[cls].count , nremote;
+
+        if(head) ptalloc_central_push(cls , head , n);
+        if((remote = ptalloc_remote_take(tc , cls , &nremote)) != NULL)
+            ptalloc_central_push(cls , remote , nremote);
+        tc->local[cls].head = NULL;
+        tc->local[cls].count = 0;
+    }
+    ptalloc_tc = NULL;
+    pthread_mutex_lock(&ptalloc_caches_lock);
+    tc->next = ptalloc_orphans;
+    ptalloc_orphans = tc;
+    pthread_mutex_unlock(&ptalloc_caches_lock);
+}
+
+void *
+ptalloc_malloc(size_t size){
+    ptalloc_cache *tc = ptalloc_tc;
+    ptalloc_list *l;
+    unsigned int cls;
+    void *p;
+
+    if(tc == NULL && (tc = ptalloc_cache_get()) == NULL) return ptalloc_large(NULL , size , 0);
+    if(size > PTALLOC_MAX_SMALL) return ptalloc_large(tc , size , 0);
+    cls = ptalloc_class_of[(size + 15) >> 4];
+    l = &tc->local[cls];
+    if(l->head == NULL && ptalloc_refill(tc , cls) == -1) return ptalloc_large(tc , size , 0);
+    p = l->head;
+    l->head = *(void **)p;
+    l->count--;
+    return p;
+}
+
+void *
+ptalloc_calloc(size_t count , size_t size){
+    size_t total = count * size;
+    void *p;
+
+    if(size && total / size != count) return NULL;
+    if(total > PTALLOC_MAX_SMALL) return ptalloc_large(ptalloc_cache_get() , total , 1);
+    if((p = ptalloc_malloc(total)) != NULL) memset(p , 0 , total);
+    return p;
+}
+
+void
+ptalloc_free(void *ptr){
+    uintptr_t off = (uintptr_t)ptr - ptalloc_base;
+    ptalloc_cache *tc = ptalloc_tc , *owner;
+    ptalloc_span *span;
+    ptalloc_list *l;
+
+    if(ptr == NULL) return;
+    if(off >= __atomic_load_n(&ptalloc_reserved , __ATOMIC_RELAXED)){
+        free((char *)ptr - PTALLOC_HEADER);
+        return;
+    }
+    span = &ptalloc_spans[off >> PTALLOC_SPAN_SHIFT];
+    if(tc == NULL) tc = ptalloc_cache_get();
+    owner = __atomic_load_n(&span->owner , __ATOMIC_RELAXED);
+    if(owner != tc){
+        unsigned int cls = span->cls , n;
+        void **remote = &owner->remote[cls];
+        void *old = __atomic_load_n(remote , __ATOMIC_RELAXED);
+
+        do {
+            *(void **)ptr = old;
+        } while(!__atomic_compare_exchange_n(remote , &old , ptr , 1 ,
+                                             __ATOMIC_RELEASE , __ATOMIC_RELAXED));
+        if(tc) tc->remotefrees++;
+        /* The owner may never run dry again: move the list on for it */
+        if(__atomic_add_fetch(&owner->remotecount[cls] , 1 , __ATOMIC_RELAXED) > 2 * ptalloc_batch[cls] &&
+           (old = ptalloc_remote_take(owner , cls , &n)) != NULL)
+            ptalloc_central_push(cls , old , n);
+        return;
+    }
+    l = &tc->local[span->cls];
+    *(void **)ptr = l->head;
+    l->head = ptr;
+    if(++l->count > 2 * ptalloc_batch[span->cls]) ptalloc_flush(tc , span->cls);
+}
+
+size_t
+ptalloc_usable_size(void *ptr){
+    uintptr_t off = (uintptr_t)ptr - ptalloc_base;
+
+    if(off >= __atomic_load_n(&ptalloc_reserved , __ATOMIC_RELAXED))
+        return *(size_t *)((char *)ptr - PTALLOC_HEADER);
+    return ptalloc_class_size[ptalloc_spans[off >> PTALLOC_SPAN_SHIFT].cls];
+}
+
+void *
+ptalloc_realloc(void *ptr , size_t size){
+    uintptr_t off = (uintptr_t)ptr - ptalloc_base;
+    size_t oldsize;
+    void *newptr;
+
+    if(ptr == NULL) return ptalloc_malloc(size);
+    if(off >= __atomic_load_n(&ptalloc_reserved , __ATOMIC_RELAXED) &&
+       size > PTALLOC_MAX_SMALL){
+        size_t *hdr = realloc((char *)ptr - PTALLOC_HEADER , size + PTALLOC_HEADER);
+
+        if(hdr == NULL) return NULL;
+        hdr[0] = size;
+        return (char *)hdr + PTALLOC_HEADER;
+    }
+    oldsize = ptalloc_usable_size(ptr);
+    /* Same class: nothing to move */
+    if(off < ptalloc_reserved && size <= PTALLOC_MAX_SMALL &&
+       ptalloc_class_of[(size + 15) >> 4] == ptalloc_spans[off >> PTALLOC_SPAN_SHIFT].cls)
+        return ptr;
+    if((newptr = ptalloc_malloc(size)) == NULL) return NULL;
+    memcpy(newptr , ptr , oldsize < size ? oldsize : size);
+    ptalloc_free(ptr);
+    return newptr;
+}
+
+void
+ptalloc_get_stats(ptalloc_stats *stats){
+    ptalloc_cache *tc;
+    unsigned int cls;
+
+    memset(stats , 0 , sizeof(*stats));
+    stats->spans = __atomic_load_n(&ptalloc_nspans , __ATOMIC_RELAXED);
+    if(stats->spans > ptalloc_maxspans) stats->spans = ptalloc_maxspans;
+    pthread_mutex_lock(&ptalloc_empty_lock);
+    stats->spans -= ptalloc_nempty;
+    stats->empty = ptalloc_nempty;
+    stats->released = ptalloc_released;
+    pthread_mutex_unlock(&ptalloc_empty_lock);
+    for(cls = 0 ; cls < PTALLOC_CLASSES ; cls++){
+        pthread_mutex_lock(&ptalloc_centrals[cls].lock);
+        stats->central += ptalloc_centrals[cls].batches;
+        pthread_mutex_unlock(&ptalloc_centrals[cls].lock);
+    }
+    pthread_mutex_lock(&ptalloc_caches_lock);
+    for(tc = ptalloc_caches ; tc ; tc = tc->allnext){
+        stats->large += tc->large;
+        stats->remote += tc->remotefrees;
+    }
+    stats->caches = ptalloc_ncaches;
+    pthread_mutex_unlock(&ptalloc_caches_lock);
+}
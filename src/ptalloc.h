@@ -0,0 +1,37 @@
+#ifndef __PTALLOC_H__
+#define __PTALLOC_H__
+
+#include <stddef.h>
+
+/* Thread caching allocator behind pmalloc, built with -DUSE_PTALLOC.
+ * See ptalloc.c */
+
+/* Objects are carved from spans of this size, aligned on it */
+#define PTALLOC_SPAN_SHIFT 16
+#define PTALLOC_SPAN       (1 << PTALLOC_SPAN_SHIFT)
+
+/* Largest size served from size classes, libc serves the rest */
+#define PTALLOC_MAX_SMALL  8192
+
+/* Address space reserved for spans at the first allocation. Only the
+ * spans in use take memory, once it is exhausted libc serves all sizes */
+#define PTALLOC_RESERVE    (4ULL << 30)
+
+typedef struct ptalloc_stats {
+    size_t spans;        /* spans holding objects of a class */
+    size_t empty;        /* spans waiting for any class */
+    size_t released;     /* empty spans whose pages went back to the system */
+    size_t large;        /* allocations handed to libc */
+    size_t central;      /* batches moved to the central lists */
+    size_t remote;       /* objects freed by another thread than their owner */
+    int caches;          /* thread caches, alive or waiting for a thread */
+} ptalloc_stats;
+
+void   *ptalloc_malloc(size_t size);
+void   *ptalloc_calloc(size_t count , size_t size);
+void   *ptalloc_realloc(void *ptr , size_t size);
+void    ptalloc_free(void *ptr);
+size_t  ptalloc_usable_size(void *ptr);
+void    ptalloc_get_stats(ptalloc_stats *stats);
+
+#endif